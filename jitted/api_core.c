@@ -3,9 +3,11 @@ The functions in this file are used to implement the self-hosted
 Zeta parser and JIT compiler
 */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "util.h"
 #include "interp.h"
 #include "api_core.h"
@@ -21,14 +23,91 @@ bool is_string(tag_t tag)
     return tag == TAG_STRING;
 }
 
+bool is_map(tag_t tag)
+{
+    return tag == TAG_MAP;
+}
+
+bool is_strbuf(tag_t tag)
+{
+    return tag == TAG_STRBUF;
+}
+
+/// Standard output buffer, shared by stdio and the print functions
+char out_buf[OUT_BUF_SIZE];
+
+/**
+Give standard output a large buffer, line buffered on a terminal
+All output, including interpreter messages written with printf,
+goes through this one buffer and so keeps its order. This must be
+called before anything is written to standard output.
+*/
+void init_output()
+{
+    int mode = isatty(STDOUT_FILENO)? _IOLBF:_IOFBF;
+    setvbuf(stdout, out_buf, mode, OUT_BUF_SIZE);
+}
+
+/**
+Write the buffered output to standard output
+*/
+void print_flush()
+{
+    fflush(stdout);
+}
+
+/**
+Append bytes to the output buffer
+The VM is single-threaded, so stdout doesn't need to be locked
+*/
+void print_bytes(const char* data, size_t len)
+{
+    fwrite_unlocked(data, 1, len, stdout);
+}
+
+/**
+Format an integer in decimal at the end of a buffer of at least 20
+characters. Returns a pointer to the first character.
+*/
+char* format_int64(int64_t value, char* end)
+{
+    // Format the digits backwards, the magnitude is taken as unsigned
+    // so that the most negative value has no overflow
+    char* p = end;
+    uint64_t mag = (value < 0)? -(uint64_t)value:(uint64_t)value;
+
+    do
+    {
+        *--p = '0' + mag % 10;
+        mag /= 10;
+    } while (mag != 0);
+
+    if (value < 0)
+        *--p = '-';
+
+    return p;
+}
+
 void print_int64(int64_t value)
 {
-    printf("%ld", value);
+    char buf[24];
+    char* p = format_int64(value, buf + sizeof(buf));
+    print_bytes(p, buf + sizeof(buf) - p);
 }
 
 void print_string(string_t* string)
 {
-    printf("%s", string_cstr(string));
+    print_bytes(string->data, string->len);
+}
+
+void print_strbuf(strbuf_t* sb)
+{
+    print_bytes(sb->buf, sb->len);
+}
+
+void print_newline()
+{
+    putc_unlocked('\n', stdout);
 }
 
 int64_t string_get_charcode(string_t* string, int64_t index)
@@ -39,20 +118,169 @@ int64_t string_get_charcode(string_t* string, int64_t index)
     return string->data[index];
 }
 
-string_t* core_read_line()
+/**
+Read a line from standard input, returns false at the end of the input
+The line is copied from the input buffer into a data string directly
+*/
+value_t core_read_line()
+{
+    size_t len;
+    const char* line = read_line_buf(&len);
+
+    if (line == NULL)
+        return VAL_FALSE;
+
+    string_t* str = string_from_bytes(line, len);
+
+    return value_from_heapptr((heapptr_t)str, TAG_STRING);
+}
+
+/**
+Read a file into a string, returns false if the file can't be read
+The contents are copied once, from the mapped file into the string
+*/
+value_t core_read_file(string_t* file_name)
+{
+    print_flush();
+
+    file_view_t view;
+
+    if (!file_view_open(&view, string_cstr(file_name)))
+        return VAL_FALSE;
+
+    string_t* str = string_from_bytes(view.data, view.len);
+
+    file_view_close(&view);
+
+    return value_from_heapptr((heapptr_t)str, TAG_STRING);
+}
+
+map_t* core_map_new()
+{
+    return map_alloc(0);
+}
+
+/**
+Get the value associated with a key, or false if there is none
+*/
+value_t core_map_get(map_t* map, value_t key)
+{
+    value_t val;
+    return map_get(map, key, &val)? val:VAL_FALSE;
+}
+
+void core_map_set(map_t* map, value_t key, value_t val)
+{
+    map_set(map, key, val);
+}
+
+int64_t core_map_size(map_t* map)
 {
-    char* buf = read_line();
-    string_t* str = vm_get_cstr(buf);
-    free(buf);
-    return str;
+    return map->len;
 }
 
-string_t* core_read_file(string_t* file_name)
+/**
+Iterate over the slots of a map holding keys, starting from the
+index after a given one. Returns -1 once all keys were visited.
+Iteration starts at index -1.
+*/
+int64_t core_map_next(map_t* map, int64_t idx)
+{
+    uint32_t next = map_next(map, (uint32_t)(idx + 1));
+    return (next < map->cap)? (int64_t)next:-1;
+}
+
+/**
+Check that a map index, as returned by $map_next, holds a key
+*/
+void check_map_idx(map_t* map, int64_t idx)
 {
-    char* buf = read_file(string_cstr(file_name));
-    string_t* str = vm_get_cstr(buf);
-    free(buf);
-    return str;
+    if (idx < 0 || idx >= map->cap || (map->ctrl[idx] & 0x80))
+    {
+        printf("invalid map index %ld\n", idx);
+        exit(-1);
+    }
+}
+
+value_t core_map_key(map_t* map, int64_t idx)
+{
+    check_map_idx(map, idx);
+    return map->slots[idx].key;
+}
+
+value_t core_map_val(map_t* map, int64_t idx)
+{
+    check_map_idx(map, idx);
+    return map->slots[idx].val;
+}
+
+/**
+Get the substring between a start index and an end index (excluded)
+The substring is a view into the string, nothing is copied
+*/
+string_t* core_string_slice(string_t* str, int64_t start, int64_t end)
+{
+    if (start < 0 || end < start || end > str->len)
+    {
+        printf("invalid slice bounds [%ld, %ld) for string of length %d\n", start, end, str->len);
+        exit(-1);
+    }
+
+    return string_slice(str, start, end - start);
+}
+
+int64_t core_string_index_of(string_t* str, string_t* needle, int64_t from)
+{
+    if (from < 0)
+        from = 0;
+
+    return string_index_of(str, needle, (from > str->len)? str->len + 1:from);
+}
+
+/**
+Check that a separator or search string is not empty
+*/
+void check_nonempty(string_t* str, const char* fn_name)
+{
+    if (str->len == 0)
+    {
+        printf("empty string argument in call to %s\n", fn_name);
+        exit(-1);
+    }
+}
+
+int64_t core_string_count(string_t* str, string_t* needle)
+{
+    check_nonempty(needle, "string_count");
+    return string_count(str, needle);
+}
+
+array_t* core_string_split(string_t* str, string_t* sep)
+{
+    check_nonempty(sep, "string_split");
+    return string_split(str, sep);
+}
+
+strbuf_t* core_strbuf_new()
+{
+    return strbuf_alloc(0);
+}
+
+void core_strbuf_append(strbuf_t* sb, string_t* str)
+{
+    strbuf_append(sb, str->data, str->len);
+}
+
+void core_strbuf_append_int64(strbuf_t* sb, int64_t value)
+{
+    char buf[24];
+    char* p = format_int64(value, buf + sizeof(buf));
+    strbuf_append(sb, p, buf + sizeof(buf) - p);
+}
+
+int64_t core_strbuf_length(strbuf_t* sb)
+{
+    return sb->len;
 }
 
 // TODO: function to allocate an executable memory block
@@ -70,15 +298,44 @@ array_t* init_api_core()
     // Type tests
     add_fn(fns, &is_int64, "is_int64", "bool(tag)");
     add_fn(fns, &is_string, "is_string", "bool(tag)");
+    add_fn(fns, &is_map, "is_map", "bool(tag)");
+    add_fn(fns, &is_strbuf, "is_strbuf", "bool(tag)");
 
     // Misc
     add_fn(fns, &string_get_charcode, "string_get_charcode", "int64(string, int64)");
 
+    // Substrings
+    add_fn(fns, &core_string_slice, "string_slice", "string(string, int64, int64)");
+    add_fn(fns, &core_string_index_of, "string_index_of", "int64(string, string, int64)");
+    add_fn(fns, &string_starts_with, "string_starts_with", "bool(string, string)");
+    add_fn(fns, &core_string_count, "string_count", "int64(string, string)");
+    add_fn(fns, &core_string_split, "string_split", "array(string, string)");
+
     // Basic string I/O
     add_fn(fns, &print_int64, "print_int64", "void(int64)");
     add_fn(fns, &print_string, "print_string", "void(string)");
-    add_fn(fns, &core_read_line, "read_line", "string()");
-    add_fn(fns, &core_read_file, "read_file", "string(string)");
+    add_fn(fns, &print_newline, "print_newline", "void()");
+    add_fn(fns, &core_read_line, "read_line", "value()");
+    add_fn(fns, &core_read_file, "read_file", "value(string)");
+
+    // String builders
+    add_fn(fns, &core_strbuf_new, "strbuf_new", "strbuf()");
+    add_fn(fns, &core_strbuf_append, "strbuf_append", "void(strbuf, string)");
+    add_fn(fns, &core_strbuf_append_int64, "strbuf_append_int64", "void(strbuf, int64)");
+    add_fn(fns, &core_strbuf_length, "strbuf_length", "int64(strbuf)");
+    add_fn(fns, &strbuf_to_string, "strbuf_to_string", "string(strbuf)");
+    add_fn(fns, &print_strbuf, "print_strbuf", "void(strbuf)");
+
+    // Hash maps
+    add_fn(fns, &core_map_new, "map_new", "map()");
+    add_fn(fns, &core_map_get, "map_get", "value(map, value)");
+    add_fn(fns, &core_map_set, "map_set", "void(map, value, value)");
+    add_fn(fns, &map_has, "map_has", "bool(map, value)");
+    add_fn(fns, &map_delete, "map_delete", "bool(map, value)");
+    add_fn(fns, &core_map_size, "map_size", "int64(map)");
+    add_fn(fns, &core_map_next, "map_next", "int64(map, int64)");
+    add_fn(fns, &core_map_key, "map_key", "value(map, int64)");
+    add_fn(fns, &core_map_val, "map_val", "value(map, int64)");
 
     // C stdlib
     add_fn(fns, &malloc, "malloc", "void*(size_t)");
@@ -3,6 +3,12 @@
 
 #include "vm.h"
 
+/// Size of the standard output buffer
+#define OUT_BUF_SIZE (1 << 16)
+
+void init_output();
+void print_flush();
+
 array_t* init_api_core();
 
 #endif
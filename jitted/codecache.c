@@ -0,0 +1,438 @@
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "codecache.h"
+#include "parser.h"
+#include "vm.h"
+
+/// Maximum number of bytes of code kept in the cache
+size_t codecache_limit = CODECACHE_SIZE;
+
+/// Code cache counters
+codecache_stats_t codecache_stats;
+
+/// Number of calls into compiled code made from the interpreter which
+/// have not returned yet
+uint32_t codecache_depth = 0;
+
+/// Executable memory area
+uint8_t* codecache_start = NULL;
+
+/**
+Span of free memory in the executable area
+*/
+typedef struct free_span
+{
+    uint8_t* start;
+    size_t size;
+
+    /// Next span, in order of increasing address
+    struct free_span* next;
+
+} free_span_t;
+
+/// Free spans, sorted by address
+free_span_t* codecache_free = NULL;
+
+/// Code in the cache, oldest first
+jit_code_t* codecache_head = NULL;
+jit_code_t* codecache_tail = NULL;
+
+/// Evicted code whose memory was not reclaimed yet
+jit_code_t* codecache_evicted = NULL;
+
+void init_codecache()
+{
+    void* mem = mmap(
+        NULL,
+        CODECACHE_SIZE,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    // Without executable memory, everything stays interpreted
+    if (mem == MAP_FAILED)
+        return;
+
+    codecache_start = mem;
+
+    codecache_free = malloc(sizeof(free_span_t));
+    codecache_free->start = mem;
+    codecache_free->size = CODECACHE_SIZE;
+    codecache_free->next = NULL;
+}
+
+/**
+Test if executable memory is available
+*/
+bool codecache_ready()
+{
+    return codecache_start != NULL;
+}
+
+/**
+Allocate memory from the first free span large enough
+*/
+uint8_t* codecache_alloc_mem(size_t size)
+{
+    for (free_span_t** link = &codecache_free; *link; link = &(*link)->next)
+    {
+        free_span_t* span = *link;
+
+        if (span->size < size)
+            continue;
+
+        uint8_t* mem = span->start;
+        span->start += size;
+        span->size -= size;
+
+        if (span->size == 0)
+        {
+            *link = span->next;
+            free(span);
+        }
+
+        return mem;
+    }
+
+    return NULL;
+}
+
+/**
+Return memory to the free spans, coalescing it with its neighbors
+*/
+void codecache_free_mem(uint8_t* mem, size_t size)
+{
+    free_span_t* prev = NULL;
+    free_span_t* next = codecache_free;
+    while (next && next->start < mem)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    free_span_t* span;
+    if (prev && prev->start + prev->size == mem)
+    {
+        span = prev;
+        span->size += size;
+    }
+    else
+    {
+        span = malloc(sizeof(free_span_t));
+        span->start = mem;
+        span->size = size;
+        span->next = next;
+
+        if (prev)
+            prev->next = span;
+        else
+            codecache_free = span;
+    }
+
+    if (next && span->start + span->size == next->start)
+    {
+        span->size += next->size;
+        span->next = next->next;
+        free(next);
+    }
+
+    // Give back the pages which became entirely free. Only the pages
+    // overlapping the memory freed could have been in use until now.
+    uintptr_t page_mask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    uintptr_t lo = ((uintptr_t)span->start + ~page_mask) & page_mask;
+    uintptr_t hi = ((uintptr_t)span->start + span->size) & page_mask;
+    uintptr_t mem_lo = (uintptr_t)mem & page_mask;
+    uintptr_t mem_hi = ((uintptr_t)mem + size + ~page_mask) & page_mask;
+
+    if (lo < mem_lo)
+        lo = mem_lo;
+    if (hi > mem_hi)
+        hi = mem_hi;
+
+    if (lo < hi)
+    {
+        madvise((void*)lo, hi - lo, MADV_DONTNEED);
+        codecache_stats.bytes_released += hi - lo;
+    }
+}
+
+/**
+Remove the entry point of a piece of code from its function
+*/
+void codecache_unlink(jit_code_t* code)
+{
+    ast_fun_t* fun = code->fun;
+
+    if (code->stmt_idx == 0)
+    {
+        if (fun->jit_entry == code->start)
+        {
+            fun->jit_entry = NULL;
+            fun->num_calls = 0;
+        }
+    }
+    else if (fun->osr_entries[code->stmt_idx] == code->start)
+    {
+        fun->osr_entries[code->stmt_idx] = NULL;
+    }
+}
+
+/**
+Free the memory and metadata of a piece of code
+*/
+void codecache_release(jit_code_t* code)
+{
+    codecache_free_mem(code->start, code->size);
+    codecache_stats.bytes_used -= code->size;
+
+    for (deopt_info_t* info = code->deopts; info;)
+    {
+        deopt_info_t* next = info->next;
+        free(info);
+        info = next;
+    }
+
+    free(code);
+}
+
+/**
+Evict code removed from the cache queue
+Its memory is reclaimed later if compiled code is running, since the
+evicted code could have frames on the stack
+*/
+void codecache_evict(jit_code_t* code)
+{
+    codecache_unlink(code);
+
+    if (codecache_depth == 0)
+    {
+        codecache_release(code);
+    }
+    else
+    {
+        code->next = codecache_evicted;
+        codecache_evicted = code;
+    }
+}
+
+/**
+Reclaim the memory of evicted code
+This must only be called when no compiled code is running
+*/
+void codecache_reclaim()
+{
+    assert (codecache_depth == 0);
+
+    while (codecache_evicted)
+    {
+        jit_code_t* code = codecache_evicted;
+        codecache_evicted = code->next;
+        codecache_release(code);
+    }
+}
+
+/**
+Remove the next piece of code to evict from the cache queue
+Code entered since the last sweep gets a second chance
+*/
+jit_code_t* codecache_pick()
+{
+    while (codecache_head)
+    {
+        jit_code_t* code = codecache_head;
+        codecache_head = code->next;
+        if (codecache_head == NULL)
+            codecache_tail = NULL;
+        code->next = NULL;
+
+        if (!code->used)
+            return code;
+
+        code->used = 0;
+
+        if (codecache_tail)
+            codecache_tail->next = code;
+        else
+            codecache_head = code;
+        codecache_tail = code;
+    }
+
+    return NULL;
+}
+
+/**
+Allocate memory for a piece of code and add it to the cache
+Cold code is evicted to make room if needed
+Returns false if no memory could be allocated
+*/
+bool codecache_add(jit_code_t* code, size_t size)
+{
+    // Keep entry points aligned
+    size = (size + 15) & ~((size_t)15);
+
+    if (codecache_start == NULL)
+        return false;
+
+    if (codecache_depth == 0)
+        codecache_reclaim();
+
+    size_t evicted = 0;
+
+    for (;;)
+    {
+        if (codecache_stats.bytes_used + size <= codecache_limit)
+        {
+            code->start = codecache_alloc_mem(size);
+            if (code->start)
+                break;
+        }
+
+        jit_code_t* victim = codecache_pick();
+        if (victim == NULL)
+            return false;
+
+        // Evicted functions wait longer before being compiled again
+        evicted += victim->size;
+        victim->fun->num_evictions++;
+        codecache_stats.num_evicted++;
+        codecache_evict(victim);
+
+        // While compiled code is running, the memory of evicted code
+        // is only reclaimed later, the next attempt will succeed
+        if (codecache_depth > 0 && evicted >= size)
+            return false;
+    }
+
+    code->size = size;
+    code->used = 0;
+    code->next = NULL;
+
+    if (codecache_tail)
+        codecache_tail->next = code;
+    else
+        codecache_head = code;
+    codecache_tail = code;
+
+    codecache_stats.bytes_used += size;
+    codecache_stats.num_added++;
+
+    return true;
+}
+
+/**
+Evict all the code compiled from a given function
+*/
+void codecache_invalidate(ast_fun_t* fun)
+{
+    jit_code_t* prev = NULL;
+
+    for (jit_code_t** link = &codecache_head; *link;)
+    {
+        jit_code_t* code = *link;
+
+        if (code->fun != fun)
+        {
+            prev = code;
+            link = &code->next;
+            continue;
+        }
+
+        *link = code->next;
+        if (codecache_tail == code)
+            codecache_tail = prev;
+
+        codecache_stats.num_invalidated++;
+        codecache_evict(code);
+    }
+}
+
+jit_code_t* test_codecache_add(ast_fun_t* fun, size_t size)
+{
+    jit_code_t* code = calloc(1, sizeof(jit_code_t));
+    code->fun = fun;
+
+    if (!codecache_add(code, size))
+    {
+        free(code);
+        return NULL;
+    }
+
+    memset(code->start, 0xC3, size);
+    fun->jit_entry = code->start;
+
+    return code;
+}
+
+void test_codecache()
+{
+    printf("code cache tests\n");
+
+    if (codecache_start == NULL)
+        return;
+
+    size_t limit = codecache_limit;
+    codecache_stats_t stats = codecache_stats;
+    size_t used = stats.bytes_used;
+
+    ast_fun_t* funs[4];
+    jit_code_t* codes[4];
+    for (size_t i = 0; i < 4; ++i)
+        funs[i] = parse_check_error(parse_string("1", "codecache_test"));
+
+    // Sizes are rounded up to keep entry points aligned
+    for (size_t i = 0; i < 3; ++i)
+    {
+        codes[i] = test_codecache_add(funs[i], 100);
+        assert (codes[i] != NULL);
+        assert (((uintptr_t)codes[i]->start & 15) == 0);
+        assert (codes[i]->size == 112);
+    }
+    assert (codecache_stats.bytes_used == used + 3 * 112);
+    assert (codes[1]->start == codes[0]->start + 112);
+
+    // The first code was entered, the second gets evicted instead
+    codecache_limit = codecache_stats.bytes_used;
+    codes[0]->used = 1;
+    uint8_t* start = codes[1]->start;
+    codes[3] = test_codecache_add(funs[3], 112);
+    assert (codes[3] != NULL);
+    assert (codes[3]->start == start);
+    assert (funs[1]->jit_entry == NULL);
+    assert (funs[0]->jit_entry != NULL);
+    assert (codecache_stats.num_evicted == stats.num_evicted + 1);
+
+    // Evicted code can not be reclaimed while compiled code runs
+    codecache_depth = 1;
+    codecache_invalidate(funs[0]);
+    assert (funs[0]->jit_entry == NULL);
+    assert (codecache_stats.bytes_used == used + 3 * 112);
+    assert (test_codecache_add(funs[1], 112) == NULL);
+    assert (funs[2]->jit_entry == NULL);
+    assert (codecache_stats.bytes_used == used + 3 * 112);
+    codecache_depth = 0;
+    codecache_reclaim();
+    assert (codecache_stats.bytes_used == used + 112);
+    assert (codecache_stats.num_evicted == stats.num_evicted + 2);
+
+    codecache_invalidate(funs[3]);
+    assert (funs[3]->jit_entry == NULL);
+    assert (codecache_stats.bytes_used == used);
+    assert (codecache_stats.num_invalidated == stats.num_invalidated + 2);
+
+    // Free memory gets coalesced and returned to the system
+    codecache_limit = limit;
+    if (used == 0)
+    {
+        assert (codecache_free->start == codecache_start);
+        assert (codecache_free->size == CODECACHE_SIZE);
+        assert (codecache_free->next == NULL);
+        assert (codecache_stats.bytes_released > stats.bytes_released);
+    }
+}
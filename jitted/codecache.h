@@ -0,0 +1,99 @@
+/**
+Bounded cache for compiled machine code
+
+Compiled code is allocated in a fixed executable memory area, using a
+first-fit free list which coalesces free spans. Memory pages which become
+entirely free are given back to the operating system.
+
+When the cache is full, or holds more code than its size limit, code is
+evicted using the clock (second chance) algorithm: compiled code sets a
+flag each time it is entered, and code which has not been entered since
+the last sweep is evicted. Code invalidated by repeated deoptimizations
+is evicted right away.
+
+Evicted code can still have frames on the stack. Its memory is reclaimed
+once no call into compiled code made from the interpreter is active.
+*/
+
+#ifndef __CODECACHE_H__
+#define __CODECACHE_H__
+
+#include "parser.h"
+#include "ir.h"
+
+/// Default size limit of the code cache, and size of the executable area
+#define CODECACHE_SIZE (1 << 24)
+
+/**
+Piece of compiled code held in the cache
+*/
+typedef struct jit_code
+{
+    /// Function this code was compiled from
+    ast_fun_t* fun;
+
+    /// Statement resumed by an on-stack replacement entry point,
+    /// zero for the regular entry point
+    uint32_t stmt_idx;
+
+    /// Machine code
+    uint8_t* start;
+    size_t size;
+
+    /// Set when the code is entered, cleared by eviction sweeps
+    uint64_t used;
+
+    /// Deoptimization metadata referenced by the code
+    deopt_info_t* deopts;
+
+    /// Next code in the cache queue or the list of evicted code
+    struct jit_code* next;
+
+} jit_code_t;
+
+/**
+Code cache counters
+*/
+typedef struct
+{
+    /// Bytes of code memory currently allocated, including evicted
+    /// code which could not be reclaimed yet
+    size_t bytes_used;
+
+    /// Number of pieces of code added to the cache
+    uint64_t num_added;
+
+    /// Number of pieces of code evicted to make room for new code
+    uint64_t num_evicted;
+
+    /// Number of pieces of code invalidated by deoptimizations
+    uint64_t num_invalidated;
+
+    /// Bytes of memory returned to the operating system
+    size_t bytes_released;
+
+} codecache_stats_t;
+
+/// Maximum number of bytes of code kept in the cache
+extern size_t codecache_limit;
+
+/// Code cache counters
+extern codecache_stats_t codecache_stats;
+
+/// Number of calls into compiled code made from the interpreter which
+/// have not returned yet
+extern uint32_t codecache_depth;
+
+void init_codecache();
+
+bool codecache_ready();
+
+bool codecache_add(jit_code_t* code, size_t size);
+
+void codecache_invalidate(ast_fun_t* fun);
+
+void codecache_reclaim();
+
+void test_codecache();
+
+#endif
@@ -1,7 +1,10 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <sys/param.h>
+#include <sys/wait.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #ifdef BSD4_4
     #include <stdlib.h>
 #else
@@ -11,12 +14,26 @@
 #include "interp.h"
 #include "parser.h"
 #include "api_core.h"
+#include "jit.h"
+#include "codecache.h"
 
 /// Shape indices for mutable cells, closures and host function wrappers
 shapeidx_t SHAPE_CELL;
 shapeidx_t SHAPE_CLOS;
 shapeidx_t SHAPE_HOSTFN;
 
+/// Interpreter stack, current segment and top of the stack
+stack_seg_t* stack_seg = NULL;
+value_t* stack_sp = NULL;
+
+/// Frame of the current interpreted call
+frame_t* stack_fp = NULL;
+
+/// Argument values of a call in tail position, kept here while the frame
+/// of the caller is popped (see eval_loop)
+value_t* tail_args = NULL;
+size_t tail_args_cap = 0;
+
 /**
 Initialize the interpreter
 */
@@ -25,6 +42,13 @@ void init_interp()
     SHAPE_CELL = shape_alloc_empty()->idx;
     SHAPE_CLOS = shape_alloc_empty()->idx;
     SHAPE_HOSTFN = shape_alloc_empty()->idx;
+
+    // Continuations and frame headers are stored in stack slots
+    assert (sizeof(kont_t) == sizeof(value_t));
+    assert (sizeof(frame_t) <= sizeof(value_t) * FRAME_SLOTS);
+
+    stack_seg = stack_seg_alloc(STACK_SEG_SLOTS);
+    stack_sp = stack_seg->slots;
 }
 
 /**
@@ -61,11 +85,9 @@ void init_runtime()
         array_prepend_obj(exprs, assg);
     }
 
-    // Resolve all variables in the global unit
-    var_res_pass(unit_fun, NULL);
-
     // Initialize the global unit
-    // This returns a closure which captures all global variables
+    // Its variables are resolved to slots in the global table
+    vm.global_fun = unit_fun;
     value_t global_clos = eval_unit(unit_fun);
     assert (global_clos.tag == TAG_CLOS);
 
@@ -83,7 +105,7 @@ cell_t* cell_alloc()
 clos_t* clos_alloc(ast_fun_t* fun)
 {
     clos_t* clos = (clos_t*)vm_alloc(
-        sizeof(clos_t) + sizeof(cell_t*) * fun->free_vars->len,
+        sizeof(clos_t) + sizeof(value_t) * fun->free_vars->len,
         SHAPE_STRING
     );
 
@@ -92,6 +114,291 @@ clos_t* clos_alloc(ast_fun_t* fun)
     return clos;
 }
 
+/**
+Get the closure of a function without free variables
+Closures which capture nothing are all alike, so a single closure is
+allocated per function expression. Evaluating the same function
+expression repeatedly thus produces identical closures, which compare
+equal with ==.
+*/
+clos_t* clos_shared(ast_fun_t* fun)
+{
+    assert (fun->free_vars->len == 0);
+
+    if (fun->shared_clos == NULL)
+        fun->shared_clos = clos_alloc(fun);
+
+    return fun->shared_clos;
+}
+
+/**
+Parse a type name in a host function signature string
+*/
+uint8_t hostfn_parse_type(const char* str, size_t len, const char* sig_str)
+{
+    static const struct { const char* name; uint8_t type; } types[] = {
+        { "void", HOST_VOID },
+        { "bool", HOST_BOOL },
+        { "tag", HOST_TAG },
+        { "int", HOST_INT32 },
+        { "int64", HOST_INT64 },
+        { "size_t", HOST_SIZE },
+        { "float64", HOST_FLOAT64 },
+        { "string", HOST_STRING },
+        { "void*", HOST_PTR },
+        { "map", HOST_MAP },
+        { "strbuf", HOST_STRBUF },
+        { "array", HOST_ARRAY },
+        { "value", HOST_VALUE }
+    };
+
+    // Trim the whitespace around the type name
+    while (len > 0 && *str == ' ')
+    {
+        str++;
+        len--;
+    }
+    while (len > 0 && str[len - 1] == ' ')
+        len--;
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+    {
+        if (strlen(types[i].name) == len && strncmp(types[i].name, str, len) == 0)
+            return types[i].type;
+    }
+
+    printf("unsupported type in host function signature \"%s\"\n", sig_str);
+    exit(-1);
+}
+
+/// C types host function parameters are passed as: integers and
+/// pointers as 64-bit words (W), float64 (F) and tagged values (V)
+#define HOST_CT_W int64_t
+#define HOST_CT_F double
+#define HOST_CT_V value_t
+
+/// Argument values passed for each parameter class
+#define HOST_ARG_W(i) a[i].word.int64
+#define HOST_ARG_F(i) a[i].word.float64
+#define HOST_ARG_V(i) a[i]
+
+/// Codes of the parameter classes, packed 2 bits per parameter into
+/// the pattern code of a signature (see host_pattern)
+#define HOST_PC_W 1
+#define HOST_PC_F 2
+#define HOST_PC_V 3
+
+/// C parameter type lists, argument lists and pattern codes for each
+/// number of parameters
+#define HOST_PARAMS0() void
+#define HOST_PARAMS1(c0) HOST_CT_##c0
+#define HOST_PARAMS2(c0, c1) HOST_PARAMS1(c0), HOST_CT_##c1
+#define HOST_PARAMS3(c0, c1, c2) HOST_PARAMS2(c0, c1), HOST_CT_##c2
+#define HOST_PARAMS4(c0, c1, c2, c3) HOST_PARAMS3(c0, c1, c2), HOST_CT_##c3
+#define HOST_PARAMS5(c0, c1, c2, c3, c4) HOST_PARAMS4(c0, c1, c2, c3), HOST_CT_##c4
+#define HOST_PARAMS6(c0, c1, c2, c3, c4, c5) HOST_PARAMS5(c0, c1, c2, c3, c4), HOST_CT_##c5
+#define HOST_PARAMS7(c0, c1, c2, c3, c4, c5, c6) HOST_PARAMS6(c0, c1, c2, c3, c4, c5), HOST_CT_##c6
+#define HOST_PARAMS8(c0, c1, c2, c3, c4, c5, c6, c7) HOST_PARAMS7(c0, c1, c2, c3, c4, c5, c6), HOST_CT_##c7
+
+#define HOST_ARGS0()
+#define HOST_ARGS1(c0) HOST_ARG_##c0(0)
+#define HOST_ARGS2(c0, c1) HOST_ARGS1(c0), HOST_ARG_##c1(1)
+#define HOST_ARGS3(c0, c1, c2) HOST_ARGS2(c0, c1), HOST_ARG_##c2(2)
+#define HOST_ARGS4(c0, c1, c2, c3) HOST_ARGS3(c0, c1, c2), HOST_ARG_##c3(3)
+#define HOST_ARGS5(c0, c1, c2, c3, c4) HOST_ARGS4(c0, c1, c2, c3), HOST_ARG_##c4(4)
+#define HOST_ARGS6(c0, c1, c2, c3, c4, c5) HOST_ARGS5(c0, c1, c2, c3, c4), HOST_ARG_##c5(5)
+#define HOST_ARGS7(c0, c1, c2, c3, c4, c5, c6) HOST_ARGS6(c0, c1, c2, c3, c4, c5), HOST_ARG_##c6(6)
+#define HOST_ARGS8(c0, c1, c2, c3, c4, c5, c6, c7) HOST_ARGS7(c0, c1, c2, c3, c4, c5, c6), HOST_ARG_##c7(7)
+
+#define HOST_PATTERN0() 0
+#define HOST_PATTERN1(c0) HOST_PC_##c0
+#define HOST_PATTERN2(c0, c1) (HOST_PATTERN1(c0) | HOST_PC_##c1 << 2)
+#define HOST_PATTERN3(c0, c1, c2) (HOST_PATTERN2(c0, c1) | HOST_PC_##c2 << 4)
+#define HOST_PATTERN4(c0, c1, c2, c3) (HOST_PATTERN3(c0, c1, c2) | HOST_PC_##c3 << 6)
+#define HOST_PATTERN5(c0, c1, c2, c3, c4) (HOST_PATTERN4(c0, c1, c2, c3) | HOST_PC_##c4 << 8)
+#define HOST_PATTERN6(c0, c1, c2, c3, c4, c5) (HOST_PATTERN5(c0, c1, c2, c3, c4) | HOST_PC_##c5 << 10)
+#define HOST_PATTERN7(c0, c1, c2, c3, c4, c5, c6) (HOST_PATTERN6(c0, c1, c2, c3, c4, c5) | HOST_PC_##c6 << 12)
+#define HOST_PATTERN8(c0, c1, c2, c3, c4, c5, c6, c7) (HOST_PATTERN7(c0, c1, c2, c3, c4, c5, c6) | HOST_PC_##c7 << 14)
+
+/**
+Parameter patterns of the host functions which can be called, as the
+name of their trampoline, the number of parameters and their classes.
+Any return type goes with any pattern. Signatures taking only integers
+and pointers are supported up to HOSTFN_MAX_PARAMS parameters, those
+taking float64 or tagged values need a pattern of their own.
+*/
+#define HOST_PATTERNS(X)                        \
+    X(void, 0, ())                              \
+    X(W, 1, (W))                                \
+    X(WW, 2, (W, W))                            \
+    X(WWW, 3, (W, W, W))                        \
+    X(WWWW, 4, (W, W, W, W))                    \
+    X(WWWWW, 5, (W, W, W, W, W))                \
+    X(WWWWWW, 6, (W, W, W, W, W, W))            \
+    X(WWWWWWW, 7, (W, W, W, W, W, W, W))        \
+    X(WWWWWWWW, 8, (W, W, W, W, W, W, W, W))    \
+    X(WV, 2, (W, V))                            \
+    X(WVV, 3, (W, V, V))                        \
+    X(WFWF, 4, (W, F, W, F))                    \
+    X(WVFW, 4, (W, V, F, W))
+
+/// Host function pointer cast to the C type of a return type and
+/// parameter pattern
+#define HOST_FN(ret_t, num_params, classes) \
+    ((ret_t (*)(HOST_PARAMS##num_params classes))fn->fptr)
+
+/**
+Trampolines calling host functions with a given parameter pattern,
+returning the value of the call as a tagged value. Integer return
+values narrower than 64 bits are read through their own C type.
+*/
+#define HOST_TRAMP(name, num_params, classes)                                   \
+value_t host_call_##name(hostfn_t* fn, value_t* a)                              \
+{                                                                               \
+    (void)a;                                                                    \
+    value_t val;                                                                \
+    val.tag = fn->ret_tag;                                                      \
+                                                                                \
+    switch (fn->ret_type)                                                       \
+    {                                                                           \
+        case HOST_VOID:                                                         \
+        HOST_FN(void, num_params, classes)(HOST_ARGS##num_params classes);      \
+        return VAL_TRUE;                                                        \
+                                                                                \
+        case HOST_BOOL:                                                         \
+        if (HOST_FN(bool, num_params, classes)(HOST_ARGS##num_params classes))  \
+            return VAL_TRUE;                                                    \
+        return VAL_FALSE;                                                       \
+                                                                                \
+        case HOST_INT32:                                                        \
+        val.word.int64 = HOST_FN(int32_t, num_params, classes)(                 \
+            HOST_ARGS##num_params classes                                       \
+        );                                                                      \
+        return val;                                                             \
+                                                                                \
+        case HOST_INT64:                                                        \
+        case HOST_SIZE:                                                         \
+        val.word.int64 = HOST_FN(int64_t, num_params, classes)(                 \
+            HOST_ARGS##num_params classes                                       \
+        );                                                                      \
+        return val;                                                             \
+                                                                                \
+        case HOST_FLOAT64:                                                      \
+        val.word.float64 = HOST_FN(double, num_params, classes)(                \
+            HOST_ARGS##num_params classes                                       \
+        );                                                                      \
+        return val;                                                             \
+                                                                                \
+        case HOST_VALUE:                                                        \
+        return HOST_FN(value_t, num_params, classes)(                           \
+            HOST_ARGS##num_params classes                                       \
+        );                                                                      \
+                                                                                \
+        default:                                                                \
+        val.word.heapptr = HOST_FN(void*, num_params, classes)(                 \
+            HOST_ARGS##num_params classes                                       \
+        );                                                                      \
+        return val;                                                             \
+    }                                                                           \
+}
+
+HOST_PATTERNS(HOST_TRAMP)
+
+/**
+Get the pattern code of the parameter types of a host function
+*/
+uint32_t host_pattern(uint8_t* param_types, uint32_t num_params)
+{
+    uint32_t pattern = 0;
+
+    for (uint32_t i = 0; i < num_params; ++i)
+    {
+        uint32_t code = HOST_PC_W;
+        if (param_types[i] == HOST_FLOAT64)
+            code = HOST_PC_F;
+        if (param_types[i] == HOST_VALUE)
+            code = HOST_PC_V;
+
+        pattern |= code << (2 * i);
+    }
+
+    return pattern;
+}
+
+/// Case of host_tramp for a parameter pattern
+#define HOST_TRAMP_CASE(name, num_params, classes)  \
+    case HOST_PATTERN##num_params classes:          \
+    return &host_call_##name;
+
+/**
+Get the trampoline for a parameter pattern code, NULL if not supported
+*/
+host_tramp_t host_tramp(uint32_t pattern)
+{
+    switch (pattern)
+    {
+        HOST_PATTERNS(HOST_TRAMP_CASE)
+
+        default:
+        return NULL;
+    }
+}
+
+/**
+Test if host functions with a given signature can be called
+*/
+bool host_sig_supported(uint8_t ret_type, uint8_t* param_types, uint32_t num_params)
+{
+    // Type tags are only taken as parameters
+    if (ret_type == HOST_TAG)
+        return false;
+
+    return host_tramp(host_pattern(param_types, num_params)) != NULL;
+}
+
+/**
+Get the tag of the heap objects passed as a given host function type,
+and the name of the type
+*/
+tag_t hostfn_obj_tag(uint8_t type, const char** type_name)
+{
+    switch (type)
+    {
+        case HOST_STRING:
+        *type_name = "string";
+        return TAG_STRING;
+
+        case HOST_MAP:
+        *type_name = "map";
+        return TAG_MAP;
+
+        case HOST_STRBUF:
+        *type_name = "strbuf";
+        return TAG_STRBUF;
+
+        default:
+        assert (type == HOST_ARRAY);
+        *type_name = "array";
+        return TAG_ARRAY;
+    }
+}
+
+/**
+Test if a host function type is that of a heap object
+*/
+bool hostfn_is_obj(uint8_t type)
+{
+    return (
+        type == HOST_STRING || type == HOST_MAP ||
+        type == HOST_STRBUF || type == HOST_ARRAY
+    );
+}
+
+/**
+Allocate a host function wrapper
+The signature string, of the form "ret(param, param, ...)", is parsed
+here once, calls only look at the parsed types (see call_host)
+*/
 hostfn_t* hostfn_alloc(void* fptr, const char* name, const char* sig_str)
 {
     hostfn_t* fn = (hostfn_t*)vm_alloc(
@@ -99,62 +406,75 @@ hostfn_t* hostfn_alloc(void* fptr, const char* name, const char* sig_str)
         SHAPE_HOSTFN
     );
 
-    size_t num_params = 0;
+    const char* open = strchr(sig_str, '(');
+    const char* close = strrchr(sig_str, ')');
 
-    // Parse the signature string with a state machine
-    #define STATE_RET   0
-    #define STATE_OPEN  1
-    #define STATE_PARAM 2
-    #define STATE_COMMA 3
-    #define STATE_CLOSE 4
-    int state = STATE_RET;
-    size_t param_len = 0;
-    for (size_t i = 0; state != STATE_CLOSE; i++)
+    if (open == NULL || close == NULL || close < open || close[1] != '\0')
     {
-        char c = sig_str[i];
+        printf("invalid host function signature \"%s\"\n", sig_str);
+        exit(-1);
+    }
 
-        switch (state)
-        {
-            // Reading the return type
-            case STATE_RET:
-            assert (c != '\0');
-            if (c == '(')
-                state = STATE_OPEN;
-            break;
+    fn->ret_type = hostfn_parse_type(sig_str, open - sig_str, sig_str);
+    fn->obj_params = 0;
+    fn->conv_params = 0;
 
-            // Just read the opening parenthesis
-            case STATE_OPEN:
-            assert (c != '\0' && c != ',');
-            if (c == ')')
-                state = STATE_CLOSE;
-            else
-            {
-                state = STATE_PARAM;
-                num_params++;
-            }
-            break;
+    uint32_t num_params = 0;
 
-            // Just read a character of a parameter
-            case STATE_PARAM:
-            assert (c != '\0');
-            if (c == ',')
-                state = STATE_COMMA;
-            else if (c == ')')
-                state = STATE_CLOSE;
-            break;
+    for (const char* param = open + 1; param < close;)
+    {
+        const char* end = param;
+        while (end < close && *end != ',')
+            end++;
 
-            // Just read a comma
-            case STATE_COMMA:
-            assert (c != ',' && c != ')' && c != '\0');
-            state = STATE_PARAM;
-            num_params++;
-            break;
+        uint8_t type = hostfn_parse_type(param, end - param, sig_str);
 
-            default:
-            assert (false);
+        if (type == HOST_VOID || num_params == HOSTFN_MAX_PARAMS)
+        {
+            printf("unsupported host function signature \"%s\"\n", sig_str);
+            exit(-1);
         }
+
+        if (hostfn_is_obj(type))
+            fn->obj_params |= 1 << num_params;
+        if (type == HOST_TAG || type == HOST_BOOL || type == HOST_INT32)
+            fn->conv_params |= 1 << num_params;
+
+        fn->param_types[num_params++] = type;
+        param = (end < close)? end + 1:end;
+    }
+
+    if (!host_sig_supported(fn->ret_type, fn->param_types, num_params))
+    {
+        printf("unsupported host function signature \"%s\"\n", sig_str);
+        exit(-1);
+    }
+
+    const char* type_name;
+    switch (fn->ret_type)
+    {
+        case HOST_INT32:
+        case HOST_INT64:
+        case HOST_SIZE:
+        fn->ret_tag = TAG_INT64;
+        break;
+
+        case HOST_FLOAT64:
+        fn->ret_tag = TAG_FLOAT64;
+        break;
+
+        case HOST_PTR:
+        fn->ret_tag = TAG_RAW_PTR;
+        break;
+
+        default:
+        fn->ret_tag = TAG_BOOL;
+        if (hostfn_is_obj(fn->ret_type))
+            fn->ret_tag = hostfn_obj_tag(fn->ret_type, &type_name);
     }
 
+    fn->tramp = host_tramp(host_pattern(fn->param_types, num_params));
+
     fn->name = vm_get_cstr(name);
     fn->sig_str = vm_get_cstr(sig_str);
     fn->num_params = num_params;
@@ -415,6 +735,14 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
         assert (decl->fun != NULL);
         ref->decl = decl;
 
+        // Global variables are accessed directly through their slot,
+        // they are never captured
+        if (decl->global)
+        {
+            ref->idx = decl->idx;
+            return;
+        }
+
         // If the variable is from this scope
         if (decl->fun == fun)
         {
@@ -457,6 +785,34 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
 
         var_res(binop->left_expr, fun);
         var_res(binop->right_expr, fun);
+
+        // Count the assignments to each variable
+        if (binop->op == &OP_ASSIGN)
+        {
+            shapeidx_t lhs_shape = get_shape(binop->left_expr);
+
+            if (lhs_shape == SHAPE_AST_DECL)
+                ((ast_decl_t*)binop->left_expr)->num_assigns++;
+            if (lhs_shape == SHAPE_AST_REF)
+            {
+                ast_decl_t* decl = ((ast_ref_t*)binop->left_expr)->decl;
+                decl->num_assigns++;
+
+                // Compiled code may have read the global as a constant,
+                // when it was only assigned by its declaration
+                if (decl->global && decl->cst_deps)
+                {
+                    for (uint32_t i = 0; i < decl->cst_deps->len; ++i)
+                    {
+                        ast_fun_t* dep = array_get(decl->cst_deps, i).word.fun;
+                        codecache_invalidate(dep);
+                    }
+
+                    decl->cst_deps = NULL;
+                }
+            }
+        }
+
         return;
     }
 
@@ -507,14 +863,128 @@ void var_res(heapptr_t expr, ast_fun_t* fun)
     assert (false);
 }
 
+/**
+Find the local variables of a function which get captured by closures
+before they are assigned, following the evaluation order
+Since there are no loops, a variable can only change after it has been
+captured if it is assigned after the capture in evaluation order
+*/
+void find_early_capts(heapptr_t expr, ast_fun_t* fun)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+        for (size_t i = 0; i < array_expr->len; ++i)
+            find_early_capts(array_get_ptr(array_expr, i), fun);
+
+        return;
+    }
+
+    if (shape == SHAPE_AST_OBJ)
+    {
+        ast_obj_t* obj_expr = (ast_obj_t*)expr;
+        for (size_t i = 0; i < obj_expr->val_exprs->len; ++i)
+            find_early_capts(array_get_ptr(obj_expr->val_exprs, i), fun);
+
+        return;
+    }
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        if (binop->op != &OP_ASSIGN)
+        {
+            find_early_capts(binop->left_expr, fun);
+            find_early_capts(binop->right_expr, fun);
+            return;
+        }
+
+        // The value assigned is evaluated first
+        find_early_capts(binop->right_expr, fun);
+
+        shapeidx_t lhs_shape = get_shape(binop->left_expr);
+
+        if (lhs_shape == SHAPE_AST_DECL)
+            ((ast_decl_t*)binop->left_expr)->assigned = true;
+        else if (lhs_shape == SHAPE_AST_REF)
+            ((ast_ref_t*)binop->left_expr)->decl->assigned = true;
+        else
+            find_early_capts(binop->left_expr, fun);
+
+        return;
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        find_early_capts(((ast_unop_t*)expr)->expr, fun);
+        return;
+    }
+
+    if (shape == SHAPE_AST_SEQ)
+    {
+        array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
+        for (size_t i = 0; i < expr_list->len; ++i)
+            find_early_capts(array_get_ptr(expr_list, i), fun);
+
+        return;
+    }
+
+    if (shape == SHAPE_AST_IF)
+    {
+        ast_if_t* ifexpr = (ast_if_t*)expr;
+        find_early_capts(ifexpr->test_expr, fun);
+        find_early_capts(ifexpr->then_expr, fun);
+        find_early_capts(ifexpr->else_expr, fun);
+        return;
+    }
+
+    // Closures capture the locals of this function when created
+    if (shape == SHAPE_AST_FUN)
+    {
+        ast_fun_t* nested = (ast_fun_t*)expr;
+
+        for (size_t i = 0; i < nested->free_vars->len; ++i)
+        {
+            ast_decl_t* decl = array_get(nested->free_vars, i).word.decl;
+
+            if (decl->fun == fun && !decl->assigned)
+                decl->capt_early = true;
+        }
+
+        return;
+    }
+
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        find_early_capts(callexpr->fun_expr, fun);
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+            find_early_capts(array_get_ptr(arg_exprs, i), fun);
+
+        return;
+    }
+}
+
 /**
 Resolve variables in a given function
+
+Escaping variables which are assigned at most once, before any closure
+captures them, can not change once captured. These are copied into the
+closures rather than held in mutable cells. The variables of the global
+unit are never captured, they live in the global slot table.
 */
 void var_res_pass(ast_fun_t* fun, ast_fun_t* parent)
 {
     fun->parent = parent;
 
     // Add the function parameters to the local scope
+    // Parameters are assigned by calls
     for (size_t i = 0; i < fun->param_decls->len; ++i)
     {
         find_decls(
@@ -522,13 +992,77 @@ void var_res_pass(ast_fun_t* fun, ast_fun_t* parent)
             fun
         );
         assert (array_get(fun->param_decls, i).word.decl->fun == fun);
+
+        ast_decl_t* decl = array_get(fun->param_decls, i).word.decl;
+        decl->num_assigns++;
+        decl->assigned = true;
     }
 
     // Find declarations in the function body
     find_decls(fun->body_expr, fun);
 
+    // The variables of the global unit are stored in the global slot
+    // table rather than on the stack, so that all units and closures
+    // can access them directly by index
+    if (fun == vm.global_fun)
+    {
+        assert (vm.global_slots == NULL);
+        vm.num_globals = fun->local_decls->len;
+        vm.global_slots = malloc(sizeof(value_t) * MAX(vm.num_globals, 1));
+
+        for (size_t i = 0; i < fun->local_decls->len; ++i)
+        {
+            ast_decl_t* decl = array_get(fun->local_decls, i).word.decl;
+            decl->global = true;
+            vm.global_slots[decl->idx] = VAL_FALSE;
+        }
+    }
+
     // Resolve variable references
     var_res(fun->body_expr, fun);
+
+    // Copy the captured variables which can not change into closures
+    if (parent != NULL && fun->esc_locals->len > 0)
+    {
+        find_early_capts(fun->body_expr, fun);
+
+        array_t* esc_locals = array_alloc(fun->esc_locals->len);
+
+        for (size_t i = 0; i < fun->esc_locals->len; ++i)
+        {
+            ast_decl_t* decl = array_get(fun->esc_locals, i).word.decl;
+
+            if (decl->num_assigns <= 1 && !decl->capt_early)
+                decl->esc = false;
+            else
+                array_append_obj(esc_locals, (heapptr_t)decl);
+        }
+
+        fun->esc_locals = esc_locals;
+    }
+
+    // The free variables are all known now, compute where their cells
+    // are found when a closure of this function is created
+    free(fun->capt_map);
+    fun->capt_map = malloc(sizeof(uint32_t) * MAX(fun->free_vars->len, 1));
+
+    for (size_t i = 0; i < fun->free_vars->len; ++i)
+    {
+        ast_decl_t* decl = array_get(fun->free_vars, i).word.decl;
+        assert (parent != NULL);
+
+        if (decl->fun == parent)
+        {
+            assert (decl->esc);
+            fun->capt_map[i] = CAPT_LOCAL | decl->idx;
+        }
+        else
+        {
+            uint32_t free_idx = array_indexof_ptr(parent->free_vars, (heapptr_t)decl);
+            assert (free_idx < parent->free_vars->len);
+            fun->capt_map[i] = free_idx;
+        }
+    }
 }
 
 /**
@@ -550,7 +1084,8 @@ bool eval_truth(value_t value)
 }
 
 /**
-Evaluate an assignment of a value to an expression
+Evaluate an assignment of a value to a variable
+Assignments to members are evaluated by eval_loop
 */
 value_t eval_assign(
     heapptr_t lhs_expr,
@@ -566,6 +1101,13 @@ value_t eval_assign(
     {
         ast_decl_t* decl = (ast_decl_t*)lhs_expr;
 
+        // Global variables are stored in the global slot table
+        if (decl->global)
+        {
+            vm.global_slots[decl->idx] = val;
+            return val;
+        }
+
         // If this an escaping variable
         if (decl->esc)
         {
@@ -589,11 +1131,21 @@ value_t eval_assign(
         ast_ref_t* ref = (ast_ref_t*)lhs_expr;
         assert (ref->decl != NULL);
 
+        // Global variables are stored in the global slot table
+        if (ref->decl->global)
+        {
+            assert (ref->idx < vm.num_globals);
+            vm.global_slots[ref->idx] = val;
+            return val;
+        }
+
         // If this is a variable from an outer function
+        // Variables assigned by nested functions are always in cells
         if (ref->decl->fun != clos->fun)
         {
             assert (ref->idx < clos->fun->free_vars->len);
-            cell_t* cell = clos->cells[ref->idx];
+            assert (ref->decl->esc);
+            cell_t* cell = clos->vals[ref->idx].word.cell;
 
             cell->word = val.word;
             cell->tag = val.tag;
@@ -625,39 +1177,6 @@ value_t eval_assign(
         return val;
     }
 
-    // Binary operator (e.g. a.b)
-    if (shape == SHAPE_AST_BINOP)
-    {
-        ast_binop_t* binop = (ast_binop_t*)lhs_expr;
-
-        value_t v0 = eval_expr(binop->left_expr, clos, locals);
-        value_t v1 = eval_expr(binop->right_expr, clos, locals);
-
-        if (binop->op == &OP_MEMBER)
-        {
-            if (v0.tag != TAG_OBJECT)
-            {
-                printf("non-object base in property write\n");
-                exit(-1);
-            }
-
-            if (v1.tag != TAG_STRING)
-            {
-                printf("non-string property name in property write\n");
-                exit(-1);
-            }
-
-            object_set_prop(
-                v0.word.object,
-                v1.word.string,
-                val,
-                ATTR_DEFAULT
-            );
-
-            return val;
-        }
-    }
-
     printf("invalid lhs expression in assignment\n");
     exit(-1);
 }
@@ -691,11 +1210,9 @@ value_t eval_get_index(
 
     if (base.tag == TAG_STRING)
     {
-        char ch = base.word.string->data[idx];
+        uint8_t ch = base.word.string->data[idx];
 
-        char buf[] = { ch, '\0' };
-        string_t* char_str = vm_get_cstr(buf);
-        return value_from_heapptr((heapptr_t)char_str, TAG_STRING);
+        return value_from_heapptr((heapptr_t)vm.char_strs[ch], TAG_STRING);
     }
 
     printf(
@@ -718,7 +1235,8 @@ value_t eval_get_prop(
         exit(-1);
     }
 
-    string_t* name_str = prop_name.word.string;
+    // Property names are interned, data strings are interned on demand
+    string_t* name_str = vm_get_tbl_str(prop_name.word.string);
 
     if (base.tag == TAG_OBJECT)
     {
@@ -749,487 +1267,1151 @@ value_t eval_get_prop(
 }
 
 /**
-Evaluate a function call
+Evaluate a property write
 */
-value_t eval_call(
-    clos_t* callee,
-    array_t* arg_exprs,
-    clos_t* caller,
-    value_t* caller_locals
+value_t eval_set_prop(
+    value_t base,
+    value_t prop_name,
+    value_t val
 )
 {
-    ast_fun_t* fptr = callee->fun;
-    assert (fptr != NULL);
-
-    if (arg_exprs->len != fptr->param_decls->len)
+    if (base.tag != TAG_OBJECT)
     {
-        printf("argument count mismatch\n");
+        printf("non-object base in property write\n");
         exit(-1);
     }
 
-    // Allocate space for the local variables
-    value_t* callee_locals = alloca(
-        sizeof(value_t) * fptr->local_decls->len
-    );
-
+    if (prop_name.tag != TAG_STRING)
+    {
+        printf("non-string property name in property write\n");
+        exit(-1);
+    }
+
+    object_set_prop(
+        base.word.object,
+        vm_get_tbl_str(prop_name.word.string),
+        val,
+        ATTR_DEFAULT
+    );
+
+    return val;
+}
+
+/**
+Evaluate a binary operator, other than assignment, on operand values
+*/
+value_t eval_binop(
+    const opinfo_t* op,
+    value_t v0,
+    value_t v1
+)
+{
+    int64_t i0 = v0.word.int64;
+    int64_t i1 = v1.word.int64;
+    string_t* s0 = v0.word.string;
+    string_t* s1 = v1.word.string;
+
+    if (op == &OP_MEMBER)
+        return eval_get_prop(v0, v1);
+
+    if (op == &OP_INDEX)
+        return eval_get_index(v0, v1);
+
+    if (op == &OP_ADD)
+        return value_from_int64(i0 + i1);
+    if (op == &OP_SUB)
+        return value_from_int64(i0 - i1);
+    if (op == &OP_MUL)
+        return value_from_int64(i0 * i1);
+    if (op == &OP_DIV)
+        return value_from_int64(i0 / i1);
+    if (op == &OP_MOD)
+        return value_from_int64(i0 % i1);
+
+    if (op == &OP_LT)
+        return (i0 < i1)? VAL_TRUE:VAL_FALSE;
+
+    if (op == &OP_LE)
+    {
+        if (v0.tag == TAG_STRING && v1.tag == TAG_STRING)
+            return (string_compare(s0, s1) <= 0)? VAL_TRUE:VAL_FALSE;
+        if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+            return (i0 <= i1)? VAL_TRUE:VAL_FALSE;
+        assert (false);
+    }
+
+    if (op == &OP_GT)
+        return (i0 > i1)? VAL_TRUE:VAL_FALSE;
+
+    if (op == &OP_GE)
+    {
+        if (v0.tag == TAG_STRING && v1.tag == TAG_STRING)
+            return (string_compare(s0, s1) >= 0)? VAL_TRUE:VAL_FALSE;
+        if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
+            return (i0 >= i1)? VAL_TRUE:VAL_FALSE;
+        assert (false);
+    }
+
+    if (op == &OP_EQ)
+        return value_equals(v0, v1)? VAL_TRUE:VAL_FALSE;
+    if (op == &OP_NE)
+        return value_equals(v0, v1)? VAL_FALSE:VAL_TRUE;
+
+    printf("unimplemented binary operator: %s\n", op->str);
+    return VAL_FALSE;
+}
+
+/**
+Evaluate a unary operator on an operand value
+*/
+value_t eval_unop(
+    const opinfo_t* op,
+    value_t v0
+)
+{
+    if (op == &OP_NEG)
+        return value_from_int64(-v0.word.int64);
+
+    if (op == &OP_NOT)
+        return eval_truth(v0)? VAL_FALSE:VAL_TRUE;
+
+    printf("unimplemented unary operator: %s\n", op->str);
+    return VAL_FALSE;
+}
+
+/**
+Allocate a segment of the interpreter stack
+*/
+stack_seg_t* stack_seg_alloc(size_t num_slots)
+{
+    stack_seg_t* seg = malloc(sizeof(stack_seg_t) + sizeof(value_t) * num_slots);
+
+    if (seg == NULL)
+    {
+        printf("out of memory for the interpreter stack\n");
+        exit(-1);
+    }
+
+    seg->prev = NULL;
+    seg->next = NULL;
+    seg->prev_sp = NULL;
+    seg->limit = seg->slots + num_slots;
+
+    return seg;
+}
+
+/**
+Free a stack segment and the spare segments following it
+*/
+void stack_seg_free(stack_seg_t* seg)
+{
+    while (seg)
+    {
+        stack_seg_t* next = seg->next;
+        free(seg);
+        seg = next;
+    }
+}
+
+/**
+Make room for a number of contiguous slots on top of the stack
+If the current segment is too full, the stack continues in the next one
+Returns the top of the stack
+*/
+value_t* stack_reserve(size_t num_slots)
+{
+    if (stack_sp + num_slots <= stack_seg->limit)
+        return stack_sp;
+
+    stack_seg_t* next = stack_seg->next;
+
+    if (next && next->limit < next->slots + num_slots)
+    {
+        stack_seg_free(next);
+        next = NULL;
+    }
+
+    if (next == NULL)
+    {
+        next = stack_seg_alloc(MAX(num_slots, STACK_SEG_SLOTS));
+        next->prev = stack_seg;
+        stack_seg->next = next;
+    }
+
+    next->prev_sp = stack_sp;
+    stack_seg = next;
+    stack_sp = next->slots;
+
+    return stack_sp;
+}
+
+/**
+Reset the top of the stack to a position saved earlier
+One spare segment is kept after the current one, the others are freed
+*/
+void stack_restore(stack_seg_t* seg, value_t* sp)
+{
+    // Usually the top of the stack stays in the current segment
+    if (seg == stack_seg && sp > seg->slots)
+    {
+        stack_sp = sp;
+        return;
+    }
+
+    // Empty segments are left for the previous segment
+    while (sp == seg->slots && seg->prev)
+    {
+        sp = seg->prev_sp;
+        seg = seg->prev;
+    }
+
+    stack_seg = seg;
+    stack_sp = sp;
+
+    if (seg->next && seg->next->next)
+    {
+        stack_seg_free(seg->next->next);
+        seg->next->next = NULL;
+    }
+}
+
+/**
+Pop a number of slots off the top of the stack
+*/
+void stack_pop(size_t num_slots)
+{
+    assert (stack_sp >= stack_seg->slots + num_slots);
+    stack_restore(stack_seg, stack_sp - num_slots);
+}
+
+/**
+Get the continuation on top of the stack
+*/
+kont_t* stack_top_kont()
+{
+    assert (stack_sp > stack_seg->slots);
+    return (kont_t*)(stack_sp - 1);
+}
+
+/**
+Get the number of stack slots a continuation needs for an AST node,
+including the values it saves
+*/
+size_t kont_size(heapptr_t node)
+{
+    shapeidx_t shape = get_shape(node);
+
+    if (shape == SHAPE_AST_CALL)
+        return ((ast_call_t*)node)->arg_exprs->len + 2;
+
+    if (shape == SHAPE_AST_BINOP)
+        return (((ast_binop_t*)node)->op == &OP_ASSIGN)? 3:2;
+
+    if (shape == SHAPE_ARRAY || shape == SHAPE_AST_OBJ)
+        return 2;
+
+    return 1;
+}
+
+/**
+Push a continuation, resuming an AST node once its child number idx
+has been evaluated, along with the values saved by the node
+*/
+void kont_push(heapptr_t node, uint32_t idx, value_t* vals, uint32_t num_vals)
+{
+    assert (num_vals < kont_size(node));
+
+    value_t* slots = stack_reserve(kont_size(node));
+    memcpy(slots, vals, sizeof(value_t) * num_vals);
+
+    kont_t* kont = (kont_t*)(slots + num_vals);
+    kont->node = node;
+    kont->idx = idx;
+
+    stack_sp = slots + num_vals + 1;
+}
+
+/**
+Replace the continuation on top of the stack by a value saved by its
+node, and push the continuation for the next child of the node
+*/
+void kont_save(kont_t* kont, value_t val)
+{
+    heapptr_t node = kont->node;
+    uint32_t idx = kont->idx;
+
+    *(value_t*)kont = val;
+
+    kont = (kont_t*)stack_sp++;
+    assert (stack_sp <= stack_seg->limit);
+    kont->node = node;
+    kont->idx = idx + 1;
+}
+
+/**
+Push a frame for a call to a closure
+The frame ends with a continuation for a NULL node, which returns
+from the call. Local variable slots are initialized to false.
+*/
+frame_t* frame_push(clos_t* clos, uint32_t num_locals, heapptr_t ret_node)
+{
+    stack_seg_t* seg = stack_seg;
+    value_t* sp = stack_sp;
+
+    value_t* slots = stack_reserve(FRAME_SLOTS + num_locals + 1);
+
+    frame_t* frame = (frame_t*)slots;
+    frame->clos = clos;
+    frame->locals = slots + FRAME_SLOTS;
+    frame->prev = stack_fp;
+    frame->ret_node = ret_node;
+    frame->ret_seg = seg;
+    frame->ret_sp = sp;
+
+    for (size_t i = 0; i < num_locals; ++i)
+        frame->locals[i] = VAL_FALSE;
+
+    kont_t* kont = (kont_t*)(frame->locals + num_locals);
+    kont->node = NULL;
+    kont->idx = 0;
+
+    stack_sp = (value_t*)(kont + 1);
+    stack_fp = frame;
+
+    return frame;
+}
+
+/**
+Pop the frame of the current call off the stack
+*/
+void frame_pop()
+{
+    frame_t* frame = stack_fp;
+    stack_fp = frame->prev;
+    stack_restore(frame->ret_seg, frame->ret_sp);
+}
+
+/**
+Push the frame of an interpreted call to a closure, allocating the cells
+of its escaping variables and assigning the arguments to its parameters
+*/
+void frame_enter(clos_t* callee, value_t* arg_vals, heapptr_t ret_node)
+{
+    ast_fun_t* fptr = callee->fun;
+
+    frame_t* frame = frame_push(callee, fptr->local_decls->len, ret_node);
+    value_t* locals = frame->locals;
+
     // Allocate mutable cells for the escaping variables
     for (size_t i = 0; i < fptr->esc_locals->len; ++i)
     {
         ast_decl_t* decl = array_get(fptr->esc_locals, i).word.decl;
         assert (decl->esc);
         assert (decl->idx < fptr->local_decls->len);
-        callee_locals[decl->idx] = value_from_obj((heapptr_t)cell_alloc());
+        locals[decl->idx] = value_from_obj((heapptr_t)cell_alloc());
     }
 
-    // Evaluate the argument values
-    for (size_t i = 0; i < arg_exprs->len; ++i)
+    // Assign the argument values to the parameters, parameters which
+    // don't escape are stored in their stack slot directly
+    for (size_t i = 0; i < fptr->param_decls->len; ++i)
     {
-        //printf("evaluating arg %ld\n", i);
+        ast_decl_t* decl = array_get(fptr->param_decls, i).word.decl;
 
-        heapptr_t param_decl = array_get_ptr(fptr->param_decls, i);
+        if (decl->esc)
+            eval_assign((heapptr_t)decl, arg_vals[i], callee, locals);
+        else
+            locals[decl->idx] = arg_vals[i];
+    }
+}
 
-        // Evaluate the parameter value
-        value_t arg_val = eval_expr(
-            array_get_ptr(arg_exprs, i),
-            caller,
-            caller_locals
-        );
+/**
+Check the argument count of a call to a closure, and get the entry point
+of its compiled code. The function gets compiled once it has been called
+often enough. Returns NULL if the call is to be interpreted.
+*/
+void* call_entry(clos_t* callee, uint32_t num_args)
+{
+    ast_fun_t* fptr = callee->fun;
+    assert (fptr != NULL);
 
-        // Assign the value to the parameter
-        eval_assign(
-            param_decl,
-            arg_val,
-            callee,
-            callee_locals
-        );
+    if (num_args != fptr->param_decls->len)
+    {
+        printf("argument count mismatch\n");
+        exit(-1);
     }
 
-    // Evaluate the unit function body in the local frame
-    return eval_expr(fptr->body_expr, callee, callee_locals);
+    if (fptr->jit_entry == NULL &&
+        ++fptr->num_calls == jit_call_threshold(fptr))
+        jit_compile(fptr);
+
+    // Compiled code runs on the native stack, which is limited
+    if (fptr->jit_entry && jit_stack_full())
+        return NULL;
+
+    return fptr->jit_entry;
 }
 
 /**
-Evaluate a host function call
+Call a host function with evaluated argument values
+The function is called by the trampoline of its parameter pattern.
 */
-value_t eval_host_call(
-    hostfn_t* callee,
-    array_t* arg_exprs,
-    clos_t* caller,
-    value_t* caller_locals
-)
+value_t call_host(hostfn_t* callee, value_t* arg_vals, uint32_t num_args)
 {
-    value_t* arg_vals = alloca(sizeof(value_t) * arg_exprs->len);
-
-    if (arg_exprs->len != callee->num_params)
+    if (num_args != callee->num_params)
     {
         printf(
             "argument count mismatch in call to %s, got %d, expected %d\n",
             string_cstr(callee->name),
-            arg_exprs->len,
+            num_args,
             callee->num_params
         );
         exit(-1);
     }
 
-    // Evaluate the argument values
-    for (size_t i = 0; i < arg_exprs->len; ++i)
+    // Check the types of the heap object arguments
+    for (size_t i = 0; callee->obj_params >> i; ++i)
     {
-        //printf("evaluating arg %ld\n", i);
+        if (!(callee->obj_params & (1 << i)))
+            continue;
 
-        // Evaluate the parameter value
-        arg_vals[i] = eval_expr(
-            array_get_ptr(arg_exprs, i),
-            caller,
-            caller_locals
-        );
+        const char* type_name;
+        if (arg_vals[i].tag != hostfn_obj_tag(callee->param_types[i], &type_name))
+        {
+            printf(
+                "expected %s argument in call to %s\n",
+                type_name,
+                string_cstr(callee->name)
+            );
+            exit(-1);
+        }
+    }
+
+    // Tags, booleans and 32-bit integers are passed as words
+    // holding their C value
+    value_t conv_vals[HOSTFN_MAX_PARAMS];
+    if (callee->conv_params)
+    {
+        memcpy(conv_vals, arg_vals, sizeof(value_t) * num_args);
+
+        for (size_t i = 0; i < num_args; ++i)
+        {
+            uint8_t type = callee->param_types[i];
+
+            if (type == HOST_TAG)
+                conv_vals[i].word.int64 = arg_vals[i].tag;
+            else if (type == HOST_BOOL)
+                conv_vals[i].word.int64 = eval_truth(arg_vals[i]);
+            else if (type == HOST_INT32)
+                conv_vals[i].word.int64 = arg_vals[i].word.int32;
+        }
+
+        arg_vals = conv_vals;
+    }
+
+    return callee->tramp(callee, arg_vals);
+}
+
+/**
+Read a variable
+*/
+value_t eval_ref(ast_ref_t* ref, clos_t* clos, value_t* locals)
+{
+    assert (ref->decl != NULL);
+
+    // Global variables are read from the global slot table
+    if (ref->decl->global)
+    {
+        assert (ref->idx < vm.num_globals);
+        return vm.global_slots[ref->idx];
     }
 
-    // Type test signature
-    if (callee->sig_str == vm_get_cstr("bool(tag)"))
+    // If this is a variable from an outer function
+    if (ref->decl->fun != clos->fun)
     {
-        bool (*fptr)(tag_t) = callee->fptr;
-        return fptr(arg_vals[0].tag)? VAL_TRUE:VAL_FALSE;
+        assert (ref->idx < clos->fun->free_vars->len);
+        value_t val = clos->vals[ref->idx];
+
+        // Variables which can change are read from their cell
+        if (ref->decl->esc)
+        {
+            cell_t* cell = val.word.cell;
+            assert (cell != NULL);
+            val.word = cell->word;
+            val.tag = cell->tag;
+        }
+
+        return val;
     }
 
-    if (callee->sig_str == vm_get_cstr("void(int)"))
+    // Check that the ref index is valid
+    if (ref->idx > clos->fun->local_decls->len)
     {
-        void (*fptr)(int) = callee->fptr;
-        fptr(arg_vals[0].word.int32);
-        return VAL_TRUE;
+        printf("invalid variable reference\n");
+        printf("ref->name=%s\n", string_cstr(ref->name));
+        printf("ref->idx=%d\n", ref->idx);
+        printf("local_decls->len=%d\n", clos->fun->local_decls->len);
+        exit(-1);
     }
 
-    if (callee->sig_str == vm_get_cstr("void(int64)"))
+    // If this an escaping variable (captured by a closure)
+    if (ref->decl->esc)
     {
-        void (*fptr)(int64_t) = callee->fptr;
-        fptr(arg_vals[0].word.int64);
-        return VAL_TRUE;
+        // Free variables are stored in mutable cells
+        // Pointers to the cells are found on the closure object
+        cell_t* cell = locals[ref->idx].word.cell;
+        value_t val;
+        val.word = cell->word;
+        val.tag = cell->tag;
+        return val;
     }
 
-    if (callee->sig_str == vm_get_cstr("void(string)"))
+    // Read directly from the stack frame
+    return locals[ref->idx];
+}
+
+/**
+Evaluate a leaf expression, a constant or a variable read
+Returns false if the expression is not a leaf
+*/
+bool eval_leaf(heapptr_t expr, clos_t* clos, value_t* locals, value_t* val)
+{
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_REF)
     {
-        void (*fptr)(string_t*) = callee->fptr;
-        fptr(arg_vals[0].word.string);
-        return VAL_TRUE;
+        *val = eval_ref((ast_ref_t*)expr, clos, locals);
+        return true;
     }
 
-    if (callee->sig_str == vm_get_cstr("string()"))
+    if (shape == SHAPE_AST_CONST)
     {
-        string_t* (*fptr)() = callee->fptr;
-        string_t* str = fptr();
-        return value_from_heapptr((heapptr_t)str, TAG_STRING);
+        *val = ((ast_const_t*)expr)->val;
+        return true;
     }
 
-    if (callee->sig_str == vm_get_cstr("string(string)"))
+    if (shape == SHAPE_STRING)
     {
-        string_t* (*fptr)(string_t*) = callee->fptr;
-        string_t* str = fptr(arg_vals[0].word.string);
-        return value_from_heapptr((heapptr_t)str, TAG_STRING);
+        *val = value_from_heapptr(expr, TAG_STRING);
+        return true;
     }
 
-    printf("unsupported host function signature\n");
-    exit(-1);
+    return false;
 }
 
 /**
-Evaluate an expression in a given frame
+Evaluate a simple expression: a leaf, or an operator applied to leaves
+These are evaluated by eval_loop without pushing continuations.
+Returns false if the expression is not simple, in which case at most
+a leaf operand was read.
 */
-value_t eval_expr(
-    heapptr_t expr, 
-    clos_t* clos,
-    value_t* locals
-)
+bool eval_simple(heapptr_t expr, clos_t* clos, value_t* locals, value_t* val)
 {
-    //printf("eval_expr\n");
+    if (eval_leaf(expr, clos, locals, val))
+        return true;
+
+    shapeidx_t shape = get_shape(expr);
+
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        value_t v0, v1;
+
+        if (binop->op == &OP_ASSIGN ||
+            !eval_leaf(binop->left_expr, clos, locals, &v0) ||
+            !eval_leaf(binop->right_expr, clos, locals, &v1))
+            return false;
+
+        *val = eval_binop(binop->op, v0, v1);
+        return true;
+    }
+
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+        value_t v0;
+
+        if (!eval_leaf(unop->expr, clos, locals, &v0))
+            return false;
+
+        *val = eval_unop(unop->op, v0);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+Evaluation loop of the interpreter
+
+Evaluating an AST node pushes a continuation for it on the interpreter
+stack, above the values it has computed so far, and moves on to its first
+child. Once a value is produced, the continuation on top of the stack
+resumes its node, which either evaluates its next child or pops itself
+and produces its own value. Calls to interpreted closures push a frame and
+evaluate the function body, the continuation at the bottom of the frame
+returns from the call. No C recursion is involved, so the depth of
+interpreted recursion is only limited by memory.
+
+If expr is NULL, the loop starts by producing val to the continuation on
+top of the stack. The loop returns when the frame it started in, which
+must have been pushed without a return node, returns.
+
+The values a continuation saves follow those recorded by the JIT for
+deoptimization (see deopt_info_t), with the child index following the
+evaluation order:
+- array and object literals save the object being initialized
+- calls save the callee and the preceding argument values
+- binary operators save the left operand value
+- assignments save the value assigned, then the base of a member target
+*/
+value_t eval_loop(heapptr_t expr, value_t val)
+{
+    clos_t* clos = stack_fp->clos;
+    value_t* locals = stack_fp->locals;
+
+    kont_t* kont;
+    heapptr_t node;
+    shapeidx_t shape;
+
+    value_t callee;
+    uint32_t num_args;
+
+    if (expr == NULL)
+        goto ret;
+
+eval:
+    // Get the shape of the AST node
+    // Note: AST nodes must match the shapes defined in init_parser,
+    // otherwise this interpreter can't handle it
+    shape = get_shape(expr);
+
+    // Variable or constant declaration (let/var)
+    if (shape == SHAPE_AST_DECL)
+    {
+        ast_decl_t* decl = (ast_decl_t*)expr;
+
+        // Let declarations should be initialized
+        assert (decl->cst == false);
+
+        val = VAL_FALSE;
+        goto ret;
+    }
+
+    // Constants and variable reads
+    if (eval_leaf(expr, clos, locals, &val))
+        goto ret;
+
+    // Array literal expression
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        // Array of values to be produced
+        array_t* val_array = array_alloc(array_expr->len);
+        val = value_from_heapptr((heapptr_t)val_array, TAG_ARRAY);
+
+        if (array_expr->len == 0)
+            goto ret;
+
+        kont_push(expr, 0, &val, 1);
+        expr = array_get_ptr(array_expr, 0);
+        goto eval;
+    }
+
+    // Object literal expression
+    if (shape == SHAPE_AST_OBJ)
+    {
+        ast_obj_t* obj_expr = (ast_obj_t*)expr;
+
+        // TODO: set prototype
+        // Do this in object_alloc?
+        object_t* obj = object_alloc(OBJ_MIN_CAP);
+        val = value_from_obj((heapptr_t)obj);
+
+        if (obj_expr->name_strs->len == 0)
+            goto ret;
+
+        kont_push(expr, 0, &val, 1);
+        expr = array_get_ptr(obj_expr->val_exprs, 0);
+        goto eval;
+    }
+
+    // Binary operator (e.g. a + b)
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+
+        // The value assigned is evaluated first, variables are
+        // assigned simple values directly
+        if (binop->op == &OP_ASSIGN)
+        {
+            if (get_shape(binop->left_expr) != SHAPE_AST_BINOP &&
+                eval_simple(binop->right_expr, clos, locals, &val))
+            {
+                val = eval_assign(binop->left_expr, val, clos, locals);
+                goto ret;
+            }
+
+            kont_push(expr, 0, NULL, 0);
+            expr = binop->right_expr;
+            goto eval;
+        }
+
+        // Simple operands are evaluated without continuations
+        value_t v0;
+        if (eval_simple(binop->left_expr, clos, locals, &v0))
+        {
+            value_t v1;
+            if (eval_simple(binop->right_expr, clos, locals, &v1))
+            {
+                val = eval_binop(binop->op, v0, v1);
+                goto ret;
+            }
+
+            kont_push(expr, 1, &v0, 1);
+            expr = binop->right_expr;
+            goto eval;
+        }
+
+        kont_push(expr, 0, NULL, 0);
+        expr = binop->left_expr;
+        goto eval;
+    }
+
+    // Unary operator (e.g.: -x, not a)
+    if (shape == SHAPE_AST_UNOP)
+    {
+        if (eval_simple(expr, clos, locals, &val))
+            goto ret;
 
-    // Get the shape of the AST node
-    // Note: AST nodes must match the shapes defined in init_parser,
-    // otherwise this interpreter can't handle it
-    shapeidx_t shape = get_shape(expr);
+        kont_push(expr, 0, NULL, 0);
+        expr = ((ast_unop_t*)expr)->expr;
+        goto eval;
+    }
 
-    // Variable or constant declaration (let/var)
-    if (shape == SHAPE_AST_DECL)
+    // Sequence/block expression
+    if (shape == SHAPE_AST_SEQ)
     {
-        ast_decl_t* decl = (ast_decl_t*)expr;
+        array_t* expr_list = ((ast_seq_t*)expr)->expr_list;
 
-        // Let declarations should be initialized
-        assert (decl->cst == false);
+        if (expr_list->len == 0)
+        {
+            val = VAL_TRUE;
+            goto ret;
+        }
 
-        return VAL_FALSE;
+        // The last expression is evaluated in tail position
+        if (expr_list->len > 1)
+            kont_push(expr, 0, NULL, 0);
+
+        expr = array_get_ptr(expr_list, 0);
+        goto eval;
     }
 
-    // Variable reference (read)
-    if (shape == SHAPE_AST_REF)
+    // If expression
+    if (shape == SHAPE_AST_IF)
     {
-        ast_ref_t* ref = (ast_ref_t*)expr;
-        assert (ref->decl != NULL);
-
-        //printf("evaluating ref to %s\n", string_cstr(ref->name));
+        ast_if_t* ifexpr = (ast_if_t*)expr;
 
-        // If this is a variable from an outer function
-        if (ref->decl->fun != clos->fun)
+        // With a simple test, the branch is evaluated right away
+        if (eval_simple(ifexpr->test_expr, clos, locals, &val))
         {
-            //printf("ref from outer fun\n");
+            expr = eval_truth(val)? ifexpr->then_expr:ifexpr->else_expr;
+            goto eval;
+        }
 
-            assert (ref->idx < clos->fun->free_vars->len);
-            cell_t* cell = clos->cells[ref->idx];
-            assert (cell != NULL);
+        kont_push(expr, 0, NULL, 0);
+        expr = ifexpr->test_expr;
+        goto eval;
+    }
 
-            value_t value;
-            value.word = cell->word;
-            value.tag = cell->tag;
+    // Function/closure expression
+    if (shape == SHAPE_AST_FUN)
+    {
+        ast_fun_t* nested = (ast_fun_t*)expr;
 
-            return value;
+        if (nested->free_vars->len == 0)
+        {
+            val = value_from_heapptr((heapptr_t)clos_shared(nested), TAG_CLOS);
+            goto ret;
         }
 
-        // Check that the ref index is valid
-        if (ref->idx > clos->fun->local_decls->len)
+        // Allocate a closure of the nested function
+        clos_t* new_clos = clos_alloc(nested);
+
+        // Copy the captured variables, from the local variables of this
+        // function or from its own closure
+        uint32_t* capt_map = nested->capt_map;
+        for (size_t i = 0; i < nested->free_vars->len; ++i)
         {
-            printf("invalid variable reference\n");
-            printf("ref->name=%s\n", string_cstr(ref->name));
-            printf("ref->idx=%d\n", ref->idx);
-            printf("local_decls->len=%d\n", clos->fun->local_decls->len);
-            exit(-1);
+            uint32_t idx = capt_map[i];
+
+            if (idx & CAPT_LOCAL)
+                new_clos->vals[i] = locals[idx & ~CAPT_LOCAL];
+            else
+                new_clos->vals[i] = clos->vals[idx];
         }
 
-        // If this an escaping variable (captured by a closure)
-        if (ref->decl->esc)
+        assert (new_clos->fun == nested);
+
+        val = value_from_heapptr((heapptr_t)new_clos, TAG_CLOS);
+        goto ret;
+    }
+
+    // Call expression
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* call = (ast_call_t*)expr;
+        array_t* arg_exprs = call->arg_exprs;
+        num_args = arg_exprs->len;
+
+        // The callee and the leading arguments which are simple are
+        // evaluated directly into the slots where the continuation of
+        // the call saves them
+        value_t* vals = stack_reserve(num_args + 2);
+        heapptr_t next = call->fun_expr;
+        uint32_t num_vals = 0;
+
+        while (eval_simple(next, clos, locals, &vals[num_vals]))
         {
-            // Free variables are stored in mutable cells
-            // Pointers to the cells are found on the closure object
-            cell_t* cell = locals[ref->idx].word.cell;
-            value_t value;
-            value.word = cell->word;
-            value.tag = cell->tag;
+            if (num_vals == 0 && vals[0].tag != TAG_CLOS && vals[0].tag != TAG_HOSTFN)
+            {
+                printf("invalid callee in function call\n");
+                exit(-1);
+            }
 
-            //printf("read value from cell\n");
+            if (++num_vals == num_args + 1)
+            {
+                stack_sp = vals + num_vals;
+                node = expr;
+                goto call;
+            }
 
-            return value;
+            next = array_get_ptr(arg_exprs, num_vals - 1);
         }
 
-        /*
-        printf("reading normal local\n");
-        string_print(ref->name);
-        printf("\n");
-        */
+        kont_t* kont = (kont_t*)(vals + num_vals);
+        kont->node = expr;
+        kont->idx = num_vals;
+        stack_sp = (value_t*)(kont + 1);
 
-        // Read directly from the stack frame
-        return locals[ref->idx];
+        expr = next;
+        goto eval;
     }
 
-    if (shape == SHAPE_AST_CONST)
-    {
-        //printf("constant\n");
+    printf("eval error, unknown expression type, shapeidx=%d\n", shape);
+    exit(-1);
 
-        ast_const_t* cst = (ast_const_t*)expr;
-        return cst->val;
-    }
+ret:
+    kont = stack_top_kont();
+    node = kont->node;
 
-    if (shape == SHAPE_STRING)
+    // Return from the current call
+    if (node == NULL)
     {
-        return value_from_heapptr(expr, TAG_STRING);
+        frame_t* frame = stack_fp;
+        heapptr_t ret_node = frame->ret_node;
+
+        if (ret_node == NULL)
+        {
+            frame_pop();
+            return val;
+        }
+
+        // Pop the frame along with the callee and argument values,
+        // which are right below it in the segment the frame returns to
+        size_t num_vals = ((ast_call_t*)ret_node)->arg_exprs->len + 1;
+        assert (frame->ret_sp >= frame->ret_seg->slots + num_vals);
+        stack_fp = frame->prev;
+        stack_restore(frame->ret_seg, frame->ret_sp - num_vals);
+
+        clos = stack_fp->clos;
+        locals = stack_fp->locals;
+        goto ret;
     }
 
-    // Array literal expression
+    shape = get_shape(node);
+
     if (shape == SHAPE_ARRAY)
     {
-        array_t* array_expr = (array_t*)expr;
+        array_t* array_expr = (array_t*)node;
+        value_t* vals = (value_t*)kont - 1;
 
-        // Array of values to be produced
-        array_t* val_array = array_alloc(array_expr->len);
+        array_set(vals[0].word.array, kont->idx, val);
 
-        for (size_t i = 0; i < array_expr->len; ++i)
+        if (++kont->idx < array_expr->len)
         {
-            heapptr_t expr = array_get(array_expr, i).word.heapptr;
-            value_t value = eval_expr(expr, clos, locals);
-            array_set(val_array, i, value);
+            expr = array_get_ptr(array_expr, kont->idx);
+            goto eval;
         }
 
-        return value_from_heapptr((heapptr_t)val_array, TAG_ARRAY);
+        val = vals[0];
+        stack_pop(2);
+        goto ret;
     }
 
-    // Object literal expression
     if (shape == SHAPE_AST_OBJ)
     {
-        //printf("obj literal expr\n");
-
-        ast_obj_t* obj_expr = (ast_obj_t*)expr;
-
-        object_t* obj = object_alloc(OBJ_MIN_CAP);
+        ast_obj_t* obj_expr = (ast_obj_t*)node;
+        value_t* vals = (value_t*)kont - 1;
 
-        // TODO: set prototype
-        // Do this in object_alloc?
+        string_t* prop_name = array_get(obj_expr->name_strs, kont->idx).word.string;
+        object_set_prop((object_t*)vals[0].word.heapptr, prop_name, val, ATTR_DEFAULT);
 
-        for (size_t i = 0; i < obj_expr->name_strs->len; ++i)
+        if (++kont->idx < obj_expr->name_strs->len)
         {
-            string_t* prop_name = array_get(obj_expr->name_strs, i).word.string;
-            heapptr_t val_expr = array_get(obj_expr->val_exprs, i).word.heapptr;
-
-            value_t value = eval_expr(val_expr, clos, locals);
-
-            object_set_prop(
-                obj,
-                prop_name,
-                value,
-                ATTR_DEFAULT
-            );
+            expr = array_get_ptr(obj_expr->val_exprs, kont->idx);
+            goto eval;
         }
 
-        return value_from_obj((heapptr_t)obj);
+        val = vals[0];
+        stack_pop(2);
+        goto ret;
     }
 
-    // Binary operator (e.g. a + b)
     if (shape == SHAPE_AST_BINOP)
     {
-        //printf("binop\n");
-
-        ast_binop_t* binop = (ast_binop_t*)expr;
+        ast_binop_t* binop = (ast_binop_t*)node;
 
-        // Assignment
         if (binop->op == &OP_ASSIGN)
         {
-            value_t val = eval_expr(binop->right_expr, clos, locals);
+            ast_binop_t* lhs = (ast_binop_t*)binop->left_expr;
 
-            return eval_assign(
-                binop->left_expr, 
-                val, 
-                clos,
-                locals
-            );
-        }
+            if (kont->idx == 0 && get_shape((heapptr_t)lhs) != SHAPE_AST_BINOP)
+            {
+                stack_pop(1);
+                val = eval_assign((heapptr_t)lhs, val, clos, locals);
+                goto ret;
+            }
 
-        value_t v0 = eval_expr(binop->left_expr, clos, locals);
-        value_t v1 = eval_expr(binop->right_expr, clos, locals);
-        int64_t i0 = v0.word.int64;
-        int64_t i1 = v1.word.int64;
-        string_t* s0 = v0.word.string;
-        string_t* s1 = v1.word.string;
-
-        if (binop->op == &OP_MEMBER)
-            return eval_get_prop(v0, v1);
-
-        if (binop->op == &OP_INDEX)
-            return eval_get_index(v0, v1);
-
-        if (binop->op == &OP_ADD)
-            return value_from_int64(i0 + i1);
-        if (binop->op == &OP_SUB)
-            return value_from_int64(i0 - i1);
-        if (binop->op == &OP_MUL)
-            return value_from_int64(i0 * i1);
-        if (binop->op == &OP_DIV)
-            return value_from_int64(i0 / i1);
-        if (binop->op == &OP_MOD)
-            return value_from_int64(i0 % i1);
-
-        if (binop->op == &OP_LT)
-            return (i0 < i1)? VAL_TRUE:VAL_FALSE;
-
-        if (binop->op == &OP_LE)
-        {
-            if (v0.tag == TAG_STRING && v1.tag == TAG_STRING)
-                return (strcmp(string_cstr(s0), string_cstr(s1)) <= 0)? VAL_TRUE:VAL_FALSE;
-            if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
-                return (i0 <= i1)? VAL_TRUE:VAL_FALSE;
-            assert (false);
-        }
+            // Assignment to a member, evaluate the base, then the name
+            if (kont->idx == 0)
+            {
+                kont_save(kont, val);
+                expr = lhs->left_expr;
+                goto eval;
+            }
 
-        if (binop->op == &OP_GT)
-            return (i0 > i1)? VAL_TRUE:VAL_FALSE;
+            if (kont->idx == 1)
+            {
+                kont_save(kont, val);
+                expr = lhs->right_expr;
+                goto eval;
+            }
 
-        if (binop->op == &OP_GE)
-        {
-            if (v0.tag == TAG_STRING && v1.tag == TAG_STRING)
-                return (strcmp(string_cstr(s0), string_cstr(s1)) >= 0)? VAL_TRUE:VAL_FALSE;
-            if (v0.tag == TAG_INT64 && v1.tag == TAG_INT64)
-                return (i0 >= i1)? VAL_TRUE:VAL_FALSE;
-            assert (false);
+            value_t* vals = (value_t*)kont - 2;
+            value_t v = vals[0];
+            value_t base = vals[1];
+            stack_pop(3);
+
+            if (lhs->op == &OP_MEMBER)
+            {
+                val = eval_set_prop(base, val, v);
+                goto ret;
+            }
+
+            printf("invalid lhs expression in assignment\n");
+            exit(-1);
         }
 
-        if (binop->op == &OP_EQ)
-            return value_equals(v0, v1)? VAL_TRUE:VAL_FALSE;
-        if (binop->op == &OP_NE)
-            return value_equals(v0, v1)? VAL_FALSE:VAL_TRUE;
+        if (kont->idx == 0)
+        {
+            kont_save(kont, val);
+            expr = binop->right_expr;
+            goto eval;
+        }
 
-        printf("unimplemented binary operator: %s\n", binop->op->str);
-        return VAL_FALSE;
+        value_t v0 = ((value_t*)kont)[-1];
+        stack_pop(2);
+        val = eval_binop(binop->op, v0, val);
+        goto ret;
     }
 
-    // Unary operator (e.g.: -x, not a)
     if (shape == SHAPE_AST_UNOP)
     {
-        ast_unop_t* unop = (ast_unop_t*)expr;
-
-        value_t v0 = eval_expr(unop->expr, clos, locals);
-
-        if (unop->op == &OP_NEG)
-            return value_from_int64(-v0.word.int64);
-
-        if (unop->op == &OP_NOT)
-            return eval_truth(v0)? VAL_FALSE:VAL_TRUE;
-
-        printf("unimplemented unary operator: %s\n", unop->op->str);
-        return VAL_FALSE;
+        stack_pop(1);
+        val = eval_unop(((ast_unop_t*)node)->op, val);
+        goto ret;
     }
 
-    // Sequence/block expression
     if (shape == SHAPE_AST_SEQ)
     {
-        ast_seq_t* seqexpr = (ast_seq_t*)expr;
-        array_t* expr_list = seqexpr->expr_list;
+        array_t* expr_list = ((ast_seq_t*)node)->expr_list;
+        uint32_t idx = kont->idx + 1;
 
-        value_t value = VAL_TRUE;
+        // Return the value of the last expression
+        if (idx >= expr_list->len)
+        {
+            stack_pop(1);
+            goto ret;
+        }
 
-        for (size_t i = 0; i < expr_list->len; ++i)
+        // Between two statements of a function body, the call is moved
+        // to compiled code (on-stack replacement) once it has executed
+        // enough statements, or if the function got compiled since the
+        // call started, as happens in deep recursions. Functions whose
+        // code was evicted, or whose entry could not be added to the
+        // code cache, wait until they get compiled again.
+        ast_fun_t* fptr = clos->fun;
+        if (node == fptr->body_expr)
         {
-            heapptr_t expr = array_get(expr_list, i).word.heapptr;
-            value = eval_expr(expr, clos, locals);
+            bool compiled = fptr->osr_entries && fptr->osr_entries[idx];
+            bool hot = idx == jit_osr_threshold && fptr->num_evictions == 0;
+
+            if (!compiled && !fptr->osr_failed && (hot || fptr->jit_entry))
+                compiled = jit_compile_osr(fptr, idx);
+
+            if (compiled && !jit_stack_full())
+            {
+                val = jit_enter(fptr->osr_entries[idx], clos, locals);
+                stack_pop(1);
+                goto ret;
+            }
         }
 
-        // Return the value of the last expression
-        return value;
+        // The last expression is evaluated in tail position
+        if (idx == expr_list->len - 1)
+            stack_pop(1);
+        else
+            kont->idx = idx;
+
+        expr = array_get_ptr(expr_list, idx);
+        goto eval;
     }
 
-    // If expression
     if (shape == SHAPE_AST_IF)
     {
-        ast_if_t* ifexpr = (ast_if_t*)expr;
+        ast_if_t* ifexpr = (ast_if_t*)node;
+        uint32_t idx = kont->idx;
 
-        value_t t = eval_expr(ifexpr->test_expr, clos, locals);
+        // The branches are evaluated in tail position, the value of a
+        // branch is the value of the if expression
+        stack_pop(1);
 
-        if (eval_truth(t))
-            return eval_expr(ifexpr->then_expr, clos, locals);
-        else
-            return eval_expr(ifexpr->else_expr, clos, locals);
+        if (idx > 0)
+            goto ret;
+
+        expr = eval_truth(val)? ifexpr->then_expr:ifexpr->else_expr;
+        goto eval;
     }
 
-    // Function/closure expression
-    if (shape == SHAPE_AST_FUN)
+    if (shape == SHAPE_AST_CALL)
     {
-        //printf("creating closure\n");
-
-        ast_fun_t* nested = (ast_fun_t*)expr;
+        array_t* arg_exprs = ((ast_call_t*)node)->arg_exprs;
+        uint32_t idx = kont->idx;
 
-        // Allocate a closure of the nested function
-        clos_t* new_clos = clos_alloc(nested);
-
-        // For each free (closure) variable of the nested function
-        for (size_t i = 0; i < nested->free_vars->len; ++i)
+        if (idx == 0 && val.tag != TAG_CLOS && val.tag != TAG_HOSTFN)
         {
-            ast_decl_t* decl = array_get(nested->free_vars, i).word.decl;
-
-            // If the variable is from this function
-            if (decl->fun == clos->fun)
-            {
-                new_clos->cells[i] = locals[decl->idx].word.cell;
-            }
-            else
-            {
-                uint32_t free_idx = array_indexof_ptr(clos->fun->free_vars, (heapptr_t)decl);
-                assert (free_idx < clos->fun->free_vars->len);
-                new_clos->cells[i] = clos->cells[free_idx];
-            }
+            printf("invalid callee in function call\n");
+            exit(-1);
         }
 
-        assert (new_clos->fun == nested);
+        // The callee and the argument values end up contiguous
+        // on the stack, in place of the continuation
+        if (idx < arg_exprs->len)
+        {
+            kont_save(kont, val);
+            expr = array_get_ptr(arg_exprs, idx);
+            goto eval;
+        }
 
-        return value_from_heapptr((heapptr_t)new_clos, TAG_CLOS);
+        *(value_t*)kont = val;
+        num_args = arg_exprs->len;
+        goto call;
     }
 
-    // Call expression
-    if (shape == SHAPE_AST_CALL)
+    printf("cannot resume evaluation, shapeidx=%d\n", shape);
+    exit(-1);
+
+call:
     {
-        //printf("evaluating call\n");
+        value_t* arg_vals = stack_sp - num_args;
+        callee = arg_vals[-1];
 
-        ast_call_t* callexpr = (ast_call_t*)expr;
+        if (callee.tag == TAG_HOSTFN)
+        {
+            val = call_host(callee.word.hostfn, arg_vals, num_args);
+            stack_pop(num_args + 1);
+            goto ret;
+        }
 
-        // Evaluate the closure expression
-        value_t callee_clos = eval_expr(callexpr->fun_expr, clos, locals);
+        assert (callee.tag == TAG_CLOS);
+        void* entry = call_entry(callee.word.clos, num_args);
 
-        if (callee_clos.tag == TAG_CLOS)
+        if (entry)
         {
-            return eval_call(
-                callee_clos.word.clos,
-                callexpr->arg_exprs,
-                clos,
-                locals
-            );
+            val = jit_enter(entry, callee.word.clos, arg_vals);
+            stack_pop(num_args + 1);
+            goto ret;
         }
 
-        if (callee_clos.tag == TAG_HOSTFN)
+        // If the call is in tail position, the frame of the caller is
+        // not needed anymore, and the callee frame takes its place
+        if (arg_vals - 1 > stack_seg->slots && ((kont_t*)arg_vals)[-2].node == NULL)
         {
-            return eval_host_call(
-                callee_clos.word.hostfn,
-                callexpr->arg_exprs,
-                clos,
-                locals
-            );
+            if (num_args > tail_args_cap)
+            {
+                tail_args_cap = 2 * num_args;
+                tail_args = realloc(tail_args, sizeof(value_t) * tail_args_cap);
+            }
+            memcpy(tail_args, arg_vals, sizeof(value_t) * num_args);
+
+            node = stack_fp->ret_node;
+            frame_pop();
+            arg_vals = tail_args;
         }
 
-        printf("invalid callee in function call\n");
-        exit(-1);
+        frame_enter(callee.word.clos, arg_vals, node);
+
+        clos = stack_fp->clos;
+        locals = stack_fp->locals;
+        expr = clos->fun->body_expr;
+        goto eval;
     }
+}
+
+/**
+Evaluate an expression in a given frame
+*/
+value_t eval_expr(
+    heapptr_t expr,
+    clos_t* clos,
+    value_t* locals
+)
+{
+    frame_t* frame = frame_push(clos, 0, NULL);
+    frame->locals = locals;
+
+    return eval_loop(expr, VAL_FALSE);
+}
+
+/**
+Call a closure with evaluated argument values
+*/
+value_t call_clos(clos_t* callee, value_t* arg_vals, uint32_t num_args)
+{
+    void* entry = call_entry(callee, num_args);
+
+    if (entry)
+        return jit_enter(entry, callee, arg_vals);
+
+    frame_enter(callee, arg_vals, NULL);
+
+    return eval_loop(callee->fun->body_expr, VAL_FALSE);
+}
+
+/**
+Call a closure or host function value with evaluated arguments
+*/
+value_t call_value(value_t callee, value_t* arg_vals, uint32_t num_args)
+{
+    if (callee.tag == TAG_CLOS)
+        return call_clos(callee.word.clos, arg_vals, num_args);
+
+    if (callee.tag == TAG_HOSTFN)
+        return call_host(callee.word.hostfn, arg_vals, num_args);
 
-    printf("eval error, unknown expression type, shapeidx=%d\n", get_shape(expr));
+    printf("invalid callee in function call\n");
     exit(-1);
 }
 
@@ -1259,12 +2441,7 @@ value_t eval_unit(ast_fun_t* unit_fun)
     );
 
     // Call the unit function with no arguments
-    return eval_call(
-        unit_clos.word.clos,
-        array_alloc(0),
-        NULL,
-        NULL
-    );
+    return call_clos(unit_clos.word.clos, NULL, 0);
 }
 
 /**
@@ -1326,10 +2503,182 @@ void test_eval_false(char* cstr)
     test_eval_equals(cstr, VAL_FALSE);
 }
 
+/**
+Evaluate code in a child process writing to a pipe, and check
+everything it outputs, including the messages of runtime errors
+*/
+void test_eval_output(char* cstr, char* expected)
+{
+    printf("%s\n", cstr);
+    fflush(stdout);
+
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        printf("failed to create pipe\n");
+        exit(-1);
+    }
+
+    pid_t pid = fork();
+    assert (pid >= 0);
+
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        eval_string(cstr, "test");
+        exit(0);
+    }
+
+    close(fds[1]);
+
+    char output[256];
+    size_t len = 0;
+    for (;;)
+    {
+        ssize_t n = read(fds[0], output + len, sizeof(output) - 1 - len);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    output[len] = '\0';
+
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    if (strcmp(output, expected) != 0)
+    {
+        printf("output doesn't match expected for input:\n%s\n", cstr);
+        printf("got output:\n%s", output);
+        exit(-1);
+    }
+}
+
+double test_host_mix(int64_t a, double b, int32_t c, double d)
+{
+    return a * b + c * d;
+}
+
+bool test_host_neg(int32_t n)
+{
+    return n < 0;
+}
+
+string_t* test_host_str(int64_t a, string_t* s, size_t b, void* p)
+{
+    return (a == 1 && b == 2 && p == &test_host_str)? s:NULL;
+}
+
+value_t test_host_val(int64_t a, value_t v, double d, int64_t b)
+{
+    return (a == 1 && b == 2 && d == 0.5)? v:VAL_FALSE;
+}
+
+int64_t test_host_sub(int64_t a, int64_t b)
+{
+    return a - b;
+}
+
+int32_t test_host_many(
+    int64_t a,
+    int32_t b,
+    bool c,
+    string_t* s,
+    size_t d,
+    tag_t t,
+    void* p,
+    int64_t e
+)
+{
+    if (!c || s == NULL || t != TAG_STRING || p != &test_host_many)
+        return 0;
+
+    return (int32_t)(a + b + d + e + s->len);
+}
+
+void test_host_calls()
+{
+    value_t args[4];
+
+    // Integer and floating-point arguments
+    hostfn_t* mix = hostfn_alloc(&test_host_mix, "mix", "float64(int64, float64, int, float64)");
+    assert (mix->num_params == 4);
+    args[0] = value_from_int64(3);
+    args[1].word.float64 = 0.5;
+    args[1].tag = TAG_FLOAT64;
+    args[2] = value_from_int64(-2);
+    args[3].word.float64 = 0.25;
+    args[3].tag = TAG_FLOAT64;
+    value_t val = call_host(mix, args, 4);
+    assert (val.tag == TAG_FLOAT64 && val.word.float64 == 1.0);
+
+    // Narrow return values
+    hostfn_t* neg = hostfn_alloc(&test_host_neg, "neg", "bool(int)");
+    args[0] = value_from_int64(-5);
+    assert (value_equals(call_host(neg, args, 1), VAL_TRUE));
+    args[0] = value_from_int64(5);
+    assert (value_equals(call_host(neg, args, 1), VAL_FALSE));
+
+    string_t* str = vm_get_cstr("foo");
+    hostfn_t* fn = hostfn_alloc(&test_host_str, "str", "string(int64,string, size_t , void*)");
+    args[0] = value_from_int64(1);
+    args[1] = value_from_heapptr((heapptr_t)str, TAG_STRING);
+    args[2] = value_from_int64(2);
+    args[3] = value_from_heapptr((heapptr_t)&test_host_str, TAG_RAW_PTR);
+    val = call_host(fn, args, 4);
+    assert (val.tag == TAG_STRING && val.word.string == str);
+
+    // Tagged values are passed and returned whole
+    fn = hostfn_alloc(&test_host_val, "val", "value(int64, value, float64, int64)");
+    args[0] = value_from_int64(1);
+    args[1] = value_from_heapptr((heapptr_t)str, TAG_STRING);
+    args[2].word.float64 = 0.5;
+    args[2].tag = TAG_FLOAT64;
+    args[3] = value_from_int64(2);
+    val = call_host(fn, args, 4);
+    assert (val.tag == TAG_STRING && val.word.string == str);
+
+    // Signatures taking integers and pointers are all supported
+    fn = hostfn_alloc(&test_host_sub, "sub", "int64(int64, int64)");
+    args[0] = value_from_int64(7);
+    args[1] = value_from_int64(9);
+    val = call_host(fn, args, 2);
+    assert (val.tag == TAG_INT64 && val.word.int64 == -2);
+
+    value_t many_args[8] = {
+        value_from_int64(1),
+        value_from_int64(-2),
+        VAL_TRUE,
+        value_from_heapptr((heapptr_t)str, TAG_STRING),
+        value_from_int64(4),
+        value_from_heapptr((heapptr_t)str, TAG_STRING),
+        value_from_heapptr((heapptr_t)&test_host_many, TAG_RAW_PTR),
+        value_from_int64(100)
+    };
+    fn = hostfn_alloc(
+        &test_host_many,
+        "many",
+        "int(int64, int, bool, string, size_t, tag, void*, int64)"
+    );
+    val = call_host(fn, many_args, 8);
+    assert (val.tag == TAG_INT64 && val.word.int64 == 106);
+
+    // Other signatures are rejected when registered
+    uint8_t types[2] = { HOST_FLOAT64, HOST_INT64 };
+    assert (host_sig_supported(HOST_INT64, types + 1, 1));
+    assert (!host_sig_supported(HOST_VOID, types, 1));
+    assert (!host_sig_supported(HOST_TAG, types + 1, 1));
+    types[0] = HOST_VALUE;
+    assert (!host_sig_supported(HOST_VALUE, types, 2));
+}
+
 void test_interp()
 {
     printf("core interpreter tests\n");
 
+    test_host_calls();
+
     // Empty unit
     test_eval_try("");
 
@@ -1381,6 +2730,13 @@ void test_interp()
     test_eval_int("'foo'.length", 3);
     test_eval_true("'foobar'[3] == 'b'");
 
+    // Indexing into strings does not allocate
+    value_t foo_val = value_from_heapptr((heapptr_t)vm_get_cstr("foo"), TAG_STRING);
+    uint8_t* allocptr = vm.allocptr;
+    value_t char_val = eval_get_index(foo_val, value_from_int64(1));
+    assert (vm.allocptr == allocptr);
+    assert (char_val.word.string == vm_get_cstr("o"));
+
     // Sequence expression
     test_eval_try("{}");
     test_eval_int("{ 2 3 }", 3);
@@ -1398,6 +2754,7 @@ void test_interp()
     // Variable declarations
     test_eval_int("var x = 3; x", 3);
     test_eval_int("let x = 7; x+1", 8);
+    test_eval_int("let iffy = 1; let notify = 2; let order = 3; iffy + notify + order", 6);
     test_eval_int("var x = 3; x = 4; x", 4);
     test_eval_int("var x = 3; x = x+1; x", 4);
     test_eval_int("var x = 3; if x != 0 then 1", 1);
@@ -1429,9 +2786,60 @@ void test_interp()
     // Capture by inner from outer
     test_eval_int("let n = 5; let f = fun () { fun() n }; let g = f(); g()", 5);
 
+    // Cells captured from the parent frame and from the parent closure
+    test_eval_int("let a = 1; let f = fun () { let b = 2; fun () { a = a + b; a } }; let g = f(); g(); g()", 5);
+
+    // Captured variables which can not change are copied into closures
+    char* capt_src =
+        "let f = fun (n) {"
+        "  let a = n + 1; var b = 0; let r = fun () r;"
+        "  let g = fun () a + n + b; b = 1; g()"
+        "}; f(1)";
+    ast_fun_t* unit = parse_check_error(parse_string(capt_src, "interp_test"));
+    var_res_pass(unit, NULL);
+    array_t* stmts = ((ast_seq_t*)unit->body_expr)->expr_list;
+    ast_fun_t* f = (ast_fun_t*)((ast_binop_t*)array_get_ptr(stmts, 0))->right_expr;
+    assert (!array_get(f->local_decls, 0).word.decl->esc);
+    assert (!array_get(f->local_decls, 1).word.decl->esc);
+    assert (array_get(f->local_decls, 2).word.decl->esc);
+    assert (array_get(f->local_decls, 3).word.decl->esc);
+    assert (f->esc_locals->len == 2);
+    test_eval_int(capt_src, 4);
+
+    // Closures which capture nothing are shared
+    test_eval_true("let f = fun () fun () 1; f() == f()");
+    test_eval_false("let f = fun (n) fun () n; f(1) == f(1)");
+
     // Captured function parameter
     test_eval_int("let f = fun (n) { fun () n }; let g = f(88); g()", 88);
 
+    // Calls mixing simple and nested argument expressions
+    test_eval_int("let f = fun (a, b, c) a - b + c; let g = fun (n) n; f(9, g(2), 1 + 3)", 11);
+    test_eval_int("let f = fun (a, b, c) a - b + c; let g = fun (n) n; f(g(9), 2, -(g(3)))", 4);
+    test_eval_int("let f = fun () fun (n) n + 1; f()(4)", 5);
+    test_eval_int("let g = fun (n) n; let x = 2; (x + g(3)) * (g(4) - x)", 10);
+    test_eval_int("let g = fun (n) n; var x = 1; x = g(x + 1); x = x * 3", 6);
+
+    // Calls in tail position run in constant stack space
+    test_eval_int("let f = fun (n) if n == 0 then 7 else f(n-1); f(1000000)", 7);
+    test_eval_int("let f = fun (n, a) { if n == 0 then a else { let b = a + 1; f(n-1, b) } }; f(1000000, 0)", 1000000);
+    test_eval_true(
+        "let even = fun (n) if n == 0 then true else odd(n-1);"
+        "let odd = fun (n) if n == 0 then false else even(n-1);"
+        "even(1000000)"
+    );
+
+    // Deep recursion is only limited by the size of the interpreter stack,
+    // with the compiler disabled since compiled code runs on the C stack
+    uint32_t threshold = jit_threshold;
+    uint32_t osr_threshold = jit_osr_threshold;
+    jit_threshold = UINT32_MAX;
+    jit_osr_threshold = UINT32_MAX;
+    test_eval_int("let f = fun (n) if n == 0 then 0 else 1 + f(n-1); f(200000)", 200000);
+    test_eval_int("let f = fun (n) { let m = n - 1; if m < 0 then 0 else f(m) + 2 }; f(100000)", 200000);
+    jit_threshold = threshold;
+    jit_osr_threshold = osr_threshold;
+
     // Objects
     test_eval_try("let o = :{}");
     test_eval_try("let o = :{x:1}");
@@ -1455,6 +2863,53 @@ void test_runtime()
     test_eval_true("assert != false");
     test_eval_true("assert (true, '')   true");
 
+    // Hash maps
+    test_eval_int("let m = $map_new(); $map_set(m, 'a', 1); $map_set(m, 2, 3); $map_get(m, 'a') + $map_get(m, 2)", 4);
+    test_eval_true("let m = $map_new(); $map_set(m, m, true); $map_has(m, m)");
+    test_eval_false("$map_has($map_new(), 0)");
+    test_eval_false("$map_get($map_new(), 'a')");
+    test_eval_int("let m = $map_new(); $map_set(m, 'ab'[0], 1); $map_get(m, 'a')", 1);
+    test_eval_int("let m = $map_new(); $map_set(m, 1, 1); $map_delete(m, 1); $map_size(m)", 0);
+    test_eval_int(
+        "let m = $map_new(); $map_set(m, 3, 4); $map_set(m, 5, 6);"
+        "let sum = fun (i) { let j = $map_next(m, i);"
+        "if j < 0 then 0 else $map_key(m, j) + $map_val(m, j) + sum(j) };"
+        "sum(-1)",
+        18
+    );
+
+    // Substrings
+    test_eval_true("$string_slice('foobar', 1, 4) == 'oob'");
+    test_eval_true("$string_slice('foobar', 3, 3) == ''");
+    test_eval_int("$string_slice($string_slice('foobar', 1, 6), 2, 5).length", 3);
+    test_eval_int("$string_index_of('foobar', 'ob', 0)", 2);
+    test_eval_int("$string_index_of('foobar', 'o', 2)", 2);
+    test_eval_int("$string_index_of('foobar', 'x', 0)", -1);
+    test_eval_true("$string_starts_with('foobar', 'foo')");
+    test_eval_false("$string_starts_with('foo', 'foobar')");
+    test_eval_int("$string_count('a b  c', ' ')", 3);
+    test_eval_int("$string_split('a b  c', ' ').length", 4);
+    test_eval_true("$string_split('a, b, c', ', ')[2] == 'c'");
+    test_eval_true("'abc' <= 'abd'");
+    test_eval_true("'b' >= 'abc'");
+    test_eval_false("'ab' >= 'abc'");
+    test_eval_true("$string_slice('abc', 0, 2) <= 'abc'");
+
+    // String builders
+    test_eval_true(
+        "let sb = $strbuf_new(); $strbuf_append(sb, 'foo');"
+        "$strbuf_append_int64(sb, -12); $strbuf_to_string(sb) == 'foo-12'"
+    );
+    test_eval_int("let sb = $strbuf_new(); $strbuf_append(sb, 'abc'); $strbuf_length(sb)", 3);
+
+    // Printed output and error messages are written in order
+    test_eval_output("println('first'); print(2); println(3)", "first\n23\n");
+    test_eval_output("println('first'); let o = 3; o.x = 1", "first\nnon-object base in property write\n");
+    test_eval_output("println('a'); $map_key($map_new(), 0)", "a\ninvalid map index 0\n");
+
+    // The globals defined in global.zeta can be reassigned
+    test_eval_output("print = fun (x) 1; println(3)", "\n");
+
     eval_file("tests/list-sum.zeta");
     eval_file("tests/read_text_file.zeta");
 
@@ -6,6 +6,10 @@ the core parser. This interpreter only serves to allow the Zeta JIT compiler
 to compile itself, it should never need to be run after that point, hence
 I have cut some corners in terms of its implementation. The language
 semantics supported are limited.
+
+Evaluation runs in a loop over an explicit interpreter stack of segments
+allocated on the C heap (see eval_loop), rather than through C recursion,
+so that deep recursion in interpreted code is only limited by memory.
 */
 
 #ifndef __INTERP_H__
@@ -41,11 +45,37 @@ typedef struct clos
     /// Function this is a closure of
     ast_fun_t* fun;
 
-    /// Mutable cell pointers (for captured closure variables)
-    cell_t* cells[];
+    /// Captured variables, in the order of the free variables of the
+    /// function. Escaping variables are held in mutable cells, stored as
+    /// object values, the other variables are copied by value.
+    value_t vals[];
 
 } clos_t;
 
+/// Host function value types, parsed from signature strings
+#define HOST_VOID       0
+#define HOST_BOOL       1
+#define HOST_TAG        2
+#define HOST_INT32      3
+#define HOST_INT64      4
+#define HOST_FLOAT64    5
+#define HOST_STRING     6
+#define HOST_PTR        7
+#define HOST_MAP        8
+#define HOST_VALUE      9
+#define HOST_STRBUF     10
+#define HOST_ARRAY      11
+#define HOST_SIZE       12
+
+/// Maximum number of parameters of host functions
+#define HOSTFN_MAX_PARAMS 8
+
+struct hostfn;
+
+/// Trampoline calling a host function through a pointer of its C type,
+/// one per parameter pattern (see HOST_PATTERNS)
+typedef value_t (*host_tramp_t)(struct hostfn* fn, value_t* args);
+
 /**
 Host function wrapper
 */
@@ -65,15 +95,102 @@ typedef struct hostfn
     /// C function pointer
     void* fptr;
 
+    /// Return and parameter types, parsed from the signature string
+    uint8_t ret_type;
+    uint8_t param_types[HOSTFN_MAX_PARAMS];
+
+    /// Tag of the values returned
+    tag_t ret_tag;
+
+    /// Parameters which take heap objects of a given type, and parameters
+    /// whose values get converted to a narrower C type, one bit each
+    uint8_t obj_params;
+    uint8_t conv_params;
+
+    /// Trampoline for the C types of the parameters
+    host_tramp_t tramp;
+
 } hostfn_t;
 
+/// Number of value slots in a segment of the interpreter stack
+#define STACK_SEG_SLOTS (1 << 16)
+
+/**
+Segment of the interpreter stack
+
+The interpreter stack is made of contiguous segments, allocated as the
+stack grows. Groups of slots which must be contiguous, such as a frame
+and its local variables, never span two segments.
+*/
+typedef struct stack_seg
+{
+    /// Previous segment, and spare segment kept for reuse
+    struct stack_seg* prev;
+    struct stack_seg* next;
+
+    /// Top of the previous segment when the stack grew into this one
+    value_t* prev_sp;
+
+    /// End of the slots
+    value_t* limit;
+
+    /// Value slots
+    value_t slots[];
+
+} stack_seg_t;
+
+/**
+Continuation, on top of the values saved by its AST node
+This resumes the node once its child number idx has been evaluated
+A continuation with a NULL node returns from the current call
+*/
+typedef struct
+{
+    heapptr_t node;
+
+    uint32_t idx;
+
+} kont_t;
+
+/**
+Frame header of an interpreted call, followed by the local variables
+*/
+typedef struct frame
+{
+    /// Closure being called
+    clos_t* clos;
+
+    /// Local variable slots
+    value_t* locals;
+
+    /// Frame of the caller
+    struct frame* prev;
+
+    /// Call expression returned to, NULL if the call was made from C
+    /// or compiled code, in which case the evaluation loop returns
+    heapptr_t ret_node;
+
+    /// Top of the stack to restore when returning
+    struct stack_seg* ret_seg;
+    value_t* ret_sp;
+
+} frame_t;
+
+/// Number of stack slots taken by a frame header
+#define FRAME_SLOTS 3
+
 /// Shape indices for mutable cells, closures and host function wrappers
 extern shapeidx_t SHAPE_CELL;
 extern shapeidx_t SHAPE_CLOS;
 extern shapeidx_t SHAPE_HOSTFN;
 
+/// Frame of the current interpreted call
+extern frame_t* stack_fp;
+
 cell_t* cell_alloc();
 clos_t* clos_alloc(ast_fun_t* fun);
+clos_t* clos_shared(ast_fun_t* fun);
+bool host_sig_supported(uint8_t ret_type, uint8_t* param_types, uint32_t num_params);
 hostfn_t* hostfn_alloc(void* fptr, const char* name, const char* sig_str);
 
 void init_interp();
@@ -81,11 +198,25 @@ void init_runtime();
 
 void var_res_pass(ast_fun_t* fun, ast_fun_t* parent);
 
+bool eval_truth(value_t value);
+value_t eval_get_index(value_t base, value_t index);
+value_t eval_get_prop(value_t base, value_t prop_name);
+value_t eval_set_prop(value_t base, value_t prop_name, value_t val);
+value_t eval_binop(const opinfo_t* op, value_t v0, value_t v1);
+value_t eval_unop(const opinfo_t* op, value_t v0);
+stack_seg_t* stack_seg_alloc(size_t num_slots);
+frame_t* frame_push(clos_t* clos, uint32_t num_locals, heapptr_t ret_node);
+void kont_push(heapptr_t node, uint32_t idx, value_t* vals, uint32_t num_vals);
+value_t eval_loop(heapptr_t expr, value_t val);
+value_t call_clos(clos_t* callee, value_t* arg_vals, uint32_t num_args);
+value_t call_host(hostfn_t* callee, value_t* arg_vals, uint32_t num_args);
+value_t call_value(value_t callee, value_t* arg_vals, uint32_t num_args);
 value_t eval_expr(heapptr_t expr, clos_t* clos, value_t* locals);
 value_t eval_unit(ast_fun_t* unit_fun);
 value_t eval_string(const char* cstr, const char* src_name);
 value_t eval_file(const char* file_name);
 
+void test_eval_output(char* cstr, char* expected);
 void test_interp();
 void test_runtime();
 
@@ -0,0 +1,2339 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include "ir.h"
+#include "parser.h"
+#include "interp.h"
+#include "vm.h"
+
+//============================================================================
+// Opcodes and runtime helpers
+//============================================================================
+
+/// Values and arguments
+const irop_t IR_CONST = { "const", 0, IRF_PURE };
+const irop_t IR_CLOS = { "clos", 0, IRF_PURE };
+const irop_t IR_ARG = { "arg", 0, IRF_PURE };
+const irop_t IR_ARG_TAG = { "arg_tag", 0, IRF_PURE };
+const irop_t IR_PHI = { "phi", -1, IRF_REMOVABLE };
+const irop_t IR_COPY = { "copy", 1, IRF_PURE };
+
+/// Integer arithmetic, operating on value words
+const irop_t IR_ADD = { "add", 2, IRF_PURE };
+const irop_t IR_SUB = { "sub", 2, IRF_PURE };
+const irop_t IR_MUL = { "mul", 2, IRF_PURE };
+const irop_t IR_DIV = { "div", 2, IRF_PURE };
+const irop_t IR_MOD = { "mod", 2, IRF_PURE };
+const irop_t IR_NEG = { "neg", 1, IRF_PURE };
+
+/// Boolean operations, producing 0 or 1
+const irop_t IR_NOT = { "not", 1, IRF_PURE };
+const irop_t IR_AND = { "and", 2, IRF_PURE };
+
+/// Integer comparisons, producing 0 or 1
+const irop_t IR_LT = { "lt", 2, IRF_PURE };
+const irop_t IR_LE = { "le", 2, IRF_PURE };
+const irop_t IR_GT = { "gt", 2, IRF_PURE };
+const irop_t IR_GE = { "ge", 2, IRF_PURE };
+const irop_t IR_EQ = { "eq", 2, IRF_PURE };
+const irop_t IR_NE = { "ne", 2, IRF_PURE };
+
+/// Tag check, fails if the tag operand doesn't match the immediate
+/// The other operands are the deopt values (see deopt_info_t)
+const irop_t IR_GUARD_TAG = { "guard_tag", -1, 0 };
+
+/// Mutable cells and closures
+const irop_t IR_CELL_NEW = { "cell_new", 0, IRF_REMOVABLE | IRF_CALL };
+const irop_t IR_CELL_GET = { "cell_get", 1, IRF_REMOVABLE };
+const irop_t IR_CELL_GET_TAG = { "cell_get_tag", 1, IRF_REMOVABLE };
+const irop_t IR_CELL_SET = { "cell_set", 3, 0 };
+const irop_t IR_CLOS_VAL = { "clos_val", 1, IRF_PURE };
+const irop_t IR_CLOS_VAL_TAG = { "clos_val_tag", 1, IRF_PURE };
+const irop_t IR_NEW_CLOS = { "new_clos", -1, IRF_REMOVABLE | IRF_CALL };
+
+/// Global variable slots, the immediate is the slot index
+const irop_t IR_GLOBAL_GET = { "global_get", 0, IRF_REMOVABLE };
+const irop_t IR_GLOBAL_GET_TAG = { "global_get_tag", 0, IRF_REMOVABLE };
+const irop_t IR_GLOBAL_SET = { "global_set", 2, 0 };
+
+/// Calls, the tag of the value produced is read with proj_tag
+const irop_t IR_CALL = { "call", -1, IRF_CALL };
+const irop_t IR_CALL_RT = { "call_rt", -1, IRF_CALL };
+const irop_t IR_PROJ_TAG = { "proj_tag", 1, IRF_PURE };
+
+/// Control flow
+const irop_t IR_IF = { "if", 1, IRF_TERM };
+const irop_t IR_JUMP = { "jump", 0, IRF_TERM };
+const irop_t IR_RET = { "ret", 2, IRF_TERM };
+
+/**
+Runtime helper signalling an invalid assignment target
+*/
+void rt_invalid_assign()
+{
+    printf("invalid lhs expression in assignment\n");
+    exit(-1);
+}
+
+/// Runtime helpers, mostly entry points into the interpreter
+const ir_helper_t RT_BINOP = { "eval_binop", &eval_binop, 0 };
+const ir_helper_t RT_UNOP = { "eval_unop", &eval_unop, 0 };
+const ir_helper_t RT_SET_PROP = { "eval_set_prop", &eval_set_prop, 0 };
+const ir_helper_t RT_ARRAY_ALLOC = { "array_alloc", &array_alloc, IRF_REMOVABLE };
+const ir_helper_t RT_ARRAY_SET = { "array_set", &array_set, 0 };
+const ir_helper_t RT_OBJ_ALLOC = { "object_alloc", &object_alloc, IRF_REMOVABLE };
+const ir_helper_t RT_OBJ_SET_PROP = { "object_set_prop", &object_set_prop, 0 };
+const ir_helper_t RT_INVALID_ASSIGN = { "invalid_assign", &rt_invalid_assign, 0 };
+
+/**
+Test if an instruction is pure (can be value numbered)
+*/
+bool ir_is_pure(ir_instr_t* instr)
+{
+    if (instr->op == &IR_CALL_RT)
+        return ((ir_helper_t*)instr->ptr)->flags & IRF_PURE;
+
+    return instr->op->flags & IRF_PURE;
+}
+
+/**
+Test if an instruction can be removed when its output is unused
+*/
+bool ir_is_removable(ir_instr_t* instr)
+{
+    uint8_t flags = instr->op->flags;
+
+    if (instr->op == &IR_CALL_RT)
+        flags = ((ir_helper_t*)instr->ptr)->flags;
+
+    return flags & (IRF_PURE | IRF_REMOVABLE);
+}
+
+/**
+Test if an instruction produces an output value
+*/
+bool ir_has_value(ir_instr_t* instr)
+{
+    return !(
+        (instr->op->flags & IRF_TERM) ||
+        instr->op == &IR_GUARD_TAG ||
+        instr->op == &IR_CELL_SET ||
+        instr->op == &IR_GLOBAL_SET
+    );
+}
+
+//============================================================================
+// IR construction primitives
+//============================================================================
+
+ir_instr_t* ir_instr_alloc(ir_fun_t* fun, const irop_t* op)
+{
+    ir_instr_t* instr = calloc(1, sizeof(ir_instr_t));
+
+    instr->op = op;
+    instr->id = fun->num_instrs++;
+    instr->reg = -1;
+    instr->slot = -1;
+
+    instr->all_next = fun->all_instrs;
+    fun->all_instrs = instr;
+
+    return instr;
+}
+
+ir_block_t* ir_block_alloc(ir_fun_t* fun)
+{
+    ir_block_t* block = calloc(1, sizeof(ir_block_t));
+
+    block->id = fun->num_blocks++;
+
+    block->all_next = fun->all_blocks;
+    fun->all_blocks = block;
+
+    return block;
+}
+
+void ir_add_arg(ir_instr_t* instr, ir_instr_t* arg)
+{
+    assert (arg != NULL);
+
+    if (instr->num_args == instr->cap_args)
+    {
+        instr->cap_args = instr->cap_args? (2 * instr->cap_args):4;
+        instr->args = realloc(
+            instr->args,
+            sizeof(ir_instr_t*) * instr->cap_args
+        );
+    }
+
+    instr->args[instr->num_args++] = arg;
+}
+
+void ir_add_pred(ir_block_t* block, ir_block_t* pred)
+{
+    if (block->num_preds == block->cap_preds)
+    {
+        block->cap_preds = block->cap_preds? (2 * block->cap_preds):2;
+        block->preds = realloc(
+            block->preds,
+            sizeof(ir_block_t*) * block->cap_preds
+        );
+    }
+
+    block->preds[block->num_preds++] = pred;
+}
+
+/**
+Append an instruction at the end of a block
+*/
+void ir_append(ir_block_t* block, ir_instr_t* instr)
+{
+    assert (instr->block == NULL);
+
+    instr->block = block;
+    instr->prev = block->last;
+    instr->next = NULL;
+
+    if (block->last)
+        block->last->next = instr;
+    else
+        block->first = instr;
+
+    block->last = instr;
+}
+
+/**
+Insert an instruction before another one
+*/
+void ir_insert_before(ir_instr_t* pos, ir_instr_t* instr)
+{
+    assert (instr->block == NULL);
+
+    ir_block_t* block = pos->block;
+
+    instr->block = block;
+    instr->prev = pos->prev;
+    instr->next = pos;
+
+    if (pos->prev)
+        pos->prev->next = instr;
+    else
+        block->first = instr;
+
+    pos->prev = instr;
+}
+
+/**
+Unlink an instruction from its block
+The instruction memory is only reclaimed by ir_free
+*/
+void ir_remove(ir_instr_t* instr)
+{
+    ir_block_t* block = instr->block;
+    assert (block != NULL);
+
+    if (instr->prev)
+        instr->prev->next = instr->next;
+    else
+        block->first = instr->next;
+
+    if (instr->next)
+        instr->next->prev = instr->prev;
+    else
+        block->last = instr->prev;
+
+    instr->block = NULL;
+    instr->prev = NULL;
+    instr->next = NULL;
+}
+
+/**
+Turn an instruction into a copy of another value
+Uses of the instruction are redirected by ir_copy_prop
+*/
+void ir_replace(ir_instr_t* instr, ir_instr_t* val)
+{
+    assert (instr != val);
+
+    instr->op = &IR_COPY;
+    instr->num_args = 0;
+    instr->imm = 0;
+    instr->ptr = NULL;
+    ir_add_arg(instr, val);
+}
+
+/**
+Get a constant value, constants are kept at the head of the entry block
+*/
+ir_instr_t* ir_const(ir_fun_t* fun, int64_t imm)
+{
+    ir_block_t* entry = fun->entry;
+
+    for (ir_instr_t* instr = entry->first; instr; instr = instr->next)
+    {
+        if (instr->op != &IR_CONST)
+            break;
+
+        if (instr->imm == imm)
+            return instr;
+    }
+
+    ir_instr_t* cst = ir_instr_alloc(fun, &IR_CONST);
+    cst->imm = imm;
+
+    if (entry->first)
+        ir_insert_before(entry->first, cst);
+    else
+        ir_append(entry, cst);
+
+    return cst;
+}
+
+/**
+Get a constant heap pointer value
+*/
+ir_instr_t* ir_const_ptr(ir_fun_t* fun, heapptr_t ptr)
+{
+    ir_instr_t* cst = ir_const(fun, (int64_t)ptr);
+    cst->ptr = ptr;
+    return cst;
+}
+
+/**
+Remove the edge coming from a given predecessor block
+Phi operands for the edge are removed along with it
+*/
+void ir_remove_pred(ir_block_t* block, ir_block_t* pred)
+{
+    uint32_t idx;
+    for (idx = 0; idx < block->num_preds; ++idx)
+        if (block->preds[idx] == pred)
+            break;
+
+    assert (idx < block->num_preds);
+
+    for (uint32_t i = idx; i + 1 < block->num_preds; ++i)
+        block->preds[i] = block->preds[i+1];
+    block->num_preds--;
+
+    for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+    {
+        if (instr->op != &IR_PHI)
+            continue;
+
+        for (uint32_t i = idx; i + 1 < instr->num_args; ++i)
+            instr->args[i] = instr->args[i+1];
+        instr->num_args--;
+    }
+}
+
+/**
+Get the successors of a block, returns the number of successors
+*/
+uint32_t ir_succs(ir_block_t* block, ir_block_t** succs)
+{
+    ir_instr_t* term = block->last;
+    assert (term && (term->op->flags & IRF_TERM));
+
+    if (term->op == &IR_IF)
+    {
+        succs[0] = term->targets[0];
+        succs[1] = term->targets[1];
+        return 2;
+    }
+
+    if (term->op == &IR_JUMP)
+    {
+        succs[0] = term->targets[0];
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+Remove the blocks which have become unreachable
+*/
+bool ir_remove_unreachable(ir_fun_t* fun)
+{
+    bool changed = false;
+
+    // Blocks are in topological order, so a block only becomes
+    // unreachable because of blocks appearing before it
+    ir_block_t* prev = fun->entry;
+    for (ir_block_t* block = fun->entry->next; block; block = block->next)
+    {
+        if (block->num_preds > 0)
+        {
+            prev = block;
+            continue;
+        }
+
+        ir_block_t* succs[2];
+        uint32_t num_succs = ir_succs(block, succs);
+        for (uint32_t i = 0; i < num_succs; ++i)
+            ir_remove_pred(succs[i], block);
+
+        while (block->first)
+            ir_remove(block->first);
+
+        prev->next = block->next;
+        if (fun->last == block)
+            fun->last = prev;
+
+        changed = true;
+    }
+
+    return changed;
+}
+
+//============================================================================
+// IR construction from the AST
+//============================================================================
+
+/**
+Pair of IR values representing a Zeta value
+*/
+typedef struct
+{
+    ir_instr_t* word;
+
+    ir_instr_t* tag;
+
+} ir_val_t;
+
+/**
+IR builder state
+*/
+typedef struct
+{
+    ir_fun_t* irfun;
+
+    /// Function being translated
+    ast_fun_t* fun;
+
+    /// Current block
+    ir_block_t* block;
+
+    /// Current values of the local variables
+    /// Escaping variables are held in cells, their word is the cell pointer
+    ir_val_t* locals;
+
+    /// Closure of the function being translated
+    ir_instr_t* clos;
+
+    /// Continuation frames of the AST nodes being translated
+    /// The val_idx of these frames indexes into the saved values
+    deopt_frame_t* frames;
+    uint32_t num_frames;
+    uint32_t cap_frames;
+
+    /// Values saved by the continuation frames
+    ir_val_t* saved;
+    uint32_t num_saved;
+    uint32_t cap_saved;
+
+} ir_builder_t;
+
+ir_val_t build_expr(ir_builder_t* b, heapptr_t expr);
+
+/**
+Append a new instruction to the current block
+*/
+ir_instr_t* build_instr(ir_builder_t* b, const irop_t* op, int num_args, ...)
+{
+    ir_instr_t* instr = ir_instr_alloc(b->irfun, op);
+
+    va_list ap;
+    va_start(ap, num_args);
+    for (int i = 0; i < num_args; ++i)
+        ir_add_arg(instr, va_arg(ap, ir_instr_t*));
+    va_end(ap);
+
+    ir_append(b->block, instr);
+
+    return instr;
+}
+
+/**
+Append a runtime helper call producing a Zeta value
+*/
+ir_val_t build_call_rt(
+    ir_builder_t* b,
+    const ir_helper_t* helper,
+    int num_args,
+    ...
+)
+{
+    ir_instr_t* call = ir_instr_alloc(b->irfun, &IR_CALL_RT);
+    call->ptr = (void*)helper;
+
+    va_list ap;
+    va_start(ap, num_args);
+    for (int i = 0; i < num_args; ++i)
+        ir_add_arg(call, va_arg(ap, ir_instr_t*));
+    va_end(ap);
+
+    ir_append(b->block, call);
+
+    ir_val_t val = { call, build_instr(b, &IR_PROJ_TAG, 1, call) };
+    return val;
+}
+
+ir_val_t build_cst(ir_builder_t* b, value_t value)
+{
+    ir_val_t val = {
+        ir_const(b->irfun, value.word.int64),
+        ir_const(b->irfun, value.tag)
+    };
+
+    return val;
+}
+
+ir_val_t build_typed(ir_builder_t* b, ir_instr_t* word, tag_t tag)
+{
+    ir_val_t val = { word, ir_const(b->irfun, tag) };
+    return val;
+}
+
+/**
+Start filling a block, adding it to the topological order
+*/
+void build_start_block(ir_builder_t* b, ir_block_t* block)
+{
+    ir_fun_t* irfun = b->irfun;
+
+    irfun->last->next = block;
+    irfun->last = block;
+
+    b->block = block;
+}
+
+/**
+Terminate the current block with a jump
+*/
+void build_jump(ir_builder_t* b, ir_block_t* target)
+{
+    ir_instr_t* jump = build_instr(b, &IR_JUMP, 0);
+    jump->targets[0] = target;
+    ir_add_pred(target, b->block);
+}
+
+/**
+Read a value from a mutable cell
+*/
+ir_val_t build_cell_get(ir_builder_t* b, ir_instr_t* cell)
+{
+    ir_val_t val = {
+        build_instr(b, &IR_CELL_GET, 1, cell),
+        build_instr(b, &IR_CELL_GET_TAG, 1, cell)
+    };
+
+    return val;
+}
+
+/**
+Get the value captured by the closure for a free variable of the current
+function, which is the cell pointer for escaping variables
+*/
+ir_val_t build_free_val(ir_builder_t* b, uint32_t idx)
+{
+    assert (idx < b->fun->free_vars->len);
+
+    ir_val_t val = {
+        build_instr(b, &IR_CLOS_VAL, 1, b->clos),
+        build_instr(b, &IR_CLOS_VAL_TAG, 1, b->clos)
+    };
+    val.word->imm = idx;
+    val.tag->imm = idx;
+
+    return val;
+}
+
+/**
+Read a global variable. Globals only assigned by their declaration are
+known once the global unit has been initialized, and these are read as
+constants. The function is recorded as depending on the global, so that
+its code is invalidated if a later unit assigns the global.
+*/
+ir_val_t build_global_get(ir_builder_t* b, ast_decl_t* decl)
+{
+    assert (decl->global);
+    assert (decl->idx < vm.num_globals);
+
+    if (decl->num_assigns <= 1 && vm.global_clos != NULL)
+    {
+        if (decl->cst_deps == NULL)
+            decl->cst_deps = array_alloc(4);
+
+        bool found = false;
+        for (uint32_t i = 0; i < decl->cst_deps->len; ++i)
+            if (array_get(decl->cst_deps, i).word.fun == b->fun)
+                found = true;
+
+        if (!found)
+            array_append_obj(decl->cst_deps, (heapptr_t)b->fun);
+
+        return build_cst(b, vm.global_slots[decl->idx]);
+    }
+
+    ir_val_t val = {
+        build_instr(b, &IR_GLOBAL_GET, 0),
+        build_instr(b, &IR_GLOBAL_GET_TAG, 0)
+    };
+    val.word->imm = decl->idx;
+    val.tag->imm = decl->idx;
+
+    return val;
+}
+
+/**
+Write a global variable
+*/
+void build_global_set(ir_builder_t* b, ast_decl_t* decl, ir_val_t val)
+{
+    assert (decl->global);
+    assert (decl->idx < vm.num_globals);
+
+    ir_instr_t* set = build_instr(b, &IR_GLOBAL_SET, 2, val.word, val.tag);
+    set->imm = decl->idx;
+}
+
+/**
+Start translating a compound AST node
+*/
+void build_enter(ir_builder_t* b, heapptr_t node)
+{
+    if (b->num_frames == b->cap_frames)
+    {
+        b->cap_frames = b->cap_frames? (2 * b->cap_frames):8;
+        b->frames = realloc(b->frames, sizeof(deopt_frame_t) * b->cap_frames);
+    }
+
+    deopt_frame_t* frame = &b->frames[b->num_frames++];
+    frame->node = node;
+    frame->idx = 0;
+    frame->val_idx = b->num_saved;
+}
+
+/**
+Set the index of the child of the current node being translated
+*/
+void build_child(ir_builder_t* b, uint32_t idx)
+{
+    assert (b->num_frames > 0);
+    b->frames[b->num_frames - 1].idx = idx;
+}
+
+/**
+Save a value needed to resume the current node in the interpreter
+*/
+void build_save(ir_builder_t* b, ir_val_t val)
+{
+    if (b->num_saved == b->cap_saved)
+    {
+        b->cap_saved = b->cap_saved? (2 * b->cap_saved):16;
+        b->saved = realloc(b->saved, sizeof(ir_val_t) * b->cap_saved);
+    }
+
+    b->saved[b->num_saved++] = val;
+}
+
+/**
+Finish translating a compound AST node
+*/
+void build_leave(ir_builder_t* b)
+{
+    assert (b->num_frames > 0);
+    b->num_saved = b->frames[b->num_frames - 1].val_idx;
+    b->num_frames--;
+}
+
+/**
+Check that a tag matches an expected value, deoptimizing otherwise
+The current child of the innermost node is the one producing child_val
+*/
+void build_guard(ir_builder_t* b, ir_instr_t* tag, tag_t expected, ir_val_t child_val)
+{
+    size_t num_locals = b->fun->local_decls->len;
+
+    deopt_info_t* info = malloc(
+        sizeof(deopt_info_t) + sizeof(deopt_frame_t) * b->num_frames
+    );
+    info->num_locals = num_locals;
+    info->num_vals = num_locals + b->num_saved + 1;
+    info->num_frames = b->num_frames;
+
+    for (uint32_t i = 0; i < b->num_frames; ++i)
+    {
+        info->frames[i] = b->frames[i];
+        info->frames[i].val_idx += num_locals;
+    }
+
+    info->next = b->irfun->deopts;
+    b->irfun->deopts = info;
+
+    ir_instr_t* guard = build_instr(b, &IR_GUARD_TAG, 1, tag);
+    guard->imm = expected;
+    guard->ptr = info;
+
+    for (size_t i = 0; i < num_locals; ++i)
+    {
+        ir_add_arg(guard, b->locals[i].word);
+        ir_add_arg(guard, b->locals[i].tag);
+    }
+
+    for (uint32_t i = 0; i < b->num_saved; ++i)
+    {
+        ir_add_arg(guard, b->saved[i].word);
+        ir_add_arg(guard, b->saved[i].tag);
+    }
+
+    ir_add_arg(guard, child_val.word);
+    ir_add_arg(guard, child_val.tag);
+}
+
+/**
+Check that a value is a boolean and get its truth value
+This mirrors eval_truth
+*/
+ir_instr_t* build_truth(ir_builder_t* b, ir_val_t val)
+{
+    build_guard(b, val.tag, TAG_BOOL, val);
+    return val.word;
+}
+
+/**
+Translate the expressions of a sequence, starting at a given index
+*/
+ir_val_t build_seq(ir_builder_t* b, ast_seq_t* seqexpr, uint32_t start_idx)
+{
+    array_t* expr_list = seqexpr->expr_list;
+
+    ir_val_t value = build_cst(b, VAL_TRUE);
+
+    build_enter(b, (heapptr_t)seqexpr);
+
+    for (size_t i = start_idx; i < expr_list->len; ++i)
+    {
+        build_child(b, i);
+        value = build_expr(b, array_get_ptr(expr_list, i));
+    }
+
+    build_leave(b);
+
+    return value;
+}
+
+/**
+Test if values can be compared for equality by comparing their tags and
+words. This holds unless both could be strings, as equal data strings
+can be distinct objects. String constants are interned.
+*/
+bool ir_eq_by_word(ir_instr_t* tag0, ir_instr_t* word0, ir_instr_t* tag1, ir_instr_t* word1)
+{
+    if (tag0->op == &IR_CONST && tag0->imm != TAG_STRING)
+        return true;
+
+    if (tag1->op == &IR_CONST && tag1->imm != TAG_STRING)
+        return true;
+
+    return (
+        tag0->op == &IR_CONST && tag1->op == &IR_CONST &&
+        word0->op == &IR_CONST && word1->op == &IR_CONST
+    );
+}
+
+/**
+Translate an assignment of a value to an expression
+This mirrors eval_assign
+*/
+ir_val_t build_assign(ir_builder_t* b, heapptr_t lhs_expr, ir_val_t val)
+{
+    shapeidx_t shape = get_shape(lhs_expr);
+
+    // Assignment to variable declaration
+    if (shape == SHAPE_AST_DECL)
+    {
+        ast_decl_t* decl = (ast_decl_t*)lhs_expr;
+
+        if (decl->global)
+        {
+            build_global_set(b, decl, val);
+            return val;
+        }
+
+        if (decl->esc)
+        {
+            ir_instr_t* cell = b->locals[decl->idx].word;
+            build_instr(b, &IR_CELL_SET, 3, cell, val.word, val.tag);
+            return val;
+        }
+
+        b->locals[decl->idx] = val;
+        return val;
+    }
+
+    // Assignment to a variable
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)lhs_expr;
+        assert (ref->decl != NULL);
+
+        if (ref->decl->global)
+        {
+            build_global_set(b, ref->decl, val);
+            return val;
+        }
+
+        if (ref->decl->fun != b->fun)
+        {
+            assert (ref->decl->esc);
+            ir_instr_t* cell = build_free_val(b, ref->idx).word;
+            build_instr(b, &IR_CELL_SET, 3, cell, val.word, val.tag);
+            return val;
+        }
+
+        if (ref->decl->esc)
+        {
+            ir_instr_t* cell = b->locals[ref->idx].word;
+            build_instr(b, &IR_CELL_SET, 3, cell, val.word, val.tag);
+            return val;
+        }
+
+        b->locals[ref->idx] = val;
+        return val;
+    }
+
+    // Binary operator (e.g. a.b)
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)lhs_expr;
+
+        // The assigned value is saved by the assignment node
+        build_child(b, 1);
+        ir_val_t v0 = build_expr(b, binop->left_expr);
+        build_save(b, v0);
+        build_child(b, 2);
+        ir_val_t v1 = build_expr(b, binop->right_expr);
+
+        if (binop->op == &OP_MEMBER)
+        {
+            build_call_rt(
+                b,
+                &RT_SET_PROP,
+                6,
+                v0.word, v0.tag,
+                v1.word, v1.tag,
+                val.word, val.tag
+            );
+
+            return val;
+        }
+    }
+
+    build_call_rt(b, &RT_INVALID_ASSIGN, 0);
+    return val;
+}
+
+/**
+Translate an if expression, merging the local variable values with phis
+*/
+ir_val_t build_if(ir_builder_t* b, ast_if_t* ifexpr)
+{
+    ir_fun_t* irfun = b->irfun;
+    size_t num_locals = b->fun->local_decls->len;
+    size_t locals_size = sizeof(ir_val_t) * num_locals;
+
+    build_enter(b, (heapptr_t)ifexpr);
+
+    ir_val_t t = build_expr(b, ifexpr->test_expr);
+    ir_instr_t* cond = build_truth(b, t);
+
+    ir_block_t* then_block = ir_block_alloc(irfun);
+    ir_block_t* else_block = ir_block_alloc(irfun);
+    ir_block_t* join_block = ir_block_alloc(irfun);
+
+    ir_instr_t* branch = build_instr(b, &IR_IF, 1, cond);
+    branch->targets[0] = then_block;
+    branch->targets[1] = else_block;
+    ir_add_pred(then_block, b->block);
+    ir_add_pred(else_block, b->block);
+
+    // Local variable values before the branch
+    ir_val_t* entry_locals = malloc(locals_size);
+    memcpy(entry_locals, b->locals, locals_size);
+
+    build_start_block(b, then_block);
+    build_child(b, 1);
+    ir_val_t then_val = build_expr(b, ifexpr->then_expr);
+    build_jump(b, join_block);
+
+    // Local variable values at the end of the then branch
+    ir_val_t* then_locals = malloc(locals_size);
+    memcpy(then_locals, b->locals, locals_size);
+    memcpy(b->locals, entry_locals, locals_size);
+
+    build_start_block(b, else_block);
+    build_child(b, 2);
+    ir_val_t else_val = build_expr(b, ifexpr->else_expr);
+    build_jump(b, join_block);
+
+    build_start_block(b, join_block);
+    build_leave(b);
+
+    // Merge the values of the local variables
+    for (size_t i = 0; i < num_locals; ++i)
+    {
+        if (then_locals[i].word != b->locals[i].word)
+            b->locals[i].word = build_instr(b, &IR_PHI, 2, then_locals[i].word, b->locals[i].word);
+        if (then_locals[i].tag != b->locals[i].tag)
+            b->locals[i].tag = build_instr(b, &IR_PHI, 2, then_locals[i].tag, b->locals[i].tag);
+    }
+
+    free(entry_locals);
+    free(then_locals);
+
+    ir_val_t val = {
+        build_instr(b, &IR_PHI, 2, then_val.word, else_val.word),
+        build_instr(b, &IR_PHI, 2, then_val.tag, else_val.tag)
+    };
+
+    return val;
+}
+
+/**
+Translate an expression, this mirrors eval_expr
+*/
+ir_val_t build_expr(ir_builder_t* b, heapptr_t expr)
+{
+    ir_fun_t* irfun = b->irfun;
+
+    shapeidx_t shape = get_shape(expr);
+
+    // Variable or constant declaration (let/var)
+    if (shape == SHAPE_AST_DECL)
+    {
+        return build_cst(b, VAL_FALSE);
+    }
+
+    // Variable reference (read)
+    if (shape == SHAPE_AST_REF)
+    {
+        ast_ref_t* ref = (ast_ref_t*)expr;
+        assert (ref->decl != NULL);
+
+        // Global variables are read from their slot
+        if (ref->decl->global)
+            return build_global_get(b, ref->decl);
+
+        // If this is a variable from an outer function
+        // Variables which can change are read from their cell
+        if (ref->decl->fun != b->fun)
+        {
+            ir_val_t val = build_free_val(b, ref->idx);
+            return ref->decl->esc? build_cell_get(b, val.word):val;
+        }
+
+        // If this an escaping variable (captured by a closure)
+        if (ref->decl->esc)
+            return build_cell_get(b, b->locals[ref->idx].word);
+
+        return b->locals[ref->idx];
+    }
+
+    if (shape == SHAPE_AST_CONST)
+    {
+        ast_const_t* cst = (ast_const_t*)expr;
+        return build_cst(b, cst->val);
+    }
+
+    if (shape == SHAPE_STRING)
+    {
+        return build_typed(b, ir_const_ptr(irfun, expr), TAG_STRING);
+    }
+
+    // Array literal expression
+    if (shape == SHAPE_ARRAY)
+    {
+        array_t* array_expr = (array_t*)expr;
+
+        ir_val_t array = build_call_rt(
+            b,
+            &RT_ARRAY_ALLOC,
+            1,
+            ir_const(irfun, array_expr->len)
+        );
+        array.tag = ir_const(irfun, TAG_ARRAY);
+
+        build_enter(b, expr);
+        build_save(b, array);
+
+        for (size_t i = 0; i < array_expr->len; ++i)
+        {
+            build_child(b, i);
+            ir_val_t elem = build_expr(b, array_get_ptr(array_expr, i));
+
+            build_call_rt(
+                b,
+                &RT_ARRAY_SET,
+                4,
+                array.word,
+                ir_const(irfun, i),
+                elem.word,
+                elem.tag
+            );
+        }
+
+        build_leave(b);
+
+        return array;
+    }
+
+    // Object literal expression
+    if (shape == SHAPE_AST_OBJ)
+    {
+        ast_obj_t* obj_expr = (ast_obj_t*)expr;
+
+        ir_val_t obj = build_call_rt(
+            b,
+            &RT_OBJ_ALLOC,
+            1,
+            ir_const(irfun, OBJ_MIN_CAP)
+        );
+        obj.tag = ir_const(irfun, TAG_OBJECT);
+
+        build_enter(b, expr);
+        build_save(b, obj);
+
+        for (size_t i = 0; i < obj_expr->name_strs->len; ++i)
+        {
+            heapptr_t prop_name = array_get_ptr(obj_expr->name_strs, i);
+            heapptr_t val_expr = array_get_ptr(obj_expr->val_exprs, i);
+
+            build_child(b, i);
+            ir_val_t val = build_expr(b, val_expr);
+
+            build_call_rt(
+                b,
+                &RT_OBJ_SET_PROP,
+                5,
+                obj.word,
+                ir_const_ptr(irfun, prop_name),
+                val.word,
+                val.tag,
+                ir_const(irfun, ATTR_DEFAULT)
+            );
+        }
+
+        build_leave(b);
+
+        return obj;
+    }
+
+    // Binary operator (e.g. a + b)
+    if (shape == SHAPE_AST_BINOP)
+    {
+        ast_binop_t* binop = (ast_binop_t*)expr;
+        const opinfo_t* op = binop->op;
+
+        build_enter(b, expr);
+
+        if (op == &OP_ASSIGN)
+        {
+            ir_val_t val = build_expr(b, binop->right_expr);
+            build_save(b, val);
+            val = build_assign(b, binop->left_expr, val);
+            build_leave(b);
+            return val;
+        }
+
+        ir_val_t v0 = build_expr(b, binop->left_expr);
+        build_save(b, v0);
+        build_child(b, 1);
+        ir_val_t v1 = build_expr(b, binop->right_expr);
+
+        // Speculate that <= and >= apply to integers, deoptimizing
+        // to the interpreter if this turns out to be wrong
+        if ((op == &OP_LE || op == &OP_GE) && b->fun->num_deopts == 0)
+        {
+            build_guard(b, v0.tag, TAG_INT64, v1);
+            build_guard(b, v1.tag, TAG_INT64, v1);
+        }
+
+        build_leave(b);
+
+        if (op == &OP_ADD)
+            return build_typed(b, build_instr(b, &IR_ADD, 2, v0.word, v1.word), TAG_INT64);
+        if (op == &OP_SUB)
+            return build_typed(b, build_instr(b, &IR_SUB, 2, v0.word, v1.word), TAG_INT64);
+        if (op == &OP_MUL)
+            return build_typed(b, build_instr(b, &IR_MUL, 2, v0.word, v1.word), TAG_INT64);
+        if (op == &OP_DIV)
+            return build_typed(b, build_instr(b, &IR_DIV, 2, v0.word, v1.word), TAG_INT64);
+        if (op == &OP_MOD)
+            return build_typed(b, build_instr(b, &IR_MOD, 2, v0.word, v1.word), TAG_INT64);
+
+        if (op == &OP_LT)
+            return build_typed(b, build_instr(b, &IR_LT, 2, v0.word, v1.word), TAG_BOOL);
+        if (op == &OP_GT)
+            return build_typed(b, build_instr(b, &IR_GT, 2, v0.word, v1.word), TAG_BOOL);
+
+        // Equality is a comparison of both the tags and the words, unless
+        // both operands could be strings, which are compared by content
+        // (see ir_eq_by_word)
+        if ((op == &OP_EQ || op == &OP_NE) && ir_eq_by_word(v0.tag, v0.word, v1.tag, v1.word))
+        {
+            ir_instr_t* eq = build_instr(
+                b,
+                &IR_AND,
+                2,
+                build_instr(b, &IR_EQ, 2, v0.tag, v1.tag),
+                build_instr(b, &IR_EQ, 2, v0.word, v1.word)
+            );
+
+            if (op == &OP_NE)
+                eq = build_instr(b, &IR_NOT, 1, eq);
+
+            return build_typed(b, eq, TAG_BOOL);
+        }
+
+        // Other operators, including <= and >= which also apply to strings,
+        // are handled by the interpreter until the operand tags are known
+        return build_call_rt(
+            b,
+            &RT_BINOP,
+            5,
+            ir_const(irfun, (int64_t)op),
+            v0.word, v0.tag,
+            v1.word, v1.tag
+        );
+    }
+
+    // Unary operator (e.g.: -x, not a)
+    if (shape == SHAPE_AST_UNOP)
+    {
+        ast_unop_t* unop = (ast_unop_t*)expr;
+
+        build_enter(b, expr);
+        ir_val_t v0 = build_expr(b, unop->expr);
+
+        // The truth check is done while the unary node is being evaluated
+        if (unop->op == &OP_NOT)
+        {
+            ir_instr_t* truth = build_truth(b, v0);
+            build_leave(b);
+            return build_typed(b, build_instr(b, &IR_NOT, 1, truth), TAG_BOOL);
+        }
+
+        build_leave(b);
+
+        if (unop->op == &OP_NEG)
+            return build_typed(b, build_instr(b, &IR_NEG, 1, v0.word), TAG_INT64);
+
+        return build_call_rt(
+            b,
+            &RT_UNOP,
+            3,
+            ir_const(irfun, (int64_t)unop->op),
+            v0.word, v0.tag
+        );
+    }
+
+    // Sequence/block expression
+    if (shape == SHAPE_AST_SEQ)
+    {
+        return build_seq(b, (ast_seq_t*)expr, 0);
+    }
+
+    // If expression
+    if (shape == SHAPE_AST_IF)
+    {
+        return build_if(b, (ast_if_t*)expr);
+    }
+
+    // Function/closure expression
+    if (shape == SHAPE_AST_FUN)
+    {
+        ast_fun_t* nested = (ast_fun_t*)expr;
+
+        // Closures which capture nothing are shared, and constant
+        if (nested->free_vars->len == 0)
+        {
+            clos_t* clos = clos_shared(nested);
+            return build_cst(b, value_from_heapptr((heapptr_t)clos, TAG_CLOS));
+        }
+
+        ir_instr_t* new_clos = ir_instr_alloc(irfun, &IR_NEW_CLOS);
+        new_clos->ptr = nested;
+
+        // Gather the values captured for the free variables of the nested
+        // function, as word and tag pairs
+        for (size_t i = 0; i < nested->free_vars->len; ++i)
+        {
+            uint32_t idx = nested->capt_map[i];
+
+            ir_val_t val;
+            if (idx & CAPT_LOCAL)
+                val = b->locals[idx & ~CAPT_LOCAL];
+            else
+                val = build_free_val(b, idx);
+
+            ir_add_arg(new_clos, val.word);
+            ir_add_arg(new_clos, val.tag);
+        }
+
+        ir_append(b->block, new_clos);
+
+        return build_typed(b, new_clos, TAG_CLOS);
+    }
+
+    // Call expression
+    if (shape == SHAPE_AST_CALL)
+    {
+        ast_call_t* callexpr = (ast_call_t*)expr;
+        array_t* arg_exprs = callexpr->arg_exprs;
+
+        build_enter(b, expr);
+
+        ir_val_t callee = build_expr(b, callexpr->fun_expr);
+        build_save(b, callee);
+
+        ir_instr_t* call = ir_instr_alloc(irfun, &IR_CALL);
+        call->ptr = callexpr;
+        ir_add_arg(call, callee.word);
+        ir_add_arg(call, callee.tag);
+
+        for (size_t i = 0; i < arg_exprs->len; ++i)
+        {
+            build_child(b, i + 1);
+            ir_val_t arg = build_expr(b, array_get_ptr(arg_exprs, i));
+            build_save(b, arg);
+            ir_add_arg(call, arg.word);
+            ir_add_arg(call, arg.tag);
+        }
+
+        build_leave(b);
+
+        ir_append(b->block, call);
+
+        ir_val_t val = { call, build_instr(b, &IR_PROJ_TAG, 1, call) };
+        return val;
+    }
+
+    printf("ir error, unknown expression type, shapeidx=%d\n", shape);
+    exit(-1);
+}
+
+/**
+Initialize a builder for a new IR function
+*/
+void build_init(ir_builder_t* b, ast_fun_t* fun)
+{
+    ir_fun_t* irfun = calloc(1, sizeof(ir_fun_t));
+    irfun->fun = fun;
+    irfun->entry = ir_block_alloc(irfun);
+    irfun->last = irfun->entry;
+
+    b->irfun = irfun;
+    b->fun = fun;
+    b->block = irfun->entry;
+    b->locals = malloc(sizeof(ir_val_t) * (fun->local_decls->len + 1));
+    b->frames = NULL;
+    b->num_frames = 0;
+    b->cap_frames = 0;
+    b->saved = NULL;
+    b->num_saved = 0;
+    b->cap_saved = 0;
+    b->clos = build_instr(b, &IR_CLOS, 0);
+}
+
+/**
+Return a value from the function being built and free the builder
+*/
+ir_fun_t* build_finish(ir_builder_t* b, ir_val_t ret_val)
+{
+    build_instr(b, &IR_RET, 2, ret_val.word, ret_val.tag);
+
+    assert (b->num_frames == 0);
+    free(b->locals);
+    free(b->frames);
+    free(b->saved);
+
+    return b->irfun;
+}
+
+/**
+Build the IR for a resolved function
+*/
+ir_fun_t* ir_build(ast_fun_t* fun)
+{
+    size_t num_locals = fun->local_decls->len;
+
+    ir_builder_t b;
+    build_init(&b, fun);
+
+    // Locals which are never assigned read as false
+    for (size_t i = 0; i < num_locals; ++i)
+        b.locals[i] = build_cst(&b, VAL_FALSE);
+
+    // Allocate mutable cells for the escaping variables
+    for (size_t i = 0; i < fun->esc_locals->len; ++i)
+    {
+        ast_decl_t* decl = array_get(fun->esc_locals, i).word.decl;
+        assert (decl->esc);
+        assert (decl->idx < num_locals);
+        b.locals[decl->idx] = build_typed(
+            &b,
+            build_instr(&b, &IR_CELL_NEW, 0),
+            TAG_OBJECT
+        );
+    }
+
+    // Assign the argument values to the parameters
+    for (size_t i = 0; i < fun->param_decls->len; ++i)
+    {
+        ir_val_t arg = {
+            build_instr(&b, &IR_ARG, 0),
+            build_instr(&b, &IR_ARG_TAG, 0)
+        };
+        arg.word->imm = i;
+        arg.tag->imm = i;
+
+        build_assign(&b, array_get_ptr(fun->param_decls, i), arg);
+    }
+
+    ir_val_t ret_val = build_expr(&b, fun->body_expr);
+    return build_finish(&b, ret_val);
+}
+
+/**
+Build the IR for an on-stack replacement entry point, which resumes an
+interpreted call of a function at a given statement of its body
+
+The compiled code is passed the local variable slots of the interpreter
+frame in place of the arguments. Escaping variables already hold their
+cells there.
+*/
+ir_fun_t* ir_build_osr(ast_fun_t* fun, uint32_t stmt_idx)
+{
+    assert (get_shape(fun->body_expr) == SHAPE_AST_SEQ);
+    ast_seq_t* body = (ast_seq_t*)fun->body_expr;
+    assert (stmt_idx < body->expr_list->len);
+
+    ir_builder_t b;
+    build_init(&b, fun);
+
+    for (size_t i = 0; i < fun->local_decls->len; ++i)
+    {
+        b.locals[i].word = build_instr(&b, &IR_ARG, 0);
+        b.locals[i].tag = build_instr(&b, &IR_ARG_TAG, 0);
+        b.locals[i].word->imm = i;
+        b.locals[i].tag->imm = i;
+    }
+
+    ir_val_t ret_val = build_seq(&b, body, stmt_idx);
+    return build_finish(&b, ret_val);
+}
+
+/**
+Free the memory associated with an IR function
+*/
+void ir_free(ir_fun_t* fun)
+{
+    for (ir_instr_t* instr = fun->all_instrs; instr;)
+    {
+        ir_instr_t* next = instr->all_next;
+        free(instr->args);
+        free(instr);
+        instr = next;
+    }
+
+    for (ir_block_t* block = fun->all_blocks; block;)
+    {
+        ir_block_t* next = block->all_next;
+        free(block->preds);
+        free(block);
+        block = next;
+    }
+
+    for (deopt_info_t* info = fun->deopts; info;)
+    {
+        deopt_info_t* next = info->next;
+        free(info);
+        info = next;
+    }
+
+    free(fun);
+}
+
+//============================================================================
+// Analyses
+//============================================================================
+
+/**
+Compute the immediate dominators and topological order indices
+This is the Cooper-Harvey-Kennedy algorithm, a single iteration suffices
+since the control flow graph is acyclic
+*/
+void ir_compute_doms(ir_fun_t* fun)
+{
+    uint32_t order = 0;
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        block->order = order++;
+        block->idom = NULL;
+    }
+
+    fun->entry->idom = fun->entry;
+
+    for (ir_block_t* block = fun->entry->next; block; block = block->next)
+    {
+        assert (block->num_preds > 0);
+
+        ir_block_t* idom = block->preds[0];
+
+        for (uint32_t i = 1; i < block->num_preds; ++i)
+        {
+            ir_block_t* other = block->preds[i];
+
+            while (idom != other)
+            {
+                while (idom->order > other->order)
+                    idom = idom->idom;
+                while (other->order > idom->order)
+                    other = other->idom;
+            }
+        }
+
+        block->idom = idom;
+    }
+}
+
+/**
+Test if block a dominates block b
+Requires up to date dominator information
+*/
+bool ir_dominates(ir_block_t* a, ir_block_t* b)
+{
+    for (;;)
+    {
+        if (b == a)
+            return true;
+
+        if (b->idom == b)
+            return false;
+
+        b = b->idom;
+    }
+}
+
+/**
+Test if an instruction dominates a given use
+For phi uses, the value is used at the end of the matching predecessor
+*/
+bool ir_dominates_use(ir_instr_t* def, ir_instr_t* use, uint32_t arg_idx)
+{
+    ir_block_t* use_block = use->block;
+
+    if (use->op == &IR_PHI)
+    {
+        use_block = use_block->preds[arg_idx];
+
+        if (def->block == use_block)
+            return true;
+    }
+    else if (def->block == use_block)
+    {
+        // Scan forward from the definition
+        for (ir_instr_t* instr = def->next; instr; instr = instr->next)
+            if (instr == use)
+                return true;
+
+        return false;
+    }
+
+    return ir_dominates(def->block, use_block);
+}
+
+//============================================================================
+// Optimization passes
+//============================================================================
+
+/**
+Evaluate a pure integer operation on constant operands
+Returns false if the operation can't be folded
+*/
+bool fold_op(const irop_t* op, int64_t a, int64_t b, int64_t* out)
+{
+    uint64_t ua = a;
+    uint64_t ub = b;
+
+    // Note: integer overflow wraps around as part of normal semantics
+    if (op == &IR_ADD) { *out = (int64_t)(ua + ub); return true; }
+    if (op == &IR_SUB) { *out = (int64_t)(ua - ub); return true; }
+    if (op == &IR_MUL) { *out = (int64_t)(ua * ub); return true; }
+    if (op == &IR_NEG) { *out = (int64_t)(0 - ua); return true; }
+    if (op == &IR_NOT) { *out = (a == 0); return true; }
+    if (op == &IR_AND) { *out = a & b; return true; }
+    if (op == &IR_LT) { *out = a < b; return true; }
+    if (op == &IR_LE) { *out = a <= b; return true; }
+    if (op == &IR_GT) { *out = a > b; return true; }
+    if (op == &IR_GE) { *out = a >= b; return true; }
+    if (op == &IR_EQ) { *out = a == b; return true; }
+    if (op == &IR_NE) { *out = a != b; return true; }
+
+    // Division by zero and overflowing division are left to trap at run time
+    if (op == &IR_DIV || op == &IR_MOD)
+    {
+        if (b == 0 || (a == INT64_MIN && b == -1))
+            return false;
+
+        *out = (op == &IR_DIV)? (a / b):(a % b);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+Constant folding
+Also folds branches on constant conditions and removes dead blocks
+*/
+bool ir_const_fold(ir_fun_t* fun)
+{
+    bool changed = false;
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr;)
+        {
+            ir_instr_t* next = instr->next;
+            const irop_t* op = instr->op;
+
+            bool all_cst = instr->num_args > 0;
+            for (uint32_t i = 0; i < instr->num_args; ++i)
+                if (instr->args[i]->op != &IR_CONST)
+                    all_cst = false;
+
+            // Arithmetic, comparisons and boolean operations
+            if ((op->flags & IRF_PURE) && op->arity > 0 && all_cst)
+            {
+                int64_t a = instr->args[0]->imm;
+                int64_t b = (instr->num_args > 1)? instr->args[1]->imm:0;
+                int64_t out;
+
+                if (fold_op(op, a, b, &out))
+                {
+                    ir_replace(instr, ir_const(fun, out));
+                    changed = true;
+                }
+            }
+
+            // Comparisons of a value with itself
+            else if ((op == &IR_EQ || op == &IR_NE) &&
+                     instr->args[0] == instr->args[1])
+            {
+                ir_replace(instr, ir_const(fun, op == &IR_EQ));
+                changed = true;
+            }
+
+            // Conjunction with false
+            else if (op == &IR_AND &&
+                     ((instr->args[0]->op == &IR_CONST && instr->args[0]->imm == 0) ||
+                      (instr->args[1]->op == &IR_CONST && instr->args[1]->imm == 0)))
+            {
+                ir_replace(instr, ir_const(fun, 0));
+                changed = true;
+            }
+
+            // Phi nodes with a single distinct input
+            else if (op == &IR_PHI)
+            {
+                bool same = true;
+                for (uint32_t i = 1; i < instr->num_args; ++i)
+                    if (instr->args[i] != instr->args[0])
+                        same = false;
+
+                if (same && instr->args[0] != instr)
+                {
+                    ir_replace(instr, instr->args[0]);
+                    changed = true;
+                }
+            }
+
+            // Tag checks on a known tag that succeed
+            else if (op == &IR_GUARD_TAG &&
+                     instr->args[0]->op == &IR_CONST &&
+                     instr->args[0]->imm == instr->imm)
+            {
+                ir_remove(instr);
+                changed = true;
+            }
+
+            // Branches on a constant condition
+            else if (op == &IR_IF && all_cst)
+            {
+                ir_block_t* taken = instr->targets[instr->args[0]->imm? 0:1];
+                ir_block_t* not_taken = instr->targets[instr->args[0]->imm? 1:0];
+
+                ir_remove_pred(not_taken, block);
+
+                instr->op = &IR_JUMP;
+                instr->num_args = 0;
+                instr->targets[0] = taken;
+                instr->targets[1] = NULL;
+
+                changed = true;
+            }
+
+            instr = next;
+        }
+    }
+
+    if (ir_remove_unreachable(fun))
+        changed = true;
+
+    return changed;
+}
+
+/**
+Copy propagation, redirects uses of copies to the copied values
+*/
+bool ir_copy_prop(ir_fun_t* fun)
+{
+    bool changed = false;
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            for (uint32_t i = 0; i < instr->num_args; ++i)
+            {
+                while (instr->args[i]->op == &IR_COPY)
+                {
+                    instr->args[i] = instr->args[i]->args[0];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // The copies are now unused
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr;)
+        {
+            ir_instr_t* next = instr->next;
+            if (instr->op == &IR_COPY)
+                ir_remove(instr);
+            instr = next;
+        }
+    }
+
+    return changed;
+}
+
+/**
+Dead code elimination, removes unused instructions without side effects
+*/
+bool ir_dce(ir_fun_t* fun)
+{
+    bool changed = false;
+
+    size_t stack_cap = fun->num_instrs;
+    ir_instr_t** stack = malloc(sizeof(ir_instr_t*) * stack_cap);
+    size_t stack_len = 0;
+
+    // Mark the instructions with side effects as live
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            instr->mark = !ir_is_removable(instr);
+
+            if (instr->mark)
+                stack[stack_len++] = instr;
+        }
+    }
+
+    // Propagate liveness to the operands
+    while (stack_len > 0)
+    {
+        ir_instr_t* instr = stack[--stack_len];
+
+        for (uint32_t i = 0; i < instr->num_args; ++i)
+        {
+            ir_instr_t* arg = instr->args[i];
+            if (arg->mark)
+                continue;
+
+            arg->mark = true;
+            assert (stack_len < stack_cap);
+            stack[stack_len++] = arg;
+        }
+    }
+
+    free(stack);
+
+    // Remove the instructions which are not live
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr;)
+        {
+            ir_instr_t* next = instr->next;
+
+            if (!instr->mark)
+            {
+                ir_remove(instr);
+                changed = true;
+            }
+
+            instr = next;
+        }
+    }
+
+    return changed;
+}
+
+/**
+Value numbering hash table entry
+*/
+typedef struct gvn_entry
+{
+    ir_instr_t* instr;
+
+    struct gvn_entry* next;
+
+} gvn_entry_t;
+
+uint64_t gvn_hash(ir_instr_t* instr)
+{
+    uint64_t h = (uint64_t)instr->op;
+    h = h * 31 + (uint64_t)instr->imm;
+    h = h * 31 + (uint64_t)instr->ptr;
+
+    for (uint32_t i = 0; i < instr->num_args; ++i)
+        h = h * 31 + (uint64_t)instr->args[i];
+
+    return h ^ (h >> 29);
+}
+
+bool gvn_equal(ir_instr_t* a, ir_instr_t* b)
+{
+    if (a->op != b->op || a->imm != b->imm || a->ptr != b->ptr)
+        return false;
+
+    if (a->num_args != b->num_args)
+        return false;
+
+    for (uint32_t i = 0; i < a->num_args; ++i)
+        if (a->args[i] != b->args[i])
+            return false;
+
+    return true;
+}
+
+/**
+Global value numbering
+Replaces pure instructions by an equivalent dominating instruction
+*/
+bool ir_gvn(ir_fun_t* fun)
+{
+    bool changed = false;
+
+    ir_compute_doms(fun);
+
+    size_t num_buckets = 16;
+    while (num_buckets < 2 * fun->num_instrs)
+        num_buckets *= 2;
+
+    gvn_entry_t** buckets = calloc(num_buckets, sizeof(gvn_entry_t*));
+
+    // Blocks are visited in topological order, so that any dominating
+    // instruction has already been added to the table
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (!ir_is_pure(instr) || instr->op == &IR_COPY)
+                continue;
+
+            size_t idx = gvn_hash(instr) & (num_buckets - 1);
+
+            gvn_entry_t* entry;
+            for (entry = buckets[idx]; entry; entry = entry->next)
+            {
+                if (gvn_equal(entry->instr, instr) &&
+                    ir_dominates(entry->instr->block, block))
+                    break;
+            }
+
+            if (entry)
+            {
+                ir_replace(instr, entry->instr);
+                changed = true;
+                continue;
+            }
+
+            entry = malloc(sizeof(gvn_entry_t));
+            entry->instr = instr;
+            entry->next = buckets[idx];
+            buckets[idx] = entry;
+        }
+    }
+
+    for (size_t i = 0; i < num_buckets; ++i)
+    {
+        for (gvn_entry_t* entry = buckets[i]; entry;)
+        {
+            gvn_entry_t* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+
+    free(buckets);
+
+    return changed;
+}
+
+/**
+Tag check elimination
+A successful tag check establishes the tag of a value for all the uses
+it dominates, which lets the other passes remove redundant checks and
+specialize generic operations on values of known types
+*/
+bool ir_tag_elim(ir_fun_t* fun)
+{
+    bool changed = false;
+
+    ir_compute_doms(fun);
+
+    for (ir_block_t* gblock = fun->entry; gblock; gblock = gblock->next)
+    {
+        for (ir_instr_t* guard = gblock->first; guard; guard = guard->next)
+        {
+            if (guard->op != &IR_GUARD_TAG)
+                continue;
+
+            ir_instr_t* tag = guard->args[0];
+            if (tag->op == &IR_CONST)
+                continue;
+
+            // The constant is only created if there are uses to replace,
+            // otherwise DCE would remove it and the passes never settle
+            ir_instr_t* known = NULL;
+
+            // Replace the uses of the tag dominated by the check
+            for (ir_block_t* block = gblock; block; block = block->next)
+            {
+                for (ir_instr_t* use = block->first; use; use = use->next)
+                {
+                    for (uint32_t i = 0; i < use->num_args; ++i)
+                    {
+                        if (use->args[i] != tag || use == guard)
+                            continue;
+
+                        if (!ir_dominates_use(guard, use, i))
+                            continue;
+
+                        if (known == NULL)
+                            known = ir_const(fun, guard->imm);
+
+                        use->args[i] = known;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Specialize the generic comparisons on integer operands, and the
+    // equality comparisons once both operand tags are known
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (instr->op != &IR_CALL_RT || instr->ptr != &RT_BINOP)
+                continue;
+
+            const opinfo_t* op = (const opinfo_t*)instr->args[0]->imm;
+            ir_instr_t* word0 = instr->args[1];
+            ir_instr_t* tag0 = instr->args[2];
+            ir_instr_t* word1 = instr->args[3];
+            ir_instr_t* tag1 = instr->args[4];
+
+            if (tag0->op != &IR_CONST || tag1->op != &IR_CONST)
+                continue;
+
+            const irop_t* new_op;
+
+            if (op == &OP_LE || op == &OP_GE)
+            {
+                if (tag0->imm != TAG_INT64 || tag1->imm != TAG_INT64)
+                    continue;
+
+                new_op = (op == &OP_LE)? &IR_LE:&IR_GE;
+            }
+            else if (op == &OP_EQ || op == &OP_NE)
+            {
+                if (!ir_eq_by_word(tag0, word0, tag1, word1))
+                    continue;
+
+                // Values with different tags are never equal
+                if (tag0->imm != tag1->imm)
+                {
+                    word0 = tag0;
+                    word1 = tag1;
+                }
+
+                new_op = (op == &OP_EQ)? &IR_EQ:&IR_NE;
+            }
+            else
+            {
+                continue;
+            }
+
+            instr->op = new_op;
+            instr->ptr = NULL;
+            instr->num_args = 0;
+            ir_add_arg(instr, word0);
+            ir_add_arg(instr, word1);
+
+            // The result tag projection is now known
+            ir_instr_t* proj = instr->next;
+            assert (proj && proj->op == &IR_PROJ_TAG && proj->args[0] == instr);
+            ir_replace(proj, ir_const(fun, TAG_BOOL));
+
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/**
+Run the optimization passes until a fixed point is reached
+*/
+void ir_optimize(ir_fun_t* fun)
+{
+    for (;;)
+    {
+        bool changed = false;
+
+        changed |= ir_const_fold(fun);
+        ir_copy_prop(fun);
+        changed |= ir_tag_elim(fun);
+        changed |= ir_const_fold(fun);
+        ir_copy_prop(fun);
+        changed |= ir_gvn(fun);
+        ir_copy_prop(fun);
+        changed |= ir_dce(fun);
+
+        if (!changed)
+            break;
+    }
+
+    ir_compute_doms(fun);
+}
+
+//============================================================================
+// Verification and dumping
+//============================================================================
+
+/**
+Verify the consistency of an IR function
+*/
+bool ir_verify(ir_fun_t* fun)
+{
+    ir_compute_doms(fun);
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        if (block->last == NULL || !(block->last->op->flags & IRF_TERM))
+        {
+            printf("block%d is not terminated\n", block->id);
+            return false;
+        }
+
+        bool phis_done = false;
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (instr->block != block)
+            {
+                printf("v%d has an invalid block pointer\n", instr->id);
+                return false;
+            }
+
+            if ((instr->op->flags & IRF_TERM) && instr != block->last)
+            {
+                printf("v%d is a terminator within block%d\n", instr->id, block->id);
+                return false;
+            }
+
+            if (instr->op == &IR_PHI)
+            {
+                if (phis_done)
+                {
+                    printf("v%d is a phi after a non-phi\n", instr->id);
+                    return false;
+                }
+
+                if (instr->num_args != block->num_preds)
+                {
+                    printf("v%d has the wrong number of inputs\n", instr->id);
+                    return false;
+                }
+            }
+            else
+            {
+                phis_done = true;
+            }
+
+            if (instr->op->arity >= 0 && instr->num_args != (uint32_t)instr->op->arity)
+            {
+                printf("v%d has the wrong number of operands\n", instr->id);
+                return false;
+            }
+
+            for (uint32_t i = 0; i < instr->num_args; ++i)
+            {
+                ir_instr_t* arg = instr->args[i];
+
+                if (arg->block == NULL)
+                {
+                    printf("v%d uses removed value v%d\n", instr->id, arg->id);
+                    return false;
+                }
+
+                if (!ir_dominates_use(arg, instr, i))
+                {
+                    printf("v%d is not dominated by v%d\n", instr->id, arg->id);
+                    return false;
+                }
+            }
+        }
+
+        // Check that the successors list this block as a predecessor
+        ir_block_t* succs[2];
+        uint32_t num_succs = ir_succs(block, succs);
+        for (uint32_t i = 0; i < num_succs; ++i)
+        {
+            bool found = false;
+            for (uint32_t j = 0; j < succs[i]->num_preds; ++j)
+                if (succs[i]->preds[j] == block)
+                    found = true;
+
+            if (!found || succs[i]->order <= block->order)
+            {
+                printf("invalid edge from block%d to block%d\n", block->id, succs[i]->id);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+Print a textual representation of an IR function
+*/
+void ir_dump(ir_fun_t* fun, FILE* out)
+{
+    fprintf(
+        out,
+        "fun (%d params, %d locals)\n",
+        fun->fun->param_decls->len,
+        fun->fun->local_decls->len
+    );
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        fprintf(out, "block%d:", block->id);
+
+        if (block->num_preds > 0)
+        {
+            fprintf(out, " ; preds:");
+            for (uint32_t i = 0; i < block->num_preds; ++i)
+                fprintf(out, " block%d", block->preds[i]->id);
+        }
+
+        fprintf(out, "\n");
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            fprintf(out, "  ");
+
+            if (ir_has_value(instr))
+                fprintf(out, "v%d = ", instr->id);
+
+            fprintf(out, "%s", instr->op->name);
+
+            if (instr->op == &IR_CALL_RT)
+                fprintf(out, " %s", ((ir_helper_t*)instr->ptr)->name);
+
+            // Guards list their deopt values separately
+            uint32_t num_args = instr->num_args;
+            if (instr->op == &IR_GUARD_TAG)
+                num_args = 1;
+
+            for (uint32_t i = 0; i < num_args; ++i)
+                fprintf(out, "%s v%d", (i > 0)? ",":"", instr->args[i]->id);
+
+            if (instr->op == &IR_CONST)
+            {
+                heapptr_t ptr = instr->ptr;
+
+                if (ptr && get_shape(ptr) == SHAPE_STRING)
+                    fprintf(out, " \"%s\"", string_cstr((string_t*)ptr));
+                else
+                    fprintf(out, " %ld", instr->imm);
+            }
+
+            if (instr->op == &IR_ARG ||
+                instr->op == &IR_ARG_TAG ||
+                instr->op == &IR_CLOS_VAL ||
+                instr->op == &IR_CLOS_VAL_TAG ||
+                instr->op == &IR_GLOBAL_GET ||
+                instr->op == &IR_GLOBAL_GET_TAG ||
+                instr->op == &IR_GLOBAL_SET ||
+                instr->op == &IR_GUARD_TAG)
+                fprintf(out, "%s %ld", instr->num_args? ",":"", instr->imm);
+
+            if (instr->op == &IR_IF)
+                fprintf(out, " then block%d else block%d",
+                    instr->targets[0]->id, instr->targets[1]->id);
+
+            if (instr->op == &IR_JUMP)
+                fprintf(out, " block%d", instr->targets[0]->id);
+
+            if (instr->op == &IR_GUARD_TAG)
+            {
+                fprintf(out, " deopt [");
+                for (uint32_t i = 1; i < instr->num_args; ++i)
+                    fprintf(out, "%sv%d", (i > 1)? ", ":"", instr->args[i]->id);
+                fprintf(out, "]");
+            }
+
+            fprintf(out, "\n");
+        }
+    }
+}
+
+//============================================================================
+// IR tests
+//============================================================================
+
+/**
+Parse and resolve a unit, then build and optimize its IR
+*/
+ir_fun_t* test_ir_unit(char* cstr, bool dump)
+{
+    printf("%s\n", cstr);
+
+    ast_fun_t* unit_fun = parse_check_error(parse_string(cstr, "ir_test"));
+    var_res_pass(unit_fun, vm.global_clos? vm.global_clos->fun:NULL);
+
+    ir_fun_t* fun = ir_build(unit_fun);
+
+    if (!ir_verify(fun))
+    {
+        ir_dump(fun, stdout);
+        printf("IR verification failed before optimization\n");
+        exit(-1);
+    }
+
+    ir_optimize(fun);
+
+    if (dump)
+        ir_dump(fun, stdout);
+
+    if (!ir_verify(fun))
+    {
+        ir_dump(fun, stdout);
+        printf("IR verification failed after optimization\n");
+        exit(-1);
+    }
+
+    return fun;
+}
+
+/**
+Find the first function expression among the statements of a unit,
+either as a statement or assigned by a statement
+*/
+ast_fun_t* test_ir_find_fun(ast_fun_t* unit_fun)
+{
+    array_t* stmts = ((ast_seq_t*)unit_fun->body_expr)->expr_list;
+
+    for (size_t i = 0; i < stmts->len; ++i)
+    {
+        heapptr_t stmt = array_get_ptr(stmts, i);
+
+        if (get_shape(stmt) == SHAPE_AST_BINOP)
+            stmt = ((ast_binop_t*)stmt)->right_expr;
+
+        if (get_shape(stmt) == SHAPE_AST_FUN)
+            return (ast_fun_t*)stmt;
+    }
+
+    return NULL;
+}
+
+/**
+Build and optimize the IR for the first function nested in a unit
+*/
+ir_fun_t* test_ir_nested(char* cstr, bool dump)
+{
+    ir_fun_t* unit = test_ir_unit(cstr, false);
+
+    ast_fun_t* nested = test_ir_find_fun(unit->fun);
+    assert (nested != NULL);
+    ir_free(unit);
+
+    ir_fun_t* fun = ir_build(nested);
+    ir_optimize(fun);
+
+    if (dump)
+        ir_dump(fun, stdout);
+
+    if (!ir_verify(fun))
+    {
+        ir_dump(fun, stdout);
+        printf("IR verification failed for nested function\n");
+        exit(-1);
+    }
+
+    return fun;
+}
+
+/**
+Count the instructions with a given opcode
+*/
+size_t test_ir_count(ir_fun_t* fun, const irop_t* op)
+{
+    size_t count = 0;
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+            if (instr->op == op)
+                count++;
+
+    return count;
+}
+
+/**
+Check that a unit optimizes down to returning a constant value
+*/
+void test_ir_ret_cst(char* cstr, value_t expected)
+{
+    ir_fun_t* fun = test_ir_unit(cstr, false);
+
+    ir_instr_t* ret = fun->last->last;
+    assert (ret->op == &IR_RET);
+
+    if (ret->args[0]->op != &IR_CONST ||
+        ret->args[1]->op != &IR_CONST ||
+        ret->args[0]->imm != expected.word.int64 ||
+        ret->args[1]->imm != expected.tag)
+    {
+        ir_dump(fun, stdout);
+        printf("unit did not fold to the expected constant\n");
+        exit(-1);
+    }
+
+    ir_free(fun);
+}
+
+void test_ir_ret_int(char* cstr, int64_t expected)
+{
+    test_ir_ret_cst(cstr, value_from_int64(expected));
+}
+
+void test_ir()
+{
+    printf("core IR tests\n");
+
+    // Constant folding
+    test_ir_ret_int("0", 0);
+    test_ir_ret_int("3 + 2 * 5", 13);
+    test_ir_ret_int("-(7 + 3)", -10);
+    test_ir_ret_int("3 + -2 * 5", -7);
+    test_ir_ret_cst("0 <= 0", VAL_TRUE);
+    test_ir_ret_cst("not not true", VAL_TRUE);
+    test_ir_ret_cst("true == false", VAL_FALSE);
+    test_ir_ret_cst("'foo' == 'foo'", VAL_TRUE);
+    test_ir_ret_cst("'f' != 'f'", VAL_FALSE);
+
+    // Branch folding
+    test_ir_ret_int("if true then 1 else 0", 1);
+    test_ir_ret_int("if 0 < 10 then 7 else 3", 7);
+    test_ir_ret_int("if not true then 1 else 0", 0);
+
+    // Copy propagation through local variables
+    test_ir_ret_int("var x = 3; x", 3);
+    test_ir_ret_int("let x = 7; x+1", 8);
+    test_ir_ret_int("var x = 3; x = x+1; x", 4);
+    test_ir_ret_int("var x; var y; x = y = 2", 2);
+
+    // Dead code elimination of an unused closure
+    ir_fun_t* fun = test_ir_unit("fun () 1; 1", true);
+    assert (test_ir_count(fun, &IR_NEW_CLOS) == 0);
+    ir_free(fun);
+
+    // Value numbering of repeated subexpressions
+    fun = test_ir_nested("let f = fun (a) (a+1) * (a+1); f(2)", true);
+    assert (test_ir_count(fun, &IR_ADD) == 1);
+    ir_free(fun);
+
+    // Tag checks are eliminated on comparison results
+    fun = test_ir_nested(
+        "let fib = fun (n) { if n < 2 then n else fib(n-1) + fib(n-2) }; fib(11)",
+        true
+    );
+    assert (test_ir_count(fun, &IR_GUARD_TAG) == 0);
+    ir_free(fun);
+
+    // Dominated tag checks on the same value are eliminated
+    fun = test_ir_nested(
+        "let f = fun (a, b) if a then b else not a; f(true, 1)",
+        true
+    );
+    assert (test_ir_count(fun, &IR_GUARD_TAG) == 1);
+    ir_free(fun);
+
+    // Generic comparisons are specialized once the tags are known
+    fun = test_ir_nested("let f = fun (a) a+1 <= 2; f(1)", true);
+    assert (test_ir_count(fun, &IR_CALL_RT) == 0);
+    assert (test_ir_count(fun, &IR_LE) == 1);
+    ir_free(fun);
+
+    // Equality with a possible string operand compares contents
+    fun = test_ir_nested("let f = fun (a) a == 'x'; f('x')", true);
+    assert (test_ir_count(fun, &IR_CALL_RT) == 1);
+    ir_free(fun);
+    fun = test_ir_nested("let f = fun (a) a != 0; f(1)", true);
+    assert (test_ir_count(fun, &IR_CALL_RT) == 0);
+    ir_free(fun);
+
+    // Globals which are never reassigned are read as constants
+    fun = test_ir_unit("println", true);
+    assert (test_ir_count(fun, &IR_GLOBAL_GET) == 0);
+    assert (fun->last->last->args[1]->op == &IR_CONST);
+    assert (fun->last->last->args[1]->imm == TAG_CLOS);
+    ir_free(fun);
+
+    // Expressions from the interpreter tests
+    ir_free(test_ir_unit("[0,1,2][0]", true));
+    ir_free(test_ir_unit("'foobar'[3] == 'b'", true));
+    ir_free(test_ir_unit("let a = 3; let f = fun () a=2; f(); a", true));
+    ir_free(test_ir_unit("let o = :{x:1}; o.x = o.x+1; o.x", true));
+    ir_free(test_ir_nested("let f = fun () { let x = 7 fun() x }; let g = f(); g()", true));
+    ir_free(test_ir_nested("let n = 5; let f = fun () { fun() n }; let g = f(); g()", true));
+    ir_free(test_ir_unit("assert (true, '')   true", true));
+}
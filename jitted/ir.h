@@ -0,0 +1,291 @@
+/**
+SSA intermediate representation for the optimizing tier
+
+The IR is built from resolved ast_fun_t bodies (see var_res_pass). Every
+Zeta value is represented by a pair of IR values, one holding the value
+word and the other holding the type tag. Type tags are thus ordinary
+64-bit values, and tag checks are regular instructions which constant
+folding and value numbering can reason about.
+
+Since the core language has no loop constructs, the control flow graph
+produced from an AST is always acyclic. The list of blocks in a function
+is kept in a topological order, which the passes rely on.
+*/
+
+#ifndef __IR_H__
+#define __IR_H__
+
+#include <stdio.h>
+#include "vm.h"
+#include "parser.h"
+#include "interp.h"
+
+typedef struct ir_instr ir_instr_t;
+typedef struct ir_block ir_block_t;
+
+/**
+IR opcode information
+*/
+typedef struct
+{
+    /// Opcode name, used when dumping IR
+    char* name;
+
+    /// Number of operands, -1 for variable arity
+    int arity;
+
+    /// Opcode flags
+    uint8_t flags;
+
+} irop_t;
+
+/// Pure operation, the output depends only on the operands
+/// Pure instructions can be value numbered and removed if unused
+#define IRF_PURE        (1 << 0)
+
+/// No observable side effects, can be removed if unused
+#define IRF_REMOVABLE   (1 << 1)
+
+/// Block terminator (branch or return)
+#define IRF_TERM        (1 << 2)
+
+/// Calls into C code, clobbering the caller-saved registers
+#define IRF_CALL        (1 << 3)
+
+/**
+Runtime helper function called from IR code
+*/
+typedef struct
+{
+    /// Helper name, used when dumping IR
+    char* name;
+
+    /// C function pointer
+    void* fptr;
+
+    /// Opcode flags applying to calls to this helper
+    uint8_t flags;
+
+} ir_helper_t;
+
+/**
+IR instruction
+*/
+typedef struct ir_instr
+{
+    /// Opcode
+    const irop_t* op;
+
+    /// Value number, used when dumping IR
+    uint32_t id;
+
+    /// Block this instruction belongs to
+    ir_block_t* block;
+
+    /// Previous and next instructions in the block
+    ir_instr_t* prev;
+    ir_instr_t* next;
+
+    /// Operands
+    ir_instr_t** args;
+    uint32_t num_args;
+    uint32_t cap_args;
+
+    /// Immediate operand (constant word, index or tag)
+    int64_t imm;
+
+    /// Pointer operand (AST node, helper or string constant)
+    void* ptr;
+
+    /// Branch targets
+    ir_block_t* targets[2];
+
+    /// Mark bit, used by the passes
+    bool mark;
+
+    /// Linear position, assigned by the register allocator
+    uint32_t pos;
+
+    /// Allocated register, or -1 if none
+    int8_t reg;
+
+    /// Spill slot index, or -1 if not spilled
+    int32_t slot;
+
+    /// Next instruction in the list of all allocated instructions
+    ir_instr_t* all_next;
+
+} ir_instr_t;
+
+/**
+Basic block
+*/
+typedef struct ir_block
+{
+    /// Block number, used when dumping IR
+    uint32_t id;
+
+    /// Index of this block in the topological order
+    uint32_t order;
+
+    /// First and last instructions
+    ir_instr_t* first;
+    ir_instr_t* last;
+
+    /// Predecessor blocks, phi operands are in the same order
+    ir_block_t** preds;
+    uint32_t num_preds;
+    uint32_t cap_preds;
+
+    /// Immediate dominator
+    ir_block_t* idom;
+
+    /// Next block in the topological order
+    ir_block_t* next;
+
+    /// Next block in the list of all allocated blocks
+    ir_block_t* all_next;
+
+} ir_block_t;
+
+/**
+Interpreter continuation frame, recorded for deoptimization
+The frame resumes an AST node once one of its children has been evaluated
+*/
+typedef struct
+{
+    /// AST node being evaluated
+    heapptr_t node;
+
+    /// Index of the child whose value is being produced (see eval_loop)
+    uint32_t idx;
+
+    /// Index of the first value saved for this node in the deopt values
+    uint32_t val_idx;
+
+} deopt_frame_t;
+
+/**
+Deoptimization metadata for a guard
+
+The deopt values of a guard are its operands following the checked tag,
+as word and tag pairs: the local variable slots of the interpreter frame,
+then the values saved by the continuation frames, then the value of the
+child expression the innermost frame is waiting for.
+*/
+typedef struct deopt_info
+{
+    /// Number of local variable slots to restore
+    uint32_t num_locals;
+
+    /// Total number of deopt values
+    uint32_t num_vals;
+
+    /// Next deopt info of the same function
+    struct deopt_info* next;
+
+    /// Continuation frames, outermost first
+    uint32_t num_frames;
+    deopt_frame_t frames[];
+
+} deopt_info_t;
+
+/**
+IR function
+*/
+typedef struct
+{
+    /// Function this IR was built from
+    ast_fun_t* fun;
+
+    /// Entry block, first in the topological order
+    ir_block_t* entry;
+
+    /// Last block in the topological order
+    ir_block_t* last;
+
+    /// Counters used to number values and blocks
+    uint32_t num_instrs;
+    uint32_t num_blocks;
+
+    /// All allocated instructions and blocks, for deallocation
+    ir_instr_t* all_instrs;
+    ir_block_t* all_blocks;
+
+    /// Deoptimization metadata of the guards
+    /// Compiled code takes ownership of these
+    deopt_info_t* deopts;
+
+} ir_fun_t;
+
+/// IR opcodes
+extern const irop_t IR_CONST;
+extern const irop_t IR_CLOS;
+extern const irop_t IR_ARG;
+extern const irop_t IR_ARG_TAG;
+extern const irop_t IR_PHI;
+extern const irop_t IR_COPY;
+extern const irop_t IR_ADD;
+extern const irop_t IR_SUB;
+extern const irop_t IR_MUL;
+extern const irop_t IR_DIV;
+extern const irop_t IR_MOD;
+extern const irop_t IR_NEG;
+extern const irop_t IR_NOT;
+extern const irop_t IR_AND;
+extern const irop_t IR_LT;
+extern const irop_t IR_LE;
+extern const irop_t IR_GT;
+extern const irop_t IR_GE;
+extern const irop_t IR_EQ;
+extern const irop_t IR_NE;
+extern const irop_t IR_GUARD_TAG;
+extern const irop_t IR_CELL_NEW;
+extern const irop_t IR_CELL_GET;
+extern const irop_t IR_CELL_GET_TAG;
+extern const irop_t IR_CELL_SET;
+extern const irop_t IR_CLOS_VAL;
+extern const irop_t IR_CLOS_VAL_TAG;
+extern const irop_t IR_GLOBAL_GET;
+extern const irop_t IR_GLOBAL_GET_TAG;
+extern const irop_t IR_GLOBAL_SET;
+extern const irop_t IR_NEW_CLOS;
+extern const irop_t IR_CALL;
+extern const irop_t IR_CALL_RT;
+extern const irop_t IR_PROJ_TAG;
+extern const irop_t IR_IF;
+extern const irop_t IR_JUMP;
+extern const irop_t IR_RET;
+
+/// Runtime helpers
+extern const ir_helper_t RT_BINOP;
+extern const ir_helper_t RT_UNOP;
+extern const ir_helper_t RT_SET_PROP;
+extern const ir_helper_t RT_ARRAY_ALLOC;
+extern const ir_helper_t RT_ARRAY_SET;
+extern const ir_helper_t RT_OBJ_ALLOC;
+extern const ir_helper_t RT_OBJ_SET_PROP;
+extern const ir_helper_t RT_INVALID_ASSIGN;
+
+bool ir_has_value(ir_instr_t* instr);
+
+ir_fun_t* ir_build(ast_fun_t* fun);
+ir_fun_t* ir_build_osr(ast_fun_t* fun, uint32_t stmt_idx);
+void ir_free(ir_fun_t* fun);
+
+bool ir_const_fold(ir_fun_t* fun);
+bool ir_copy_prop(ir_fun_t* fun);
+bool ir_dce(ir_fun_t* fun);
+bool ir_gvn(ir_fun_t* fun);
+bool ir_tag_elim(ir_fun_t* fun);
+void ir_optimize(ir_fun_t* fun);
+
+void ir_compute_doms(ir_fun_t* fun);
+bool ir_dominates(ir_block_t* a, ir_block_t* b);
+bool ir_verify(ir_fun_t* fun);
+void ir_dump(ir_fun_t* fun, FILE* out);
+
+ast_fun_t* test_ir_find_fun(ast_fun_t* unit_fun);
+void test_ir();
+
+#endif
@@ -0,0 +1,1825 @@
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <alloca.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "jit.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "codecache.h"
+#include "parser.h"
+#include "interp.h"
+#include "vm.h"
+
+/// Number of interpreted calls before a function gets compiled
+uint32_t jit_threshold = JIT_CALL_THRESHOLD;
+
+/// Number of statements executed before on-stack replacement
+uint32_t jit_osr_threshold = JIT_OSR_THRESHOLD;
+
+/// Argument values passed by tail calls between compiled functions
+/// These are read on entry, before the callee makes any call
+value_t jit_tail_args[JIT_MAX_TAIL_ARGS];
+
+/// Lowest native stack address compiled code may be called at,
+/// NULL if compiled code can't run
+char* jit_stack_limit = NULL;
+
+/// Profiler support options
+bool jit_perf_map = false;
+bool jit_dump = false;
+
+/// Profiler support output files, NULL if disabled
+FILE* jit_perf_map_file = NULL;
+FILE* jit_dump_file = NULL;
+
+/// Number of code load records written to the jitdump file
+uint64_t jit_dump_index = 0;
+
+//============================================================================
+// Profiler support
+//============================================================================
+
+/**
+Header of a jitdump file
+See tools/perf/Documentation/jitdump-specification.txt in the Linux tree
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+
+} jit_dump_header_t;
+
+/**
+Code load record of a jitdump file
+The record is followed by the code name string and the code bytes
+*/
+typedef struct
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+
+} jit_dump_load_t;
+
+#define JIT_DUMP_MAGIC 0x4A695444
+#define JIT_DUMP_VERSION 1
+#define JIT_DUMP_CODE_LOAD 0
+#define JIT_DUMP_EM_X86_64 62
+
+/**
+Get a timestamp for jitdump records
+This is the clock used by perf record -k mono
+*/
+uint64_t jit_dump_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+Open the perf map file, where perf looks up symbols for code
+which does not belong to any mapped file
+*/
+void jit_perf_map_open()
+{
+    char file_name[64];
+    sprintf(file_name, "/tmp/perf-%d.map", getpid());
+
+    jit_perf_map_file = fopen(file_name, "w");
+
+    if (jit_perf_map_file == NULL)
+        printf("failed to open perf map file \"%s\"\n", file_name);
+}
+
+/**
+Open the jitdump file and write its header
+The file is mapped as executable so that perf record notices it,
+perf inject then uses it to create symbol files for compiled code
+*/
+void jit_dump_open()
+{
+    char file_name[64];
+    sprintf(file_name, "/tmp/jit-%d.dump", getpid());
+
+    int fd = open(file_name, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0)
+    {
+        printf("failed to open jitdump file \"%s\"\n", file_name);
+        return;
+    }
+
+    void* marker = mmap(
+        NULL,
+        sysconf(_SC_PAGESIZE),
+        PROT_READ | PROT_EXEC,
+        MAP_PRIVATE,
+        fd,
+        0
+    );
+
+    if (marker == MAP_FAILED)
+    {
+        printf("failed to map jitdump file \"%s\"\n", file_name);
+        close(fd);
+        return;
+    }
+
+    jit_dump_file = fdopen(fd, "w");
+
+    jit_dump_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JIT_DUMP_MAGIC;
+    header.version = JIT_DUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = JIT_DUMP_EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = jit_dump_time();
+
+    fwrite(&header, sizeof(header), 1, jit_dump_file);
+    fflush(jit_dump_file);
+}
+
+/**
+Produce the symbol name of compiled code, with its source location
+On-stack replacement entry points are given the statement they resume at
+*/
+char* jit_code_name(ast_fun_t* fun, uint32_t stmt_idx, char* buf, size_t size)
+{
+    const char* name = fun->name? string_cstr(fun->name):"fun";
+    const char* src_name = fun->src? string_cstr(fun->src->name):"?";
+    uint32_t line_no = fun->src? srcfile_pos(fun->src, fun->src_off).lineNo:0;
+
+    int len = snprintf(
+        buf,
+        size,
+        "%s %s:%d",
+        name,
+        src_name,
+        line_no + 1
+    );
+
+    if (stmt_idx > 0 && len >= 0 && (size_t)len < size)
+        snprintf(buf + len, size - len, " [osr %d]", stmt_idx);
+
+    return buf;
+}
+
+/**
+Tell the profilers about newly compiled code
+*/
+void jit_perf_record(const char* name, void* code, size_t size)
+{
+    if (jit_perf_map_file)
+    {
+        fprintf(jit_perf_map_file, "%lx %lx %s\n", (uintptr_t)code, size, name);
+        fflush(jit_perf_map_file);
+    }
+
+    if (jit_dump_file)
+    {
+        size_t name_len = strlen(name) + 1;
+
+        jit_dump_load_t rec;
+        rec.id = JIT_DUMP_CODE_LOAD;
+        rec.total_size = sizeof(rec) + name_len + size;
+        rec.timestamp = jit_dump_time();
+        rec.pid = getpid();
+        rec.tid = getpid();
+        rec.vma = (uintptr_t)code;
+        rec.code_addr = (uintptr_t)code;
+        rec.code_size = size;
+        rec.code_index = jit_dump_index++;
+
+        fwrite(&rec, sizeof(rec), 1, jit_dump_file);
+        fwrite(name, name_len, 1, jit_dump_file);
+        fwrite(code, size, 1, jit_dump_file);
+        fflush(jit_dump_file);
+    }
+}
+
+void init_jit()
+{
+#if defined(__x86_64__)
+    size_t stack_size = JIT_STACK_SIZE;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur / 2 < stack_size)
+        stack_size = limit.rlim_cur / 2;
+
+    jit_stack_limit = (char*)__builtin_frame_address(0) - stack_size;
+
+    if (jit_perf_map)
+        jit_perf_map_open();
+
+    if (jit_dump)
+        jit_dump_open();
+#endif
+}
+
+//============================================================================
+// Runtime helpers called from compiled code
+//============================================================================
+
+/**
+Call compiled code from the interpreter
+Evicted code gets reclaimed once no compiled code is running
+*/
+value_t jit_enter(void* entry, clos_t* clos, value_t* args)
+{
+    codecache_depth++;
+
+    value_t val = ((jit_entry_t)entry)(clos, args);
+
+    if (--codecache_depth == 0)
+        codecache_reclaim();
+
+    return val;
+}
+
+/**
+Test if the native stack is too deep to call compiled code
+*/
+bool jit_stack_full()
+{
+    return (char*)__builtin_frame_address(0) < jit_stack_limit;
+}
+
+/**
+Interpret a call to a compiled function, made when the native stack is
+too deep. The deeper calls then run on the interpreter stack.
+*/
+value_t jit_stack_overflow(clos_t* clos, value_t* args)
+{
+    return call_clos(clos, args, clos->fun->param_decls->len);
+}
+
+/**
+Call a closure or host function with evaluated arguments
+This is the slow path for calls made from compiled code
+*/
+value_t jit_call(value_t callee, value_t* args, uint64_t num_args)
+{
+    return call_value(callee, args, num_args);
+}
+
+/**
+Allocate a closure, given the values captured for its free variables
+*/
+clos_t* jit_new_clos(ast_fun_t* fun, value_t* vals)
+{
+    clos_t* clos = clos_alloc(fun);
+
+    for (size_t i = 0; i < fun->free_vars->len; ++i)
+        clos->vals[i] = vals[i];
+
+    return clos;
+}
+
+/**
+Deoptimize after a guard failed in compiled code
+The interpreter frame and continuations are rebuilt on the interpreter
+stack from the deopt values, and evaluation resumes in the interpreter,
+producing the return value of the function
+*/
+value_t jit_deopt(clos_t* clos, deopt_info_t* info, value_t* vals)
+{
+    ast_fun_t* fun = clos->fun;
+
+    // After repeated failures, discard the compiled code so that the
+    // function gets recompiled later, without speculating this time
+    if (++fun->num_deopts == JIT_MAX_DEOPTS)
+        codecache_invalidate(fun);
+
+    assert (info->num_locals <= fun->local_decls->len);
+    frame_t* frame = frame_push(clos, fun->local_decls->len, NULL);
+    memcpy(frame->locals, vals, sizeof(value_t) * info->num_locals);
+
+    // Push the continuations of the AST nodes being evaluated,
+    // outermost first, with the values they saved
+    for (uint32_t i = 0; i < info->num_frames; ++i)
+    {
+        deopt_frame_t* deopt_frame = &info->frames[i];
+
+        uint32_t end_idx = info->num_vals - 1;
+        if (i + 1 < info->num_frames)
+            end_idx = info->frames[i + 1].val_idx;
+
+        kont_push(
+            deopt_frame->node,
+            deopt_frame->idx,
+            vals + deopt_frame->val_idx,
+            end_idx - deopt_frame->val_idx
+        );
+    }
+
+    // Resume evaluation with the value of the innermost child
+    return eval_loop(NULL, vals[info->num_vals - 1]);
+}
+
+#if defined(__x86_64__)
+
+//============================================================================
+// x86-64 assembler
+//============================================================================
+
+/**
+Machine code buffer
+*/
+typedef struct
+{
+    uint8_t* buf;
+    size_t len;
+    size_t cap;
+
+} asm_t;
+
+/// Condition codes
+#define CC_B    0x2
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xC
+#define CC_GE   0xD
+#define CC_LE   0xE
+#define CC_G    0xF
+
+/// Extension opcodes of the arithmetic with immediate group
+#define ALU_ADD 0
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_CMP 7
+
+/// Arithmetic opcodes with a register source (op r/m64, r64)
+#define OP_ADD_RR   0x01
+#define OP_AND_RR   0x21
+#define OP_SUB_RR   0x29
+#define OP_CMP_RR   0x39
+#define OP_TEST_RR  0x85
+#define OP_MOV_RR   0x89
+#define OP_MOV_LOAD 0x8B
+
+void asm_byte(asm_t* as, uint8_t b)
+{
+    if (as->len == as->cap)
+    {
+        as->cap = as->cap? (2 * as->cap):256;
+        as->buf = realloc(as->buf, as->cap);
+    }
+
+    as->buf[as->len++] = b;
+}
+
+void asm_u32(asm_t* as, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        asm_byte(as, (v >> (8 * i)) & 0xFF);
+}
+
+void asm_u64(asm_t* as, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        asm_byte(as, (v >> (8 * i)) & 0xFF);
+}
+
+/**
+Emit a REX prefix, if one is needed
+*/
+void asm_rex(asm_t* as, bool w, int reg, int base)
+{
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((base >> 3) & 1);
+
+    if (rex != 0x40)
+        asm_byte(as, rex);
+}
+
+void asm_modrm_rr(asm_t* as, int reg, int rm)
+{
+    asm_byte(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/**
+Emit a ModRM byte for a [base + disp32] memory operand
+*/
+void asm_modrm_mem(asm_t* as, int reg, int base, int32_t disp)
+{
+    asm_byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+
+    // rsp and r12 as a base require a SIB byte
+    if ((base & 7) == REG_RSP)
+        asm_byte(as, 0x24);
+
+    asm_u32(as, disp);
+}
+
+/**
+Register-register instruction of the form op r/m64, r64
+*/
+void asm_rr(asm_t* as, uint8_t opcode, int dst, int src)
+{
+    asm_rex(as, true, src, dst);
+    asm_byte(as, opcode);
+    asm_modrm_rr(as, src, dst);
+}
+
+/**
+Register-memory instruction operating on [base + disp]
+*/
+void asm_rm(asm_t* as, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    asm_rex(as, true, reg, base);
+    asm_byte(as, opcode);
+    asm_modrm_mem(as, reg, base, disp);
+}
+
+void asm_mov_rr(asm_t* as, int dst, int src)
+{
+    if (dst != src)
+        asm_rr(as, OP_MOV_RR, dst, src);
+}
+
+void asm_mov_ri(asm_t* as, int dst, int64_t imm)
+{
+    if (imm >= 0 && imm <= UINT32_MAX)
+    {
+        // mov r32, imm32, zero-extended
+        asm_rex(as, false, 0, dst);
+        asm_byte(as, 0xB8 + (dst & 7));
+        asm_u32(as, imm);
+    }
+    else if (imm >= INT32_MIN && imm <= INT32_MAX)
+    {
+        // mov r/m64, imm32, sign-extended
+        asm_rex(as, true, 0, dst);
+        asm_byte(as, 0xC7);
+        asm_modrm_rr(as, 0, dst);
+        asm_u32(as, imm);
+    }
+    else
+    {
+        asm_rex(as, true, 0, dst);
+        asm_byte(as, 0xB8 + (dst & 7));
+        asm_u64(as, imm);
+    }
+}
+
+void asm_load(asm_t* as, int dst, int base, int32_t disp)
+{
+    asm_rm(as, OP_MOV_LOAD, dst, base, disp);
+}
+
+void asm_store(asm_t* as, int base, int32_t disp, int src)
+{
+    asm_rm(as, OP_MOV_RR, src, base, disp);
+}
+
+/**
+Store a sign-extended 32-bit immediate to a 64-bit memory location
+*/
+void asm_store_imm(asm_t* as, int base, int32_t disp, int32_t imm)
+{
+    asm_rex(as, true, 0, base);
+    asm_byte(as, 0xC7);
+    asm_modrm_mem(as, 0, base, disp);
+    asm_u32(as, imm);
+}
+
+/**
+Load and zero-extend a byte (movzx r32, byte [base + disp])
+*/
+void asm_load_u8(asm_t* as, int dst, int base, int32_t disp)
+{
+    asm_rex(as, false, dst, base);
+    asm_byte(as, 0x0F);
+    asm_byte(as, 0xB6);
+    asm_modrm_mem(as, dst, base, disp);
+}
+
+/**
+Arithmetic with a sign-extended 32-bit immediate
+*/
+void asm_alu_ri(asm_t* as, int ext, int dst, int32_t imm)
+{
+    asm_rex(as, true, 0, dst);
+    asm_byte(as, 0x81);
+    asm_modrm_rr(as, ext, dst);
+    asm_u32(as, imm);
+}
+
+/**
+Compare a 32-bit memory operand with an immediate
+*/
+void asm_cmp_m32_imm(asm_t* as, int base, int32_t disp, int32_t imm)
+{
+    asm_rex(as, false, 0, base);
+    asm_byte(as, 0x81);
+    asm_modrm_mem(as, ALU_CMP, base, disp);
+    asm_u32(as, imm);
+}
+
+void asm_imul_rr(asm_t* as, int dst, int src)
+{
+    asm_rex(as, true, dst, src);
+    asm_byte(as, 0x0F);
+    asm_byte(as, 0xAF);
+    asm_modrm_rr(as, dst, src);
+}
+
+/**
+Unary instruction of the 0xF7 group (neg is /3, idiv is /7)
+*/
+void asm_unary(asm_t* as, int ext, int reg)
+{
+    asm_rex(as, true, 0, reg);
+    asm_byte(as, 0xF7);
+    asm_modrm_rr(as, ext, reg);
+}
+
+/**
+Set al from a condition code and zero-extend it into rax
+*/
+void asm_setcc_rax(asm_t* as, int cc)
+{
+    asm_byte(as, 0x0F);
+    asm_byte(as, 0x90 + cc);
+    asm_byte(as, 0xC0);
+
+    // movzx eax, al
+    asm_byte(as, 0x0F);
+    asm_byte(as, 0xB6);
+    asm_byte(as, 0xC0);
+}
+
+/**
+Test the low byte of rax, as eval_truth does (test al, al)
+*/
+void asm_test_al(asm_t* as)
+{
+    asm_byte(as, 0x84);
+    asm_byte(as, 0xC0);
+}
+
+void asm_call_r(asm_t* as, int reg)
+{
+    asm_rex(as, false, 0, reg);
+    asm_byte(as, 0xFF);
+    asm_modrm_rr(as, 2, reg);
+}
+
+void asm_jmp_r(asm_t* as, int reg)
+{
+    asm_rex(as, false, 0, reg);
+    asm_byte(as, 0xFF);
+    asm_modrm_rr(as, 4, reg);
+}
+
+void asm_push(asm_t* as, int reg)
+{
+    asm_rex(as, false, 0, reg);
+    asm_byte(as, 0x50 + (reg & 7));
+}
+
+void asm_pop(asm_t* as, int reg)
+{
+    asm_rex(as, false, 0, reg);
+    asm_byte(as, 0x58 + (reg & 7));
+}
+
+/**
+Emit a jump with a 32-bit displacement to be patched
+Returns the offset of the displacement
+*/
+size_t asm_jmp(asm_t* as)
+{
+    asm_byte(as, 0xE9);
+    asm_u32(as, 0);
+    return as->len - 4;
+}
+
+size_t asm_jcc(asm_t* as, int cc)
+{
+    asm_byte(as, 0x0F);
+    asm_byte(as, 0x80 + cc);
+    asm_u32(as, 0);
+    return as->len - 4;
+}
+
+/**
+Patch a jump displacement to point to a given code offset
+*/
+void asm_patch(asm_t* as, size_t disp_off, size_t target)
+{
+    int32_t disp = (int32_t)(target - (disp_off + 4));
+    memcpy(as->buf + disp_off, &disp, sizeof(disp));
+}
+
+//============================================================================
+// Code generation
+//============================================================================
+
+/// Value locations
+#define LOC_IMM 0
+#define LOC_REG 1
+#define LOC_MEM 2
+
+/**
+Location of a value, used when moving values around
+*/
+typedef struct
+{
+    uint8_t kind;
+
+    /// Register, or base register of a memory operand
+    int8_t reg;
+
+    /// Memory operand displacement
+    int32_t disp;
+
+    /// Immediate value
+    int64_t imm;
+
+} loc_t;
+
+/**
+Move between two locations, for parallel moves
+*/
+typedef struct
+{
+    loc_t dst;
+    loc_t src;
+
+} move_t;
+
+/**
+Jump to be patched once the target block is placed
+*/
+typedef struct
+{
+    size_t disp_off;
+    ir_block_t* target;
+
+} jit_patch_t;
+
+/// Frame slots holding the closure and argument pointers
+#define FRAME_CLOS_DISP (-8)
+#define FRAME_ARGS_DISP (-16)
+
+/// Maximum number of jump patches per function
+#define MAX_PATCHES(fun) (2 * (fun)->num_instrs + 1)
+
+/**
+Code generation state for a function
+*/
+typedef struct
+{
+    asm_t as;
+
+    ir_fun_t* fun;
+
+    /// Code cache entry for the code generated
+    jit_code_t* code;
+
+    regalloc_t ra;
+
+    /// Number of callee-saved registers preserved in the frame
+    uint32_t num_saved;
+
+    /// Frame size, excluding the saved rbp
+    int32_t frame_size;
+
+    /// Code offsets of the blocks, indexed by block id
+    size_t* block_offs;
+
+    /// Jumps to blocks
+    jit_patch_t* patches;
+    uint32_t num_patches;
+
+    /// Guards and their jumps to the deoptimization stubs
+    ir_instr_t** guards;
+    size_t* guard_jumps;
+    uint32_t num_guards;
+
+} jit_gen_t;
+
+loc_t loc_reg(int reg)
+{
+    loc_t loc = { LOC_REG, reg, 0, 0 };
+    return loc;
+}
+
+loc_t loc_mem(int base, int32_t disp)
+{
+    loc_t loc = { LOC_MEM, base, disp, 0 };
+    return loc;
+}
+
+loc_t loc_imm(int64_t imm)
+{
+    loc_t loc = { LOC_IMM, -1, 0, imm };
+    return loc;
+}
+
+bool loc_equal(loc_t a, loc_t b)
+{
+    if (a.kind != b.kind)
+        return false;
+
+    if (a.kind == LOC_IMM)
+        return a.imm == b.imm;
+
+    return a.reg == b.reg && a.disp == b.disp;
+}
+
+/**
+Get the location of an IR value
+*/
+loc_t jit_loc(jit_gen_t* gen, ir_instr_t* instr)
+{
+    if (instr->op == &IR_CONST)
+        return loc_imm(instr->imm);
+
+    if (instr->reg >= 0)
+        return loc_reg(instr->reg);
+
+    assert (instr->slot >= 0);
+    int32_t disp = -(16 + 8 * gen->num_saved + 8 * (instr->slot + 1));
+    return loc_mem(REG_RBP, disp);
+}
+
+/**
+Move a value between two locations
+Memory to memory moves go through rax
+*/
+void gen_mov(asm_t* as, loc_t dst, loc_t src)
+{
+    assert (dst.kind != LOC_IMM);
+
+    if (loc_equal(dst, src))
+        return;
+
+    if (dst.kind == LOC_REG)
+    {
+        if (src.kind == LOC_IMM)
+            asm_mov_ri(as, dst.reg, src.imm);
+        else if (src.kind == LOC_REG)
+            asm_mov_rr(as, dst.reg, src.reg);
+        else
+            asm_load(as, dst.reg, src.reg, src.disp);
+        return;
+    }
+
+    if (src.kind == LOC_REG)
+    {
+        asm_store(as, dst.reg, dst.disp, src.reg);
+        return;
+    }
+
+    if (src.kind == LOC_IMM && src.imm >= INT32_MIN && src.imm <= INT32_MAX)
+    {
+        asm_store_imm(as, dst.reg, dst.disp, src.imm);
+        return;
+    }
+
+    gen_mov(as, loc_reg(REG_RAX), src);
+    asm_store(as, dst.reg, dst.disp, REG_RAX);
+}
+
+/**
+Perform a set of moves as if they happened simultaneously
+Cycles are broken using r11
+*/
+void gen_par_moves(asm_t* as, move_t* moves, uint32_t num_moves)
+{
+    while (num_moves > 0)
+    {
+        bool progress = false;
+
+        for (uint32_t i = 0; i < num_moves; ++i)
+        {
+            // A move can be done if its destination isn't needed as a source
+            bool blocked = false;
+            for (uint32_t j = 0; j < num_moves; ++j)
+                if (j != i && loc_equal(moves[j].src, moves[i].dst))
+                    blocked = true;
+
+            if (blocked)
+                continue;
+
+            gen_mov(as, moves[i].dst, moves[i].src);
+            moves[i] = moves[--num_moves];
+            progress = true;
+            break;
+        }
+
+        if (progress)
+            continue;
+
+        // All the remaining moves form cycles, save one destination
+        loc_t saved = moves[0].dst;
+        gen_mov(as, loc_reg(REG_R11), saved);
+        for (uint32_t j = 0; j < num_moves; ++j)
+            if (loc_equal(moves[j].src, saved))
+                moves[j].src = loc_reg(REG_R11);
+    }
+}
+
+void gen_load(jit_gen_t* gen, int reg, ir_instr_t* instr)
+{
+    gen_mov(&gen->as, loc_reg(reg), jit_loc(gen, instr));
+}
+
+void gen_store(jit_gen_t* gen, ir_instr_t* instr, int reg)
+{
+    gen_mov(&gen->as, jit_loc(gen, instr), loc_reg(reg));
+}
+
+/**
+Test if a value is a constant fitting in a sign-extended immediate
+*/
+bool jit_is_imm32(ir_instr_t* instr)
+{
+    return (
+        instr->op == &IR_CONST &&
+        instr->imm >= INT32_MIN &&
+        instr->imm <= INT32_MAX
+    );
+}
+
+/**
+Call a C function through rax
+*/
+void gen_call_c(jit_gen_t* gen, void* fptr)
+{
+    asm_mov_ri(&gen->as, REG_RAX, (int64_t)fptr);
+    asm_call_r(&gen->as, REG_RAX);
+}
+
+/**
+Emit a jump to a block, omitted if the block comes next
+*/
+void gen_jump(jit_gen_t* gen, ir_block_t* block, ir_block_t* target)
+{
+    if (block->next == target)
+        return;
+
+    jit_patch_t* patch = &gen->patches[gen->num_patches++];
+    patch->disp_off = asm_jmp(&gen->as);
+    patch->target = target;
+}
+
+/**
+Load the word operand in rax, and the other in r11 unless it is
+a small constant, then apply an arithmetic or comparison instruction
+*/
+void gen_binop(jit_gen_t* gen, ir_instr_t* instr, int alu_ext, uint8_t opcode)
+{
+    asm_t* as = &gen->as;
+    ir_instr_t* rhs = instr->args[1];
+
+    gen_load(gen, REG_RAX, instr->args[0]);
+
+    if (jit_is_imm32(rhs))
+    {
+        asm_alu_ri(as, alu_ext, REG_RAX, rhs->imm);
+        return;
+    }
+
+    gen_load(gen, REG_R11, rhs);
+    asm_rr(as, opcode, REG_RAX, REG_R11);
+}
+
+void gen_compare(jit_gen_t* gen, ir_instr_t* instr, int cc)
+{
+    gen_binop(gen, instr, ALU_CMP, OP_CMP_RR);
+    asm_setcc_rax(&gen->as, cc);
+    gen_store(gen, instr, REG_RAX);
+}
+
+/**
+Restore the callee-saved registers and pop the frame
+*/
+void gen_leave(jit_gen_t* gen)
+{
+    asm_t* as = &gen->as;
+
+    uint32_t idx = 0;
+    for (int reg = 0; reg < 16; ++reg)
+    {
+        if (gen->ra.used_callee_saved & (1 << reg))
+        {
+            asm_load(as, reg, REG_RBP, -(16 + 8 * (idx + 1)));
+            idx++;
+        }
+    }
+
+    asm_mov_rr(as, REG_RSP, REG_RBP);
+    asm_pop(as, REG_RBP);
+}
+
+/**
+Emit the epilogue, restoring callee-saved registers and returning
+*/
+void gen_epilogue(jit_gen_t* gen)
+{
+    gen_leave(gen);
+    asm_byte(&gen->as, 0xC3);
+}
+
+/**
+Test if the value of a call is returned without further computation,
+in which case the call can be made as a tail call
+*/
+bool jit_is_tail_call(ir_instr_t* call)
+{
+    if (call->num_args / 2 - 1 > JIT_MAX_TAIL_ARGS)
+        return false;
+
+    ir_instr_t* word = call;
+    ir_instr_t* tag = call->next;
+    if (tag == NULL || tag->op != &IR_PROJ_TAG || tag->args[0] != call)
+        return false;
+
+    ir_block_t* block = call->block;
+    ir_instr_t* term = tag->next;
+
+    for (;;)
+    {
+        if (term->op == &IR_RET)
+            return term->args[0] == word && term->args[1] == tag;
+
+        if (term->op != &IR_JUMP)
+            return false;
+
+        // The successor may only merge the value being returned
+        ir_block_t* succ = term->targets[0];
+
+        uint32_t pred_idx = 0;
+        while (succ->preds[pred_idx] != block)
+            pred_idx++;
+
+        ir_instr_t* phi_word = NULL;
+        ir_instr_t* phi_tag = NULL;
+        ir_instr_t* instr = succ->first;
+        for (; instr->op == &IR_PHI; instr = instr->next)
+        {
+            if (instr->args[pred_idx] == word)
+                phi_word = instr;
+            else if (instr->args[pred_idx] == tag)
+                phi_tag = instr;
+        }
+
+        if (phi_word == NULL || phi_tag == NULL)
+            return false;
+
+        word = phi_word;
+        tag = phi_tag;
+        block = succ;
+        term = instr;
+    }
+}
+
+/**
+Compile a call to a Zeta closure or host function
+Arguments are passed in a value_t array at the bottom of the frame
+*/
+void gen_call(jit_gen_t* gen, ir_instr_t* instr)
+{
+    asm_t* as = &gen->as;
+    uint32_t num_args = instr->num_args / 2 - 1;
+    bool tail = jit_is_tail_call(instr);
+
+    for (uint32_t i = 0; i < num_args; ++i)
+    {
+        int32_t disp = sizeof(value_t) * i;
+        gen_mov(as, loc_mem(REG_RSP, disp), jit_loc(gen, instr->args[2 + 2*i]));
+        gen_mov(as, loc_mem(REG_RSP, disp + offsetof(value_t, tag)), jit_loc(gen, instr->args[3 + 2*i]));
+    }
+
+    move_t moves[2] = {
+        { loc_reg(REG_RDI), jit_loc(gen, instr->args[0]) },
+        { loc_reg(REG_RSI), jit_loc(gen, instr->args[1]) }
+    };
+    gen_par_moves(as, moves, 2);
+
+    // Fast path: call compiled closures with a matching arity directly
+    asm_alu_ri(as, ALU_CMP, REG_RSI, TAG_CLOS);
+    size_t not_clos = asm_jcc(as, CC_NE);
+    asm_load(as, REG_RAX, REG_RDI, offsetof(clos_t, fun));
+    asm_load(as, REG_R11, REG_RAX, offsetof(ast_fun_t, jit_entry));
+    asm_rr(as, OP_TEST_RR, REG_R11, REG_R11);
+    size_t not_compiled = asm_jcc(as, CC_E);
+    asm_load(as, REG_RAX, REG_RAX, offsetof(ast_fun_t, param_decls));
+    asm_cmp_m32_imm(as, REG_RAX, offsetof(array_t, len), num_args);
+    size_t bad_arity = asm_jcc(as, CC_NE);
+    size_t done = 0;
+    if (tail)
+    {
+        // The frame holding the arguments is popped before jumping to
+        // the callee, the arguments are passed in jit_tail_args instead
+        asm_mov_ri(as, REG_RSI, (int64_t)jit_tail_args);
+        for (uint32_t i = 0; i < 2 * num_args; ++i)
+        {
+            asm_load(as, REG_RAX, REG_RSP, sizeof(word_t) * i);
+            asm_store(as, REG_RSI, sizeof(word_t) * i, REG_RAX);
+        }
+
+        gen_leave(gen);
+        asm_jmp_r(as, REG_R11);
+    }
+    else
+    {
+        asm_mov_rr(as, REG_RSI, REG_RSP);
+        asm_call_r(as, REG_R11);
+        done = asm_jmp(as);
+    }
+
+    // Slow path, through jit_call
+    asm_patch(as, not_clos, as->len);
+    asm_patch(as, not_compiled, as->len);
+    asm_patch(as, bad_arity, as->len);
+    asm_mov_rr(as, REG_RDX, REG_RSP);
+    asm_mov_ri(as, REG_RCX, num_args);
+    gen_call_c(gen, &jit_call);
+
+    if (!tail)
+        asm_patch(as, done, as->len);
+}
+
+/**
+Compile an IR instruction
+*/
+void gen_instr(jit_gen_t* gen, ir_instr_t* instr)
+{
+    asm_t* as = &gen->as;
+    const irop_t* op = instr->op;
+    ir_block_t* block = instr->block;
+
+    // Constants are materialized where they are used, phis are
+    // written by predecessors and call tags are written by calls
+    if (op == &IR_CONST || op == &IR_PHI || op == &IR_PROJ_TAG)
+        return;
+
+    if (op == &IR_CLOS)
+    {
+        asm_load(as, REG_RAX, REG_RBP, FRAME_CLOS_DISP);
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_ARG || op == &IR_ARG_TAG)
+    {
+        int32_t disp = sizeof(value_t) * instr->imm;
+        asm_load(as, REG_R11, REG_RBP, FRAME_ARGS_DISP);
+
+        if (op == &IR_ARG)
+            asm_load(as, REG_RAX, REG_R11, disp);
+        else
+            asm_load_u8(as, REG_RAX, REG_R11, disp + offsetof(value_t, tag));
+
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_COPY)
+    {
+        gen_mov(as, jit_loc(gen, instr), jit_loc(gen, instr->args[0]));
+        return;
+    }
+
+    if (op == &IR_ADD || op == &IR_SUB || op == &IR_AND)
+    {
+        if (op == &IR_ADD)
+            gen_binop(gen, instr, ALU_ADD, OP_ADD_RR);
+        else if (op == &IR_SUB)
+            gen_binop(gen, instr, ALU_SUB, OP_SUB_RR);
+        else
+            gen_binop(gen, instr, ALU_AND, OP_AND_RR);
+
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_MUL)
+    {
+        gen_load(gen, REG_RAX, instr->args[0]);
+        gen_load(gen, REG_R11, instr->args[1]);
+        asm_imul_rr(as, REG_RAX, REG_R11);
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_DIV || op == &IR_MOD)
+    {
+        gen_load(gen, REG_RAX, instr->args[0]);
+        gen_load(gen, REG_R11, instr->args[1]);
+
+        // cqo, sign-extend rax into rdx
+        asm_byte(as, 0x48);
+        asm_byte(as, 0x99);
+        asm_unary(as, 7, REG_R11);
+
+        gen_store(gen, instr, (op == &IR_DIV)? REG_RAX:REG_RDX);
+        return;
+    }
+
+    if (op == &IR_NEG)
+    {
+        gen_load(gen, REG_RAX, instr->args[0]);
+        asm_unary(as, 3, REG_RAX);
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_NOT)
+    {
+        gen_load(gen, REG_RAX, instr->args[0]);
+        asm_test_al(as);
+        asm_setcc_rax(as, CC_E);
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_LT) { gen_compare(gen, instr, CC_L); return; }
+    if (op == &IR_LE) { gen_compare(gen, instr, CC_LE); return; }
+    if (op == &IR_GT) { gen_compare(gen, instr, CC_G); return; }
+    if (op == &IR_GE) { gen_compare(gen, instr, CC_GE); return; }
+    if (op == &IR_EQ) { gen_compare(gen, instr, CC_E); return; }
+    if (op == &IR_NE) { gen_compare(gen, instr, CC_NE); return; }
+
+    if (op == &IR_GUARD_TAG)
+    {
+        gen_load(gen, REG_RAX, instr->args[0]);
+        asm_alu_ri(as, ALU_CMP, REG_RAX, instr->imm);
+        gen->guards[gen->num_guards] = instr;
+        gen->guard_jumps[gen->num_guards] = asm_jcc(as, CC_NE);
+        gen->num_guards++;
+        return;
+    }
+
+    if (op == &IR_CELL_NEW)
+    {
+        gen_call_c(gen, &cell_alloc);
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_CELL_GET || op == &IR_CELL_GET_TAG)
+    {
+        gen_load(gen, REG_R11, instr->args[0]);
+
+        if (op == &IR_CELL_GET)
+            asm_load(as, REG_RAX, REG_R11, offsetof(cell_t, word));
+        else
+            asm_load_u8(as, REG_RAX, REG_R11, offsetof(cell_t, tag));
+
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_CELL_SET)
+    {
+        // The tag is stored as a full word, the cell is padded
+        gen_load(gen, REG_R11, instr->args[0]);
+        gen_load(gen, REG_RAX, instr->args[1]);
+        asm_store(as, REG_R11, offsetof(cell_t, word), REG_RAX);
+        gen_load(gen, REG_RAX, instr->args[2]);
+        asm_store(as, REG_R11, offsetof(cell_t, tag), REG_RAX);
+        return;
+    }
+
+    if (op == &IR_GLOBAL_GET || op == &IR_GLOBAL_GET_TAG)
+    {
+        // The global slot table never moves, its address is embedded
+        asm_mov_ri(as, REG_R11, (int64_t)&vm.global_slots[instr->imm]);
+
+        if (op == &IR_GLOBAL_GET)
+            asm_load(as, REG_RAX, REG_R11, offsetof(value_t, word));
+        else
+            asm_load_u8(as, REG_RAX, REG_R11, offsetof(value_t, tag));
+
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_GLOBAL_SET)
+    {
+        // The tag is stored as a full word, the value is padded
+        asm_mov_ri(as, REG_R11, (int64_t)&vm.global_slots[instr->imm]);
+        gen_load(gen, REG_RAX, instr->args[0]);
+        asm_store(as, REG_R11, offsetof(value_t, word), REG_RAX);
+        gen_load(gen, REG_RAX, instr->args[1]);
+        asm_store(as, REG_R11, offsetof(value_t, tag), REG_RAX);
+        return;
+    }
+
+    if (op == &IR_CLOS_VAL || op == &IR_CLOS_VAL_TAG)
+    {
+        int32_t disp = offsetof(clos_t, vals) + sizeof(value_t) * instr->imm;
+        gen_load(gen, REG_R11, instr->args[0]);
+
+        if (op == &IR_CLOS_VAL)
+            asm_load(as, REG_RAX, REG_R11, disp + offsetof(value_t, word));
+        else
+            asm_load_u8(as, REG_RAX, REG_R11, disp + offsetof(value_t, tag));
+
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_NEW_CLOS)
+    {
+        // The captured values are passed on the stack, the tags are
+        // stored as full words
+        for (uint32_t i = 0; i < instr->num_args; ++i)
+        {
+            loc_t dst = loc_mem(REG_RSP, sizeof(word_t) * i);
+            gen_mov(as, dst, jit_loc(gen, instr->args[i]));
+        }
+
+        asm_mov_ri(as, REG_RDI, (int64_t)instr->ptr);
+        asm_mov_rr(as, REG_RSI, REG_RSP);
+        gen_call_c(gen, &jit_new_clos);
+        gen_store(gen, instr, REG_RAX);
+        return;
+    }
+
+    if (op == &IR_CALL || op == &IR_CALL_RT)
+    {
+        if (op == &IR_CALL)
+        {
+            gen_call(gen, instr);
+        }
+        else
+        {
+            static const int arg_regs[] = {
+                REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9
+            };
+
+            assert (instr->num_args <= 6);
+
+            move_t moves[6];
+            for (uint32_t i = 0; i < instr->num_args; ++i)
+            {
+                moves[i].dst = loc_reg(arg_regs[i]);
+                moves[i].src = jit_loc(gen, instr->args[i]);
+            }
+            gen_par_moves(as, moves, instr->num_args);
+
+            ir_helper_t* helper = instr->ptr;
+            gen_call_c(gen, helper->fptr);
+        }
+
+        // Values are returned in rax:rdx
+        gen_store(gen, instr, REG_RAX);
+
+        if (instr->next && instr->next->op == &IR_PROJ_TAG)
+        {
+            // movzx edx, dl
+            asm_byte(as, 0x0F);
+            asm_byte(as, 0xB6);
+            asm_byte(as, 0xD2);
+            gen_store(gen, instr->next, REG_RDX);
+        }
+
+        return;
+    }
+
+    if (op == &IR_IF)
+    {
+        ir_block_t* then_block = instr->targets[0];
+        ir_block_t* else_block = instr->targets[1];
+        assert (then_block->first == NULL || then_block->first->op != &IR_PHI);
+        assert (else_block->first == NULL || else_block->first->op != &IR_PHI);
+
+        gen_load(gen, REG_RAX, instr->args[0]);
+        asm_test_al(as);
+
+        jit_patch_t* patch = &gen->patches[gen->num_patches++];
+        patch->disp_off = asm_jcc(as, CC_E);
+        patch->target = else_block;
+
+        gen_jump(gen, block, then_block);
+        return;
+    }
+
+    if (op == &IR_JUMP)
+    {
+        ir_block_t* target = instr->targets[0];
+
+        uint32_t pred_idx = 0;
+        while (target->preds[pred_idx] != block)
+            pred_idx++;
+
+        // Move the phi inputs for this edge into place
+        uint32_t num_moves = 0;
+        for (ir_instr_t* phi = target->first; phi && phi->op == &IR_PHI; phi = phi->next)
+            num_moves++;
+
+        move_t* moves = malloc(sizeof(move_t) * (num_moves + 1));
+        num_moves = 0;
+        for (ir_instr_t* phi = target->first; phi && phi->op == &IR_PHI; phi = phi->next)
+        {
+            moves[num_moves].dst = jit_loc(gen, phi);
+            moves[num_moves].src = jit_loc(gen, phi->args[pred_idx]);
+            num_moves++;
+        }
+        gen_par_moves(as, moves, num_moves);
+        free(moves);
+
+        gen_jump(gen, block, target);
+        return;
+    }
+
+    if (op == &IR_RET)
+    {
+        move_t moves[2] = {
+            { loc_reg(REG_RAX), jit_loc(gen, instr->args[0]) },
+            { loc_reg(REG_RDX), jit_loc(gen, instr->args[1]) }
+        };
+        gen_par_moves(as, moves, 2);
+
+        gen_epilogue(gen);
+        return;
+    }
+
+    printf("jit error, unsupported IR instruction: %s\n", op->name);
+    exit(-1);
+}
+
+/**
+Compile an optimized and register allocated IR function
+*/
+void gen_fun(jit_gen_t* gen)
+{
+    asm_t* as = &gen->as;
+    ir_fun_t* fun = gen->fun;
+
+    // Space needed to pass arguments and closure cells on the stack
+    int32_t out_size = 0;
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            int32_t size = 0;
+
+            if (instr->op == &IR_CALL)
+                size = sizeof(value_t) * (instr->num_args / 2 - 1);
+            if (instr->op == &IR_NEW_CLOS)
+                size = sizeof(value_t) * (instr->num_args / 2);
+            if (instr->op == &IR_GUARD_TAG)
+                size = sizeof(value_t) * ((deopt_info_t*)instr->ptr)->num_vals;
+
+            if (size > out_size)
+                out_size = size;
+        }
+    }
+
+    gen->num_saved = __builtin_popcount(gen->ra.used_callee_saved);
+
+    // Keep the stack 16-byte aligned at call sites
+    gen->frame_size = 16 + 8 * (gen->num_saved + gen->ra.num_slots) + out_size;
+    gen->frame_size = (gen->frame_size + 15) & ~15;
+
+    // Prologue
+    asm_push(as, REG_RBP);
+    asm_mov_rr(as, REG_RBP, REG_RSP);
+    asm_alu_ri(as, ALU_SUB, REG_RSP, gen->frame_size);
+    asm_store(as, REG_RBP, FRAME_CLOS_DISP, REG_RDI);
+    asm_store(as, REG_RBP, FRAME_ARGS_DISP, REG_RSI);
+
+    // Mark the code as used, for the code cache eviction
+    asm_mov_ri(as, REG_RAX, (int64_t)&gen->code->used);
+    asm_store_imm(as, REG_RAX, 0, 1);
+
+    uint32_t idx = 0;
+    for (int reg = 0; reg < 16; ++reg)
+    {
+        if (gen->ra.used_callee_saved & (1 << reg))
+        {
+            asm_store(as, REG_RBP, -(16 + 8 * (idx + 1)), reg);
+            idx++;
+        }
+    }
+
+    // Calls deep in the native stack go to the interpreter. Entries for
+    // on-stack replacement are only entered with enough stack left.
+    size_t stack_full = 0;
+    if (gen->code->stmt_idx == 0)
+    {
+        asm_mov_ri(as, REG_RAX, (int64_t)&jit_stack_limit);
+        asm_load(as, REG_RAX, REG_RAX, 0);
+        asm_rr(as, OP_CMP_RR, REG_RSP, REG_RAX);
+        stack_full = asm_jcc(as, CC_B);
+    }
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        gen->block_offs[block->id] = as->len;
+
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+            gen_instr(gen, instr);
+    }
+
+    for (uint32_t i = 0; i < gen->num_patches; ++i)
+    {
+        jit_patch_t* patch = &gen->patches[i];
+        asm_patch(as, patch->disp_off, gen->block_offs[patch->target->id]);
+    }
+
+    // Deoptimization stubs, writing the deopt values of
+    // the guards to the bottom of the frame
+    for (uint32_t i = 0; i < gen->num_guards; ++i)
+    {
+        ir_instr_t* guard = gen->guards[i];
+        asm_patch(as, gen->guard_jumps[i], as->len);
+
+        for (uint32_t j = 1; j < guard->num_args; ++j)
+        {
+            int32_t disp = (j - 1) * sizeof(word_t);
+            gen_mov(as, loc_mem(REG_RSP, disp), jit_loc(gen, guard->args[j]));
+        }
+
+        asm_load(as, REG_RDI, REG_RBP, FRAME_CLOS_DISP);
+        asm_mov_ri(as, REG_RSI, (int64_t)guard->ptr);
+        asm_mov_rr(as, REG_RDX, REG_RSP);
+        gen_call_c(gen, &jit_deopt);
+        gen_epilogue(gen);
+    }
+
+    if (gen->code->stmt_idx == 0)
+    {
+        asm_patch(as, stack_full, as->len);
+        asm_load(as, REG_RDI, REG_RBP, FRAME_CLOS_DISP);
+        asm_load(as, REG_RSI, REG_RBP, FRAME_ARGS_DISP);
+        gen_call_c(gen, &jit_stack_overflow);
+        gen_epilogue(gen);
+    }
+}
+
+#endif
+
+/**
+Test if functions can be compiled on this platform
+*/
+bool jit_enabled()
+{
+#if defined(__x86_64__)
+    return codecache_ready();
+#else
+    return false;
+#endif
+}
+
+/**
+Compile an IR function to machine code
+The statement index is that of an on-stack replacement entry, or zero
+Returns NULL if the code could not be compiled
+*/
+void* jit_compile_ir(ir_fun_t* irfun, uint32_t stmt_idx)
+{
+#if defined(__x86_64__)
+    ir_optimize(irfun);
+
+    jit_code_t* code = calloc(1, sizeof(jit_code_t));
+    code->fun = irfun->fun;
+    code->stmt_idx = stmt_idx;
+
+    jit_gen_t gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.fun = irfun;
+    gen.code = code;
+    gen.block_offs = calloc(irfun->num_blocks + 1, sizeof(size_t));
+    gen.patches = malloc(sizeof(jit_patch_t) * MAX_PATCHES(irfun));
+    gen.guards = malloc(sizeof(ir_instr_t*) * (irfun->num_instrs + 1));
+    gen.guard_jumps = malloc(sizeof(size_t) * (irfun->num_instrs + 1));
+
+    regalloc(irfun, &gen.ra);
+    gen_fun(&gen);
+
+    void* entry = NULL;
+    if (codecache_add(code, gen.as.len))
+    {
+        memcpy(code->start, gen.as.buf, gen.as.len);
+        entry = code->start;
+
+        // The deopt metadata is referenced by the compiled code
+        code->deopts = irfun->deopts;
+        irfun->deopts = NULL;
+
+        if (jit_perf_map_file || jit_dump_file)
+        {
+            char name[256];
+            jit_code_name(irfun->fun, stmt_idx, name, sizeof(name));
+            jit_perf_record(name, entry, gen.as.len);
+        }
+    }
+    else
+    {
+        free(code);
+    }
+
+    free(gen.as.buf);
+    free(gen.block_offs);
+    free(gen.patches);
+    free(gen.guards);
+    free(gen.guard_jumps);
+    ir_free(irfun);
+
+    return entry;
+#else
+    ir_free(irfun);
+    return NULL;
+#endif
+}
+
+/**
+Get the number of interpreted calls before a function gets compiled
+This doubles each time its code is evicted from the code cache, so that
+code which doesn't fit in the cache is not recompiled over and over
+*/
+uint64_t jit_call_threshold(ast_fun_t* fun)
+{
+    uint32_t backoff = fun->num_evictions;
+    if (backoff > JIT_MAX_BACKOFF)
+        backoff = JIT_MAX_BACKOFF;
+
+    return (uint64_t)jit_threshold << backoff;
+}
+
+/**
+Compile a function to machine code
+Returns false if the function could not be compiled
+*/
+bool jit_compile(ast_fun_t* fun)
+{
+    if (!jit_enabled())
+        return false;
+
+    fun->jit_entry = jit_compile_ir(ir_build(fun), 0);
+
+    // Try again later if the code cache is under pressure
+    if (fun->jit_entry == NULL)
+    {
+        fun->num_calls = 0;
+        fun->num_evictions++;
+        return false;
+    }
+
+    fun->osr_failed = false;
+    return true;
+}
+
+/**
+Compile an on-stack replacement entry point resuming the body of a
+function at a given statement (see ir_build_osr)
+Returns false if the code could not be compiled
+*/
+bool jit_compile_osr(ast_fun_t* fun, uint32_t stmt_idx)
+{
+    if (!jit_enabled())
+        return false;
+
+    array_t* expr_list = ((ast_seq_t*)fun->body_expr)->expr_list;
+
+    if (fun->osr_entries == NULL)
+        fun->osr_entries = calloc(expr_list->len, sizeof(void*));
+
+    fun->osr_entries[stmt_idx] = jit_compile_ir(ir_build_osr(fun, stmt_idx), stmt_idx);
+
+    // Retrying on every statement would keep failing
+    if (fun->osr_entries[stmt_idx] == NULL)
+    {
+        fun->osr_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+void test_jit()
+{
+    printf("core JIT tests\n");
+
+    if (!jit_enabled())
+        return;
+
+    // Compile every function on its first call, and run
+    // the interpreter and runtime tests on compiled code
+    uint32_t threshold = jit_threshold;
+    jit_threshold = 1;
+
+    test_interp();
+    test_runtime();
+
+    value_t fib = eval_string(
+        "let fib = fun (n) if n < 2 then n else fib(n-1) + fib(n-2); fib",
+        "jit_test"
+    );
+    assert (fib.tag == TAG_CLOS);
+
+    value_t arg = value_from_int64(20);
+    value_t val = call_clos(fib.word.clos, &arg, 1);
+    assert (fib.word.clos->fun->jit_entry != NULL);
+    assert (val.tag == TAG_INT64 && val.word.int64 == 6765);
+
+    // Deoptimization in the middle of nested expressions, with a
+    // captured local variable and partially evaluated call arguments
+    val = eval_string(
+        "let f = fun (a, b) {"
+        "  var n = 1;"
+        "  let g = fun (x, y, z) x + z;"
+        "  let c = fun () n = n + 1;"
+        "  let v = [n, g(c(), if a <= b then 10 else 20, c())];"
+        "  v[1] + n"
+        "};"
+        "f(1, 2) + f('a', 'b') * 1000",
+        "jit_test"
+    );
+    assert (val.tag == TAG_INT64 && val.word.int64 == 8008);
+
+    val = eval_string(
+        "let f = fun (o, a, b) {"
+        "  o.x = :{ p: 1, q: a >= b, r: 3 };"
+        "  o.x.r + (if not (a <= b) then 1 else 2)"
+        "};"
+        "f(:{}, 1, 2) + f(:{}, 'b', 'a') * 10",
+        "jit_test"
+    );
+    assert (val.tag == TAG_INT64 && val.word.int64 == 45);
+
+    // Code which keeps deoptimizing gets recompiled without speculation
+    value_t cmp = eval_string("let cmp = fun (a, b) a <= b; cmp", "jit_test");
+    ast_fun_t* cmp_fun = cmp.word.clos->fun;
+    value_t args[2] = {
+        value_from_heapptr((heapptr_t)vm_get_cstr("a"), TAG_STRING),
+        value_from_heapptr((heapptr_t)vm_get_cstr("b"), TAG_STRING)
+    };
+    for (size_t i = 0; i < JIT_MAX_DEOPTS; ++i)
+    {
+        val = call_clos(cmp.word.clos, args, 2);
+        assert (value_equals(val, VAL_TRUE));
+    }
+    assert (cmp_fun->num_deopts == JIT_MAX_DEOPTS);
+    assert (cmp_fun->jit_entry == NULL);
+
+    val = call_clos(cmp.word.clos, args, 2);
+    assert (value_equals(val, VAL_TRUE));
+    assert (cmp_fun->jit_entry != NULL);
+    assert (cmp_fun->num_deopts == JIT_MAX_DEOPTS);
+
+    // Code reading a global as a constant is invalidated when
+    // a later unit assigns the global
+    value_t println = eval_string("println", "jit_test");
+    ast_fun_t* println_fun = println.word.clos->fun;
+    if (println_fun->jit_entry == NULL)
+        jit_compile(println_fun);
+    assert (println_fun->jit_entry != NULL);
+    test_eval_output("print = fun (x) $print_string('new'); println(1)", "new\n");
+
+    // Replace every call on the stack after its first statement,
+    // running unit bodies in compiled code
+    uint32_t osr_threshold = jit_osr_threshold;
+    jit_threshold = UINT32_MAX;
+    jit_osr_threshold = 1;
+
+    test_interp();
+    test_runtime();
+
+    // Captured locals are transferred in their cells, and the
+    // compiled unit body can deoptimize back into the interpreter
+    ast_fun_t* unit = parse_check_error(parse_string(
+        "var n = 1;"
+        "let f = fun () n = n + 1;"
+        "f();"
+        "let s = 'a';"
+        "n + (if s <= 'b' then 10 else 20)",
+        "jit_test"
+    ));
+    val = eval_unit(unit);
+    assert (val.tag == TAG_INT64 && val.word.int64 == 12);
+    assert (unit->osr_entries != NULL && unit->osr_entries[1] != NULL);
+    assert (unit->num_deopts == 1);
+
+    // Calls still interpreted when a recursive function gets compiled
+    // move to compiled code at their next statement
+    jit_threshold = 10;
+    jit_osr_threshold = osr_threshold;
+    value_t f = eval_string(
+        "let f = fun (n) {"
+        "  var r = 0;"
+        "  if n > 0 then r = f(n - 1) + 1 else r = 0;"
+        "  r"
+        "};"
+        "f",
+        "jit_test"
+    );
+    arg = value_from_int64(40);
+    val = call_clos(f.word.clos, &arg, 1);
+    assert (val.tag == TAG_INT64 && val.word.int64 == 40);
+    assert (f.word.clos->fun->osr_entries != NULL);
+    assert (f.word.clos->fun->osr_entries[1] == NULL);
+    assert (f.word.clos->fun->osr_entries[2] != NULL);
+
+    // Symbol names given to compiled code for profilers
+    char name[64];
+    jit_code_name(f.word.clos->fun, 0, name, sizeof(name));
+    assert (strcmp(name, "f jit_test:1") == 0);
+    jit_code_name(f.word.clos->fun, 2, name, sizeof(name));
+    assert (strcmp(name, "f jit_test:1 [osr 2]") == 0);
+    jit_code_name(unit, 0, name, sizeof(name));
+    assert (strcmp(name, "unit jit_test:1") == 0);
+
+    f = eval_string("var g = 0;\ng = fun () 1;\ng", "jit_test");
+    jit_code_name(f.word.clos->fun, 0, name, sizeof(name));
+    assert (strcmp(name, "g jit_test:2") == 0);
+
+    f = eval_string("[fun () 2][0]", "jit_test");
+    jit_code_name(f.word.clos->fun, 0, name, sizeof(name));
+    assert (strcmp(name, "fun jit_test:1") == 0);
+
+    // With a small code cache, cold code keeps getting evicted, and
+    // evicted functions wait longer before getting compiled again
+    size_t limit = codecache_limit;
+    codecache_stats_t stats = codecache_stats;
+    codecache_limit = 256;
+    jit_threshold = 1;
+
+    value_t funs = eval_string(
+        "[fun (n) n + 1, fun (n) n * 2, fun (n) n - 3, fun (n) n * n]",
+        "jit_test"
+    );
+    for (int64_t i = 0; i < 100; ++i)
+    {
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            value_t clos = array_get(funs.word.array, j);
+            arg = value_from_int64(i);
+            val = call_clos(clos.word.clos, &arg, 1);
+            assert (val.tag == TAG_INT64);
+        }
+    }
+    assert (codecache_stats.num_evicted > stats.num_evicted);
+    assert (codecache_stats.num_added - stats.num_added < 40);
+    assert (codecache_stats.bytes_used <= codecache_limit);
+
+    arg = value_from_int64(20);
+    val = call_clos(fib.word.clos, &arg, 1);
+    assert (val.tag == TAG_INT64 && val.word.int64 == 6765);
+
+    // On-stack replacement entries which can't be added to the code
+    // cache are not compiled again until the function gets compiled
+    codecache_limit = 0;
+    jit_threshold = UINT32_MAX;
+    jit_osr_threshold = 1;
+    f = eval_string("fun (n) { let a = n + 1; let b = a * 2; a + b }", "jit_test");
+    arg = value_from_int64(3);
+    val = call_clos(f.word.clos, &arg, 1);
+    assert (val.tag == TAG_INT64 && val.word.int64 == 12);
+    assert (f.word.clos->fun->osr_failed);
+    assert (f.word.clos->fun->osr_entries[1] == NULL);
+
+    codecache_limit = limit;
+    assert (jit_compile(f.word.clos->fun));
+    assert (!f.word.clos->fun->osr_failed);
+    jit_osr_threshold = osr_threshold;
+
+    jit_threshold = threshold;
+
+    // Deep recursions leave compiled code for the interpreter stack
+    // before using up the native stack
+    test_eval_output(
+        "let f = fun (n) if n == 0 then 0 else 1 + f(n-1); println(f(200000))",
+        "200000\n"
+    );
+    val = eval_string(
+        "let f = fun (n) {"
+        "  var r = 0;"
+        "  if n > 0 then r = f(n - 1) + 1 else r = 0;"
+        "  r"
+        "};"
+        "f(200000)",
+        "jit_test"
+    );
+    assert (val.tag == TAG_INT64 && val.word.int64 == 200000);
+}
@@ -0,0 +1,81 @@
+/**
+Zeta x86-64 JIT compiler
+
+Functions which get called often enough are translated to the SSA IR (see
+ir.h), optimized, register allocated (see regalloc.h) and compiled to
+x86-64 machine code. Compiled functions follow the System V calling
+convention, so that the interpreter and compiled code can call each other.
+On other platforms, functions are never compiled. Compiled code is held
+in a bounded code cache (see codecache.h).
+
+Interpreted calls which keep running for long, such as unit bodies, are
+moved to compiled code between two statements of the function body. The
+compiled entry point resumes the body at that statement, taking the
+interpreter locals as its arguments (on-stack replacement).
+*/
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "vm.h"
+#include "parser.h"
+#include "interp.h"
+
+/// Entry point of a compiled function
+typedef value_t (*jit_entry_t)(clos_t* clos, value_t* args);
+
+/// Default number of interpreted calls before a function gets compiled
+#define JIT_CALL_THRESHOLD 50
+
+/// Default number of statements an interpreted call executes in its body
+/// before it gets replaced on the stack by compiled code
+#define JIT_OSR_THRESHOLD 100
+
+/// Maximum number of arguments of tail calls in compiled code
+#define JIT_MAX_TAIL_ARGS 16
+
+/// Number of deoptimizations after which compiled code is discarded
+#define JIT_MAX_DEOPTS 4
+
+/// Maximum number of times the call threshold of a function is doubled
+/// when its code gets evicted from the code cache
+#define JIT_MAX_BACKOFF 16
+
+/// Native stack space available to compiled code, deeper calls are
+/// interpreted, on the interpreter stack (at most half the stack limit)
+#define JIT_STACK_SIZE (1 << 22)
+
+/// Number of interpreted calls before a function gets compiled
+extern uint32_t jit_threshold;
+
+/// Number of statements executed before on-stack replacement
+extern uint32_t jit_osr_threshold;
+
+/// Write perf map entries for compiled code, to /tmp/perf-<pid>.map
+extern bool jit_perf_map;
+
+/// Write compiled code to a jitdump file for perf inject,
+/// to /tmp/jit-<pid>.dump
+extern bool jit_dump;
+
+void init_jit();
+
+bool jit_enabled();
+
+bool jit_stack_full();
+
+uint64_t jit_call_threshold(ast_fun_t* fun);
+
+bool jit_compile(ast_fun_t* fun);
+
+bool jit_compile_osr(ast_fun_t* fun, uint32_t stmt_idx);
+
+char* jit_code_name(ast_fun_t* fun, uint32_t stmt_idx, char* buf, size_t size);
+
+value_t jit_enter(void* entry, clos_t* clos, value_t* args);
+
+value_t jit_call(value_t callee, value_t* args, uint64_t num_args);
+
+void test_jit();
+
+#endif
@@ -3,6 +3,11 @@
 #include "vm.h"
 #include "parser.h"
 #include "interp.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "codecache.h"
+#include "jit.h"
+#include "api_core.h"
 #include "util.h"
 
 void run_repl()
@@ -23,6 +28,13 @@ void run_repl()
 
         char* cstr = read_line();
 
+        // Stop at the end of the input
+        if (cstr == NULL)
+        {
+            putchar('\n');
+            break;
+        }
+
         // Evaluate the code string
         value_t value = eval_string(cstr, "shell");
 
@@ -36,8 +48,31 @@ void run_repl()
 
 int main(int argc, char** argv)
 {
-    // Check if we are in test mode
-    bool test = (argc == 2 && strcmp(argv[1], "--test") == 0);
+    bool test = false;
+    bool bench = false;
+    char* file_name = NULL;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        // Check if we are in test mode
+        if (strcmp(argv[i], "--test") == 0)
+            test = true;
+
+        // Run the benchmarks of the runtime primitives
+        else if (strcmp(argv[i], "--bench") == 0)
+            bench = true;
+
+        // Profiler support for compiled code
+        else if (strcmp(argv[i], "--perf-map") == 0)
+            jit_perf_map = true;
+        else if (strcmp(argv[i], "--jitdump") == 0)
+            jit_dump = true;
+
+        else
+            file_name = argv[i];
+    }
+
+    init_output();
 
     init_vm();
     if (test)
@@ -47,6 +82,13 @@ int main(int argc, char** argv)
     if (test)
         test_parser();
 
+    if (bench)
+    {
+        bench_vm();
+        bench_parser();
+        return 0;
+    }
+
     init_interp();
     if (test)
         test_interp();
@@ -55,14 +97,28 @@ int main(int argc, char** argv)
     if (test)
         test_runtime();
 
+    if (test)
+        test_ir();
+
+    if (test)
+        test_regalloc();
+
+    init_codecache();
+    if (test)
+        test_codecache();
+
+    init_jit();
+    if (test)
+        test_jit();
+
     // File name passed
-    if (argc == 2 && !test)
+    if (file_name && !test)
     {
-        eval_file(argv[1]);
+        eval_file(file_name);
     }
 
     // No file names passed. Read-eval-print loop.
-    if (argc == 1)
+    if (!file_name && !test)
     {
         run_repl();
     }
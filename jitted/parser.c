@@ -72,6 +72,8 @@ Initialize data needed by the Zeta core parser
 */
 void init_parser()
 {
+    init_tokenizer();
+
     // TODO: use shapes to describe AST node struct layouts
     // - use helper functions to make this easier
     // - assert that size according to shape matches sizeof(struct)
@@ -96,142 +98,442 @@ char* srcpos_to_str(srcpos_t pos, char* buf)
     return buf;
 }
 
-input_t input_from_string(string_t* str, string_t* src_name)
+/**
+Allocate a source for some text, which must outlive the source
+*/
+srcfile_t* srcfile_alloc(string_t* name, const char* data, uint32_t len)
 {
-    input_t input;
-    input.str = str;
-    input.idx = 0;
-    input.src_name = src_name;
-    input.pos.lineNo = 0;
-    input.pos.colNo = 0;
-    return input;
+    assert (data[len] == '\0');
+
+    srcfile_t* src = malloc(sizeof(srcfile_t));
+    src->name = name;
+    src->data = data;
+    src->len = len;
+    src->view.data = NULL;
+    src->line_starts = NULL;
+    src->num_lines = 0;
+    return src;
 }
 
-/// Test if the end of file has been reached
-bool input_eof(input_t* input)
+/**
+Build the table of line start offsets of a source
+*/
+void srcfile_index_lines(srcfile_t* src)
 {
-    assert (input->str != NULL);
-    return (input->idx >= input->str->len);
+    src->num_lines = 1 + bytes_count_byte(src->data, src->len, '\n');
+    src->line_starts = malloc(src->num_lines * sizeof(uint32_t));
+    src->line_starts[0] = 0;
+
+    const char* p = src->data;
+    const char* end = src->data + src->len;
+
+    for (uint32_t i = 1; i < src->num_lines; ++i)
+    {
+        p = bytes_find_byte(p, end - p, '\n') + 1;
+        src->line_starts[i] = p - src->data;
+    }
 }
 
-/// Peek at a character from the input
-char input_peek_ch(input_t* input)
+/**
+Convert a byte offset in a source into line and column numbers
+The line table is built on the first conversion.
+*/
+srcpos_t srcfile_pos(srcfile_t* src, uint32_t offset)
 {
-    assert (input->str != NULL);
+    assert (offset <= src->len);
 
-    if (input->idx >= input->str->len)
-        return '\0';
+    if (src->line_starts == NULL)
+        srcfile_index_lines(src);
+
+    // Find the last line starting at or before the offset
+    uint32_t lo = 0;
+    uint32_t hi = src->num_lines;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
 
-    return input->str->data[input->idx];
+        if (src->line_starts[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    srcpos_t pos;
+    pos.lineNo = lo;
+    pos.colNo = offset - src->line_starts[lo];
+    return pos;
 }
 
-/// Read a character from the input
-char input_read_ch(input_t* input)
+/// Character classes for the tokenizer, filled by init_tokenizer
+#define CH_IDENT_START  1
+#define CH_IDENT        2
+#define CH_DIGIT        4
+#define CH_SPACE        8
+uint8_t char_class[256];
+
+/**
+Keyword table entry
+*/
+typedef struct
 {
-    char ch = input_peek_ch(input);
+    const char* str;
+
+    uint8_t len;
+
+    uint8_t kind;
+
+} keyword_t;
+
+/// Keywords, indexed by keyword_hash, which is perfect for this set
+keyword_t keyword_tbl[32];
+
+/// Operators matching each kind of token, NULL for other tokens
+/// The - token is both binary subtraction and unary negation.
+const opinfo_t* tok_ops[TOK_NUM_KINDS] = {
+    [TOK_DOT] = &OP_MEMBER,
+    [TOK_LBRACKET] = &OP_INDEX,
+    [TOK_LPAREN] = &OP_CALL,
+    [TOK_NOT] = &OP_NOT,
+    [TOK_STAR] = &OP_MUL,
+    [TOK_SLASH] = &OP_DIV,
+    [TOK_MOD] = &OP_MOD,
+    [TOK_PLUS] = &OP_ADD,
+    [TOK_MINUS] = &OP_SUB,
+    [TOK_LT] = &OP_LT,
+    [TOK_LE] = &OP_LE,
+    [TOK_GT] = &OP_GT,
+    [TOK_GE] = &OP_GE,
+    [TOK_IN] = &OP_IN,
+    [TOK_INSTANCEOF] = &OP_INST_OF,
+    [TOK_EQ] = &OP_EQ,
+    [TOK_NE] = &OP_NE,
+    [TOK_AND] = &OP_AND,
+    [TOK_OR] = &OP_OR,
+    [TOK_ASSIGN] = &OP_ASSIGN,
+};
 
-    input->idx++;
+/**
+Hash function for the keywords, computed from the first two characters
+and the length of an identifier of at least two characters
+*/
+uint32_t keyword_hash(const char* str, uint32_t len)
+{
+    return ((uint8_t)str[0] + 18 * (uint8_t)str[1] + len) & 31;
+}
 
-    if (ch == '\n')
+/**
+Initialize the character classes and the keyword table
+*/
+void init_tokenizer()
+{
+    for (int ch = 0; ch < 256; ++ch)
     {
-        input->pos.lineNo++;
-        input->pos.colNo = 0;
+        char_class[ch] = 0;
+
+        if (isalpha(ch) || ch == '_' || ch == '$')
+            char_class[ch] |= CH_IDENT_START | CH_IDENT;
+
+        if (isdigit(ch))
+            char_class[ch] |= CH_IDENT | CH_DIGIT;
+
+        if (isspace(ch))
+            char_class[ch] |= CH_SPACE;
     }
-    else
+
+    static const keyword_t keywords[] = {
+        { "var", 3, TOK_VAR },
+        { "let", 3, TOK_LET },
+        { "if", 2, TOK_IF },
+        { "then", 4, TOK_THEN },
+        { "else", 4, TOK_ELSE },
+        { "fun", 3, TOK_FUN },
+        { "true", 4, TOK_TRUE },
+        { "false", 5, TOK_FALSE },
+        { "not", 3, TOK_NOT },
+        { "mod", 3, TOK_MOD },
+        { "and", 3, TOK_AND },
+        { "or", 2, TOK_OR },
+        { "in", 2, TOK_IN },
+        { "instanceof", 10, TOK_INSTANCEOF },
+    };
+
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i)
     {
-        input->pos.colNo++;
-    }
+        uint32_t h = keyword_hash(keywords[i].str, keywords[i].len);
 
-    return ch;
+        // The hash function must be perfect for the keyword set
+        assert (keyword_tbl[h].str == NULL);
+        keyword_tbl[h] = keywords[i];
+    }
 }
 
-/// Try and match a given character in the input
-/// The character is consumed if matched
-bool input_match_ch(input_t* input, char ch)
+/**
+Get the kind of an identifier token, which may be a keyword
+*/
+uint8_t keyword_lookup(const char* str, uint32_t len)
 {
-    if (input_peek_ch(input) == ch)
-    {
-        input_read_ch(input);
-        return true;
-    }
+    if (len < 2 || len > 10)
+        return TOK_IDENT;
 
-    return false;
+    keyword_t* kw = &keyword_tbl[keyword_hash(str, len)];
+
+    if (kw->len == len && memcmp(kw->str, str, len) == 0)
+        return kw->kind;
+
+    return TOK_IDENT;
 }
 
-/// Try and match a given string in the input
-/// The string is consumed if matched
-bool input_match_str(input_t* input, char* str)
+/**
+Skip whitespace and comments, returning the index of the next token
+Sets the unterminated flag if the input ends inside a comment.
+*/
+uint32_t skip_ws(const char* data, uint32_t len, uint32_t idx, bool* unterminated)
 {
-    input_t sub = *input;
-
+    // Until the end of the whitespace
     for (;;)
     {
-        if (*str == '\0')
-        {
-            *input = sub;
-            return true;
-        }
+        // Most tokens are separated by at most one space
+        if (data[idx] == ' ')
+            idx++;
+
+        if (char_class[(uint8_t)data[idx]] & CH_SPACE)
+            idx += bytes_skip_space(data + idx, len - idx);
 
-        if (input_eof(&sub))
+        // Note: the source text is followed by a zero byte, so the
+        // character after a slash can always be read
+        if (data[idx] != '/')
+            return idx;
+
+        // Single-line comment, skip to the end of the line
+        if (data[idx + 1] == '/')
         {
-            return false;
+            const char* nl = bytes_find_byte(data + idx + 2, len - idx - 2, '\n');
+            idx = nl? (nl - data + 1):len;
+            continue;
         }
 
-        if (!input_match_ch(&sub, *str))
+        // Multi-line comment, skip past the closing */
+        if (data[idx + 1] == '*')
         {
-            return false;
+            const char* end = bytes_find(data + idx + 2, len - idx - 2, "*/", 2);
+
+            if (end == NULL)
+            {
+                *unterminated = true;
+                return idx;
+            }
+
+            idx = end - data + 2;
+            continue;
         }
 
-        str++;
+        return idx;
     }
 }
 
-/// Consume whitespace and comments
-void input_eat_ws(input_t* input)
+/**
+Find the end of a string literal starting with a given quote character
+Returns 0 if the literal is not terminated.
+*/
+uint32_t lex_string(const char* data, uint32_t len, uint32_t idx, char quote)
 {
-    // Until the end of the whitespace
     for (;;)
     {
-        // Consume whitespace characters
-        if (isspace(input_peek_ch(input)))
+        const char* end = bytes_find_byte(data + idx, len - idx, quote);
+
+        if (end == NULL)
+            return 0;
+
+        // Escape sequences may contain the quote character
+        const char* esc = bytes_find_byte(data + idx, end - (data + idx), '\\');
+
+        if (esc == NULL)
+            return end - data + 1;
+
+        idx = esc - data + 2;
+    }
+}
+
+/**
+Split source text into tokens
+The token array ends with a TOK_EOF token and is allocated with malloc.
+*/
+token_t* tokenize(const char* data, uint32_t len, uint32_t* num_toks)
+{
+    assert (data[len] == '\0');
+
+    size_t cap = 16 + len / 8;
+    token_t* toks = malloc(cap * sizeof(token_t));
+    size_t n = 0;
+    uint32_t idx = 0;
+
+    for (;;)
+    {
+        if (n == cap)
         {
-            input_read_ch(input);
+            cap *= 2;
+            toks = realloc(toks, cap * sizeof(token_t));
+        }
+
+        bool unterminated = false;
+        idx = skip_ws(data, len, idx, &unterminated);
+
+        token_t* tok = &toks[n++];
+        tok->start = idx;
+
+        if (unterminated)
+        {
+            tok->kind = TOK_ERROR;
+            tok->len = len - idx;
+            idx = len;
             continue;
         }
 
-        // If this is a single-line comment
-        if (input_match_str(input, "//"))
+        if (idx >= len)
         {
-            // Read until and end of line is reached
-            for (;;)
+            tok->kind = TOK_EOF;
+            tok->len = 0;
+            break;
+        }
+
+        char ch = data[idx];
+        uint8_t cls = char_class[(uint8_t)ch];
+        uint32_t end = idx + 1;
+
+        if (cls & CH_IDENT_START)
+        {
+            while (char_class[(uint8_t)data[end]] & CH_IDENT)
+                end++;
+
+            tok->kind = keyword_lookup(data + idx, end - idx);
+        }
+        else if (cls & CH_DIGIT)
+        {
+            // Hexadecimal and binary literals
+            if (ch == '0' && data[end] == 'x')
+            {
+                end++;
+                while (isxdigit((uint8_t)data[end]))
+                    end++;
+            }
+            else if (ch == '0' && data[end] == 'b')
+            {
+                end++;
+                while (data[end] == '0' || data[end] == '1')
+                    end++;
+            }
+            else
             {
-                char ch = input_read_ch(input);
-                if (ch == '\n' || ch == '\0')
-                    break;
+                while (char_class[(uint8_t)data[end]] & CH_DIGIT)
+                    end++;
             }
 
-            continue;
+            tok->kind = TOK_INT;
         }
-
-        // If this is a multi-line comment
-        if (input_match_str(input, "/*"))
+        else
         {
-            // Read until the end of the comment
-            for (;;)
+            // Two-character operators ending with '='
+            bool eq_next = (data[end] == '=');
+
+            switch (ch)
             {
-                char ch = input_read_ch(input);
-                if (ch == '*' && input_match_ch(input, '/'))
-                    break;
+                case '\'':
+                case '"':
+                end = lex_string(data, len, idx + 1, ch);
+                tok->kind = end? TOK_STRING:TOK_ERROR;
+                end = end? end:len;
+                break;
+
+                case '.': tok->kind = TOK_DOT; break;
+                case ',': tok->kind = TOK_COMMA; break;
+                case ';': tok->kind = TOK_SEMI; break;
+                case ':': tok->kind = TOK_COLON; break;
+                case '(': tok->kind = TOK_LPAREN; break;
+                case ')': tok->kind = TOK_RPAREN; break;
+                case '[': tok->kind = TOK_LBRACKET; break;
+                case ']': tok->kind = TOK_RBRACKET; break;
+                case '{': tok->kind = TOK_LBRACE; break;
+                case '}': tok->kind = TOK_RBRACE; break;
+                case '+': tok->kind = TOK_PLUS; break;
+                case '-': tok->kind = TOK_MINUS; break;
+                case '*': tok->kind = TOK_STAR; break;
+                case '/': tok->kind = TOK_SLASH; break;
+                case '<': tok->kind = eq_next? TOK_LE:TOK_LT; break;
+                case '>': tok->kind = eq_next? TOK_GE:TOK_GT; break;
+                case '=': tok->kind = eq_next? TOK_EQ:TOK_ASSIGN; break;
+                case '!': tok->kind = eq_next? TOK_NE:TOK_OTHER; break;
+
+                default:
+                tok->kind = TOK_OTHER;
             }
 
-            continue;
+            if (eq_next && (ch == '<' || ch == '>' || ch == '=' || ch == '!'))
+                end++;
         }
 
-        // This isn't whitespace, stop
-        break;
+        tok->len = end - idx;
+        idx = end;
     }
+
+    *num_toks = n;
+    return toks;
 }
 
+input_t input_from_src(srcfile_t* src)
+{
+    input_t input;
+    input.src = src;
+    input.data = src->data;
+    input.len = src->len;
+    input.toks = tokenize(src->data, src->len, &input.num_toks);
+    input.tok_idx = 0;
+    return input;
+}
+
+void input_free(input_t* input)
+{
+    free(input->toks);
+    input->toks = NULL;
+}
+
+/// Get the current token
+token_t* input_peek_tok(input_t* input)
+{
+    assert (input->tok_idx < input->num_toks);
+    return &input->toks[input->tok_idx];
+}
+
+/// Get the kind of the current token
+uint8_t input_peek(input_t* input)
+{
+    return input_peek_tok(input)->kind;
+}
+
+/// Consume the current token, the final TOK_EOF is never consumed
+void input_next(input_t* input)
+{
+    if (input_peek(input) != TOK_EOF)
+        input->tok_idx++;
+}
+
+/// Try and match a token of a given kind
+/// The token is consumed if matched
+bool input_match_tok(input_t* input, uint8_t kind)
+{
+    if (input_peek(input) == kind)
+    {
+        input_next(input);
+        return true;
+    }
+
+    return false;
+}
+
+/// Get the byte offset of the current token
+uint32_t input_offset(input_t* input)
+{
+    return input_peek_tok(input)->start;
+}
 
 /// Allocate a parse error node
 heapptr_t ast_error_alloc(input_t* input, const char* error_str)
@@ -241,8 +543,9 @@ heapptr_t ast_error_alloc(input_t* input, const char* error_str)
         SHAPE_AST_ERROR
     );
 
-    node->src_pos = input->pos;
+    node->src_off = input_offset(input);
     node->error_str = vm_get_cstr(error_str);
+    node->src = input->src;
 
     assert (ast_error((heapptr_t)node));
 
@@ -255,6 +558,15 @@ bool ast_error(heapptr_t node)
     return get_shape(node) == SHAPE_AST_ERROR;
 }
 
+/// Set the source offset of a node, parse errors are left as they are
+heapptr_t ast_at(heapptr_t node, uint32_t src_off)
+{
+    if (!ast_error(node))
+        ((ast_node_t*)node)->src_off = src_off;
+
+    return node;
+}
+
 /// Allocate an integer node
 heapptr_t ast_const_alloc(value_t val)
 {
@@ -292,6 +604,11 @@ heapptr_t ast_decl_alloc(heapptr_t name_str, bool cst)
     node->idx = 0xFFFF;
     node->cst = cst;
     node->esc = false;
+    node->num_assigns = 0;
+    node->assigned = false;
+    node->capt_early = false;
+    node->global = false;
+    node->cst_deps = NULL;
     return (heapptr_t)node;
 }
 
@@ -387,7 +704,17 @@ heapptr_t ast_fun_alloc(
     node->local_decls = array_alloc(4);
     node->esc_locals = array_alloc(4);
     node->free_vars = array_alloc(4);
+    node->capt_map = NULL;
+    node->shared_clos = NULL;
     node->body_expr = body_expr;
+    node->name = NULL;
+    node->src = NULL;
+    node->num_calls = 0;
+    node->jit_entry = NULL;
+    node->num_deopts = 0;
+    node->num_evictions = 0;
+    node->osr_entries = NULL;
+    node->osr_failed = false;
     return (heapptr_t)node;
 }
 
@@ -413,41 +740,19 @@ heapptr_t ast_obj_alloc(
 
 /**
 Parse an identifier
+Keywords are also accepted where only a name can appear, such as after
+the member operator.
 */
 heapptr_t parse_ident(input_t* input)
 {
-    size_t startIdx = input->idx;
-    size_t len = 0;
-
-    char firstCh = input_peek_ch(input);
-
-    if (firstCh != '_' &&
-        firstCh != '$' &&
-        !isalpha(firstCh))
-        return ast_error_alloc(input, "invalid identifier start");;
-
-    for (;;)
-    {
-        char ch = input_peek_ch(input);
-
-        if (!isalnum(ch) && ch != '$' && ch != '_')
-            break;
-
-        // Consume this character
-        input_read_ch(input);
-        len++;
-    }
+    token_t* tok = input_peek_tok(input);
 
-    if (len == 0)
-        return ast_error_alloc(input, "invalid identifier");
+    if (tok->kind != TOK_IDENT && !TOK_IS_KEYWORD(tok->kind))
+        return ast_error_alloc(input, "invalid identifier start");
 
-    string_t* str = string_alloc(len);
+    input_next(input);
 
-    // Copy the characters
-    strncpy(str->data, input->str->data + startIdx, len);
-    str->data[len] = '\0';
-
-    return (heapptr_t)vm_get_tbl_str(str);
+    return (heapptr_t)vm_get_str(input->data + tok->start, tok->len);
 }
 
 /**
@@ -456,72 +761,60 @@ Note: floating-point numbers are not supported by the core parser
 */
 heapptr_t parse_number(input_t* input)
 {
-    char* numStart;
-
-    int64_t intVal;
-
-    char* endInt = NULL;
-
-    // Hexadecimal literals
-    if (input_match_str(input, "0x"))
-    {
-        numStart = input->str->data + input->idx;
-        intVal = strtol(numStart, &endInt, 16);
-    }
+    token_t* tok = input_peek_tok(input);
+    const char* digits = input->data + tok->start;
+    const char* end = digits + tok->len;
+    int base = 10;
 
-    // Binary literals
-    else if (input_match_str(input, "0b"))
+    // Hexadecimal and binary literals
+    if (tok->len >= 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'b'))
     {
-        numStart = input->str->data + input->idx;
-        intVal = strtol(numStart, &endInt, 2);
+        base = (digits[1] == 'x')? 16:2;
+        digits += 2;
     }
 
-    // Decimal literals
-    else
+    // The digits were validated by the tokenizer
+    uint64_t intVal = 0;
+    for (; digits < end; ++digits)
     {
-        numStart = input->str->data + input->idx;
-        intVal = strtol(numStart, &endInt, 10);
+        int digit = isdigit((uint8_t)*digits)? (*digits - '0'):(tolower((uint8_t)*digits) - 'a' + 10);
+        intVal = intVal * base + digit;
     }
 
-    input->idx += endInt - numStart;
-    return (heapptr_t)ast_const_alloc(value_from_int64(intVal));
+    input_next(input);
+    return ast_at(ast_const_alloc(value_from_int64((int64_t)intVal)), tok->start);
 }
 
 /**
 Parse a string literal
 */
-heapptr_t parse_string_lit(input_t* input, char endCh)
+heapptr_t parse_string_lit(input_t* input)
 {
-    size_t len = 0;
-    size_t cap = 64;
+    token_t* tok = input_peek_tok(input);
 
-    char* buf = malloc(cap);
+    // Characters between the quotes
+    const char* chars = input->data + tok->start + 1;
+    uint32_t len = tok->len - 2;
 
-    for (;;)
+    // Without escape sequences, the string is taken from the source text
+    if (bytes_find_byte(chars, len, '\\') == NULL)
     {
-        // If this is the end of the input
-        if (input_eof(input))
-        {
-            free(buf);
-            return ast_error_alloc(
-                input,
-                "end of input inside string literal"
-            );
-        }
+        input_next(input);
+        return (heapptr_t)vm_get_str(chars, len);
+    }
 
-        // Consume this character
-        char ch = input_read_ch(input);
+    char* buf = malloc(len);
+    uint32_t buf_len = 0;
 
-        // If this is the end of the string
-        if (ch == endCh)
-        {
-            break;
-        }
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        char ch = chars[i];
 
         // If this is an escape sequence
+        // Note: the tokenizer ensures that a character follows
         if (ch == '\\')
         {
-            char esc = input_read_ch(input);
+            char esc = chars[++i];
 
             switch (esc)
             {
@@ -536,25 +829,15 @@ heapptr_t parse_string_lit(input_t* input, char endCh)
             }
         }
 
-        buf[len] = ch;
-        len++;
-
-        if (len == cap)
-        {
-            cap *= 2;
-            char* newBuf = malloc(cap);
-            strncpy(newBuf, buf, len);
-            free(buf);
-        }
+        buf[buf_len++] = ch;
     }
 
-    buf[len] = '\0';
-
     // Get the interned version of this string
-    string_t* str = vm_get_cstr(buf);
+    string_t* str = vm_get_str(buf, buf_len);
 
     free(buf);
 
+    input_next(input);
     return (heapptr_t)str;
 }
 
@@ -566,8 +849,7 @@ heapptr_t parse_if_expr(input_t* input)
 {
     heapptr_t test_expr = parse_expr(input);
 
-    input_eat_ws(input);
-    if (!input_match_str(input, "then"))
+    if (!input_match_tok(input, TOK_THEN))
     {
         return ast_error_alloc(input, "expected 'then' keyword");
     }
@@ -583,8 +865,7 @@ heapptr_t parse_if_expr(input_t* input)
     heapptr_t else_expr;
 
     // If these is an else clause
-    input_eat_ws(input);
-    if (input_match_str(input, "else"))
+    if (input_match_tok(input, TOK_ELSE))
     {
        else_expr = parse_expr(input);
     }
@@ -599,7 +880,7 @@ heapptr_t parse_if_expr(input_t* input)
 /**
 Parse a list of expressions
 */
-heapptr_t parse_expr_list(input_t* input, char endCh)
+heapptr_t parse_expr_list(input_t* input, uint8_t end_tok)
 {
     // Allocate an array with an initial capacity
     array_t* arr = array_alloc(4);
@@ -607,11 +888,8 @@ heapptr_t parse_expr_list(input_t* input, char endCh)
     // Until the end of the list
     for (;;)
     {
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, endCh))
+        if (input_match_tok(input, end_tok))
         {
             break;
         }
@@ -628,17 +906,14 @@ heapptr_t parse_expr_list(input_t* input, char endCh)
         // Write the expression to the array
         array_set_obj(arr, arr->len, expr);
 
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, endCh))
+        if (input_match_tok(input, end_tok))
         {
             break;
         }
 
         // If this is not the first element, there must be a separator
-        if (!input_match_ch(input, ','))
+        if (!input_match_tok(input, TOK_COMMA))
         {
             return ast_error_alloc(input, "expected comma separator in list");
         }
@@ -650,7 +925,7 @@ heapptr_t parse_expr_list(input_t* input, char endCh)
 /**
 Parse a sequence expression
 */
-heapptr_t parse_seq_expr(input_t* input, char endCh)
+heapptr_t parse_seq_expr(input_t* input, uint8_t end_tok)
 {
     // Allocate an array with an initial capacity
     array_t* arr = array_alloc(4);
@@ -658,11 +933,8 @@ heapptr_t parse_seq_expr(input_t* input, char endCh)
     // Until the end of the list
     for (;;)
     {
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, endCh))
+        if (input_match_tok(input, end_tok))
         {
             break;
         }
@@ -679,17 +951,14 @@ heapptr_t parse_seq_expr(input_t* input, char endCh)
         // Write the expression to the array
         array_set_obj(arr, arr->len, expr);
 
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, endCh))
+        if (input_match_tok(input, end_tok))
         {
             break;
         }
 
         // Match a semicolon if one is present (optional)
-        if (input_match_ch(input, ';'))
+        if (input_match_tok(input, TOK_SEMI))
         {
         }
     }
@@ -703,8 +972,7 @@ fun (x,y,z) <body_expr>
 */
 heapptr_t parse_fun_expr(input_t* input)
 {
-    input_eat_ws(input);
-    if (!input_match_ch(input, '('))
+    if (!input_match_tok(input, TOK_LPAREN))
     {
         return ast_error_alloc(input, "expected parameter list");
     }
@@ -715,33 +983,28 @@ heapptr_t parse_fun_expr(input_t* input)
     // Until the end of the list
     for (;;)
     {
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, ')'))
+        if (input_match_tok(input, TOK_RPAREN))
             break;
 
         // Parse an identifier
+        uint32_t ident_off = input_offset(input);
         heapptr_t ident = parse_ident(input);
 
         if (ast_error(ident))
             return ident;
 
-        heapptr_t decl = ast_decl_alloc(ident, false);
+        heapptr_t decl = ast_at(ast_decl_alloc(ident, false), ident_off);
 
         // Write the expression to the array
         array_set_obj(param_decls, param_decls->len, decl);
 
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, ')'))
+        if (input_match_tok(input, TOK_RPAREN))
             break;
 
         // If this is not the first element, there must be a separator
-        if (!input_match_ch(input, ','))
+        if (!input_match_tok(input, TOK_COMMA))
         {
             return ast_error_alloc(input, "expected comma separator in parameter list");
         }
@@ -755,7 +1018,28 @@ heapptr_t parse_fun_expr(input_t* input)
         return body_expr;
     }
 
-    return (heapptr_t)ast_fun_alloc(param_decls, body_expr);
+    ast_fun_t* fun = (ast_fun_t*)ast_fun_alloc(param_decls, body_expr);
+    fun->src = input->src;
+
+    return (heapptr_t)fun;
+}
+
+/**
+Name an anonymous function after the variable it gets assigned to
+*/
+void ast_name_fun(heapptr_t lhs_expr, heapptr_t val_expr)
+{
+    if (get_shape(val_expr) != SHAPE_AST_FUN)
+        return;
+
+    ast_fun_t* fun = (ast_fun_t*)val_expr;
+    if (fun->name != NULL)
+        return;
+
+    if (get_shape(lhs_expr) == SHAPE_AST_DECL)
+        fun->name = ((ast_decl_t*)lhs_expr)->name;
+    else if (get_shape(lhs_expr) == SHAPE_AST_REF)
+        fun->name = ((ast_ref_t*)lhs_expr)->name;
 }
 
 /**
@@ -770,11 +1054,8 @@ heapptr_t parse_obj_expr(input_t* input)
     // Until the end of the list
     for (;;)
     {
-        // Read whitespace
-        input_eat_ws(input);
-
         // If this is the end of the list
-        if (input_match_ch(input, '}'))
+        if (input_match_tok(input, TOK_RBRACE))
         {
             break;
         }
@@ -787,8 +1068,7 @@ heapptr_t parse_obj_expr(input_t* input)
             return ident;
         }
 
-        input_eat_ws(input);
-        if (!input_match_ch(input, ':'))
+        if (!input_match_tok(input, TOK_COLON))
         {
             return ast_error_alloc(input, "expected : separator");
         }
@@ -805,14 +1085,13 @@ heapptr_t parse_obj_expr(input_t* input)
         array_set_obj(val_exprs, val_exprs->len, expr);
 
         // If this is the end of the list
-        input_eat_ws(input);
-        if (input_match_ch(input, '}'))
+        if (input_match_tok(input, TOK_RBRACE))
         {
             break;
         }
 
         // If this is not the first element, there must be a separator
-        if (!input_match_ch(input, ','))
+        if (!input_match_tok(input, TOK_COMMA))
         {
             return ast_error_alloc(input, "expected comma separator in list");
         }
@@ -826,102 +1105,25 @@ Try to match an operator in the input
 */
 const opinfo_t* input_match_op(input_t* input, int minPrec, bool preUnary)
 {
-    input_t beforeOp = *input;
-
-    char ch = input_peek_ch(input);
-
-    const opinfo_t* op = NULL;
-
-    // Switch on the first character of the operator
-    // We do this to avoid a long cascade of match tests
-    switch (ch)
-    {
-        case '.':
-        if (input_match_ch(input, '.'))     op = &OP_MEMBER;
-        break;
-
-        case '[':
-        if (input_match_ch(input, '['))     op = &OP_INDEX;
-        break;
-
-        case '(':
-        if (input_match_ch(input, '('))     op = &OP_CALL;
-        break;
+    const opinfo_t* op = tok_ops[input_peek(input)];
 
-        case 'n':
-        if (input_match_str(input, "not"))  op = &OP_NOT;
-        break;
+    if (op == NULL)
+        return NULL;
 
-        case '*':
-        if (input_match_ch(input, '*'))     op = &OP_MUL;
-        break;
+    if (preUnary && op == &OP_SUB)
+        op = &OP_NEG;
 
-        case '/':
-        if (input_match_ch(input, '/'))     op = &OP_DIV;
-        break;
-
-        case 'm':
-        if (input_match_str(input, "mod"))  op = &OP_MOD;
-        break;
+    // If its precedence isn't high enough or it doesn't meet
+    // the arity and associativity requirements, the operator
+    // is not consumed
+    if ((op->prec < minPrec) ||
+        (preUnary && op->arity != 1) ||
+        (preUnary && op->assoc != 'r'))
+        return NULL;
 
-        case '+':
-        if (input_match_ch(input, '+'))     op = &OP_ADD;
-        break;
-
-        case '-':
-        if (input_match_ch(input, '-'))
-            op = preUnary? &OP_NEG:&OP_SUB;
-        break;
-
-        case '<':
-        if (input_match_str(input, "<="))   op = &OP_LE;
-        if (input_match_ch(input, '<'))     op = &OP_LT;
-        break;
-
-        case '>':
-        if (input_match_str(input, ">="))   op = &OP_GE;
-        if (input_match_ch(input, '>'))     op = &OP_GT;
-        break;
-
-        case 'i':
-        if (input_match_str(input, "instanceof")) op = &OP_INST_OF;
-        if (input_match_str(input, "in")) op = &OP_IN;
-        break;
+    input_next(input);
 
-        case '=':
-        if (input_match_str(input, "=="))   op = &OP_EQ;
-        if (input_match_ch(input, '='))     op = &OP_ASSIGN;
-        break;
-
-        case '!':
-        if (input_match_str(input, "!="))   op = &OP_NE;
-        break;
-
-        case 'a':
-        if (input_match_str(input, "and"))  op = &OP_AND;
-        break;
-
-        case 'o':
-        if (input_match_str(input, "or"))   op = &OP_OR;
-        break;
-    }
-
-    // If any operator was found
-    if (op)
-    {
-        // If its precedence isn't high enough or it doesn't meet
-        // the arity and associativity requirements
-        if ((op->prec < minPrec) ||
-            (preUnary && op->arity != 1) || 
-            (preUnary && op->assoc != 'r'))
-        {
-            // Backtrack to avoid consuming the operator
-            *input = beforeOp;
-            op = NULL;
-        }
-    }
-
-    // Return the matched operator, if any
+    // Return the matched operator
     return op;
 }
 
@@ -931,8 +1133,7 @@ Note: assumes that the "var" keyword has already been matched
 */
 heapptr_t parse_var_decl(input_t* input)
 {
-    input_eat_ws(input);
-
+    uint32_t ident_off = input_offset(input);
     heapptr_t ident = parse_ident(input);
 
     if (ast_error(ident))
@@ -940,7 +1141,7 @@ heapptr_t parse_var_decl(input_t* input)
         return ast_error_alloc(input, "expected identifier in variable expression");
     }
 
-    return ast_decl_alloc(ident, false);
+    return ast_at(ast_decl_alloc(ident, false), ident_off);
 }
 
 /**
@@ -949,8 +1150,7 @@ Note: assumes that the "let" keyword has already been matched
 */
 heapptr_t parse_cst_decl(input_t* input)
 {
-    input_eat_ws(input);
-
+    uint32_t ident_off = input_offset(input);
     heapptr_t ident = parse_ident(input);
 
     if (ast_error(ident))
@@ -958,10 +1158,8 @@ heapptr_t parse_cst_decl(input_t* input)
         return ast_error_alloc(input, "expected identifier in variable expression");
     }
 
-    input_eat_ws(input);
-
     // A value must be assigned to the constant declared
-    if (!input_match_str(input, "="))
+    if (!input_match_tok(input, TOK_ASSIGN))
     {
         return ast_error_alloc(input, "expected value assignment in let declaration");
     }
@@ -973,10 +1171,13 @@ heapptr_t parse_cst_decl(input_t* input)
         return val;
     }
 
+    heapptr_t decl = ast_at(ast_decl_alloc(ident, true), ident_off);
+    ast_name_fun(decl, val);
+
     // Create and return an assignment expression
     return ast_binop_alloc(
         &OP_ASSIGN,
-        ast_decl_alloc(ident, true),
+        decl,
         val
     );
 }
@@ -986,109 +1187,110 @@ Parse an atomic expression
 */
 heapptr_t parse_atom(input_t* input)
 {
-    //printf("parse_atom\n");
-
-    // Consume whitespace
-    input_eat_ws(input);
+    token_t* tok = input_peek_tok(input);
+    uint32_t off = tok->start;
 
-    // Numerical constant
-    if (isdigit(input_peek_ch(input)))
+    switch (tok->kind)
     {
+        // Numerical constant
+        case TOK_INT:
         return parse_number(input);
-    }
 
-    // String literal
-    if (input_match_ch(input, '\''))
-    {
-        return parse_string_lit(input, '\'');
-    }
-    if (input_match_ch(input, '"'))
-    {
-        return parse_string_lit(input, '"');
-    }
+        // String literal
+        case TOK_STRING:
+        return parse_string_lit(input);
 
-    // Array literal
-    if (input_match_ch(input, '['))
-    {
-        return parse_expr_list(input, ']');
-    }
+        // Array literal
+        case TOK_LBRACKET:
+        input_next(input);
+        return parse_expr_list(input, TOK_RBRACKET);
 
-    // Object literal
-    if (input_match_str(input, ":{"))
-    {
-        return parse_obj_expr(input);
-    }
-
-    // Parenthesized expression
-    if (input_match_ch(input, '('))
-    {
-        heapptr_t expr = parse_expr(input);
-        if (ast_error(expr))
+        // Object literal, the colon must be directly followed by the brace
+        case TOK_COLON:
+        if (tok[1].kind == TOK_LBRACE && tok[1].start == tok->start + 1)
         {
-            return ast_error_alloc(input, "expected expression after '('");
+            input_next(input);
+            input_next(input);
+            return ast_at(parse_obj_expr(input), off);
         }
+        break;
 
-        if (!input_match_ch(input, ')'))
+        // Parenthesized expression
+        case TOK_LPAREN:
         {
-            return ast_error_alloc(input, "expected closing parenthesis");
-        }
-
-        return expr;
-    }
+            input_next(input);
 
-    // Sequence/block expression (i.e { a; b; c }
-    if (input_match_ch(input, '{'))
-    {
-        return parse_seq_expr(input, '}');
-    }
+            heapptr_t expr = parse_expr(input);
+            if (ast_error(expr))
+            {
+                return ast_error_alloc(input, "expected expression after '('");
+            }
 
-    // Try matching a right-associative (prefix) unary operators
-    const opinfo_t* op = input_match_op(input, 0, true);
+            if (!input_match_tok(input, TOK_RPAREN))
+            {
+                return ast_error_alloc(input, "expected closing parenthesis");
+            }
 
-    // If a matching operator was found
-    if (op)
-    {
-        heapptr_t expr = parse_atom(input);
-        if (ast_error(expr))
-        {
             return expr;
         }
 
-        return (heapptr_t)ast_unop_alloc(op, expr);
-    }
+        // Sequence/block expression (i.e { a; b; c }
+        case TOK_LBRACE:
+        input_next(input);
+        return ast_at(parse_seq_expr(input, TOK_RBRACE), off);
 
-    // Identifier
-    if (isalnum(input_peek_ch(input)))
-    {
         // Variable declaration
-        if (input_match_str(input, "var"))
-            return parse_var_decl(input);
+        case TOK_VAR:
+        input_next(input);
+        return parse_var_decl(input);
 
         // Constant declaration
-        if (input_match_str(input, "let"))
-            return parse_cst_decl(input);
+        case TOK_LET:
+        input_next(input);
+        return ast_at(parse_cst_decl(input), off);
 
         // If expression
-        if (input_match_str(input, "if"))
-            return parse_if_expr(input);
+        case TOK_IF:
+        input_next(input);
+        return ast_at(parse_if_expr(input), off);
 
         // Function expression
-        if (input_match_str(input, "fun"))
-            return parse_fun_expr(input);
+        case TOK_FUN:
+        input_next(input);
+        return ast_at(parse_fun_expr(input), off);
 
         // true and false boolean constants
-        if (input_match_str(input, "true"))
-            return (heapptr_t)ast_const_alloc(VAL_TRUE);
-        if (input_match_str(input, "false"))
-            return (heapptr_t)ast_const_alloc(VAL_FALSE);
+        case TOK_TRUE:
+        input_next(input);
+        return ast_at(ast_const_alloc(VAL_TRUE), off);
+        case TOK_FALSE:
+        input_next(input);
+        return ast_at(ast_const_alloc(VAL_FALSE), off);
+
+        // Identifier
+        case TOK_IDENT:
+        return ast_at(ast_ref_alloc(parse_ident(input)), off);
+
+        // Unterminated string literal or comment
+        case TOK_ERROR:
+        if (input->data[tok->start] == '/')
+            return ast_error_alloc(input, "end of input inside comment");
+        return ast_error_alloc(input, "end of input inside string literal");
     }
 
-    // Identifiers beginning with non-alphanumeric characters
-    if (input_peek_ch(input) == '_' ||
-        input_peek_ch(input) == '$' ||
-        isalpha(input_peek_ch(input)))
+    // Try matching a right-associative (prefix) unary operators
+    const opinfo_t* op = input_match_op(input, 0, true);
+
+    // If a matching operator was found
+    if (op)
     {
-        return ast_ref_alloc(parse_ident(input));
+        heapptr_t expr = parse_atom(input);
+        if (ast_error(expr))
+        {
+            return expr;
+        }
+
+        return ast_at(ast_unop_alloc(op, expr), off);
     }
 
     // Parsing failed
@@ -1123,13 +1325,11 @@ heapptr_t parse_expr_prec(input_t* input, int minPrec)
 
     for (;;)
     {
-        // Consume whitespace
-        input_eat_ws(input);
-
         //printf("looking for op, minPrec=%d\n", minPrec);
 
         // Attempt to match an operator in the input
         // with sufficient precedence
+        uint32_t op_off = input_offset(input);
         const opinfo_t* op = input_match_op(input, minPrec, false);
 
         // If no operator matches, break out
@@ -1157,12 +1357,12 @@ heapptr_t parse_expr_prec(input_t* input, int minPrec)
         if (op == &OP_CALL)
         {
             // Parse the argument list and create the call expression
-            heapptr_t arg_exprs = parse_expr_list(input, ')');
+            heapptr_t arg_exprs = parse_expr_list(input, TOK_RPAREN);
 
             if (ast_error(arg_exprs))
                 return arg_exprs;
 
-            lhs_expr = ast_call_alloc(lhs_expr, (array_t*)arg_exprs);
+            lhs_expr = ast_at(ast_call_alloc(lhs_expr, (array_t*)arg_exprs), op_off);
         }
 
         // If this is a member expression
@@ -1180,8 +1380,9 @@ heapptr_t parse_expr_prec(input_t* input, int minPrec)
             lhs_expr = ast_binop_alloc(
                 op,
                 lhs_expr,
-                ident/*, lhs_expr.pos*/
+                ident
             );
+            ast_at(lhs_expr, op_off);
         }
 
         // If this is a binary operator
@@ -1194,15 +1395,20 @@ heapptr_t parse_expr_prec(input_t* input, int minPrec)
             if (ast_error(rhs_expr))
                 return rhs_expr;
 
+            if (op == &OP_ASSIGN)
+                ast_name_fun(lhs_expr, rhs_expr);
+
             // Create a new parent node for the expressions
             lhs_expr = ast_binop_alloc(
                 op,
                 lhs_expr,
-                rhs_expr/*, lhs_expr.pos*/
+                rhs_expr
             );
+            ast_at(lhs_expr, op_off);
 
-            // If specified, match the operator closing string
-            if (op->close_str && !input_match_str(input, op->close_str))
+            // If specified, match the operator closing string, which
+            // only the indexing operator has
+            if (op->close_str && !input_match_tok(input, TOK_RBRACKET))
                 return ast_error_alloc(input, "expected operator closing");
         }
 
@@ -1245,7 +1451,7 @@ Parse a source unit from an input object
 heapptr_t parse_unit(input_t* input)
 {
     // Create a sequence expression from the expression list
-    heapptr_t seq_expr = parse_seq_expr(input, '\0');
+    heapptr_t seq_expr = parse_seq_expr(input, TOK_EOF);
 
     if (ast_error(seq_expr))
     {
@@ -1255,7 +1461,11 @@ heapptr_t parse_unit(input_t* input)
     // Create an empty array for the parameter list
     array_t* param_list = array_alloc(0);
 
-    return ast_fun_alloc(param_list, seq_expr);
+    ast_fun_t* unit_fun = (ast_fun_t*)ast_fun_alloc(param_list, seq_expr);
+    unit_fun->name = vm_get_cstr("unit");
+    unit_fun->src = input->src;
+
+    return (heapptr_t)unit_fun;
 }
 
 /**
@@ -1263,12 +1473,20 @@ Parse a source string as a unit
 */
 heapptr_t parse_string(const char* cstr, const char* src_name)
 {
-    input_t input = input_from_string(
-        vm_get_cstr(cstr),
-        vm_get_cstr("parser_test")
-    );
+    // The source keeps a copy of the string, so that source positions
+    // can be computed after the caller frees it
+    size_t len = strlen(cstr);
+    char* text = malloc(len + 1);
+    memcpy(text, cstr, len + 1);
+
+    srcfile_t* src = srcfile_alloc(vm_get_cstr(src_name), text, len);
+    input_t input = input_from_src(src);
 
-    return parse_unit(&input);
+    heapptr_t unit_fun = parse_unit(&input);
+
+    input_free(&input);
+
+    return unit_fun;
 }
 
 /**
@@ -1276,11 +1494,20 @@ Parse a source file
 */
 heapptr_t parse_file(const char* file_name)
 {
-    char* src_text = read_file(file_name);
+    // The source is parsed directly from the mapped file, which
+    // stays mapped for source positions to be computed later
+    file_view_t view;
+
+    if (!file_view_open(&view, file_name))
+        exit(-1);
+
+    srcfile_t* src = srcfile_alloc(vm_get_cstr(file_name), view.data, view.len);
+    src->view = view;
+    input_t input = input_from_src(src);
+
+    heapptr_t unit_fun = parse_unit(&input);
 
-    heapptr_t unit_fun = parse_string(src_text, file_name);
-    
-    free(src_text);
+    input_free(&input);
 
     return unit_fun;
 }
@@ -1294,12 +1521,11 @@ ast_fun_t* parse_check_error(heapptr_t node)
     {
         ast_error_t* error = (ast_error_t*)node;
 
-        //printf("parsing failed \"%s\"\n", string_cstr(error->src_name));
 
         char buf[64];
         printf(
             "parsing failed %s - %s\n",
-            srcpos_to_str(error->src_pos, buf),
+            srcpos_to_str(srcfile_pos(error->src, error->src_off), buf),
             string_cstr(error->error_str)
         );
 
@@ -1500,6 +1726,50 @@ void test_parser()
     // Regressions
     test_parse_fail("'a' <'");
 
+    // Unterminated comments and literals
+    test_parse_fail("1 /* comment");
+    test_parse_fail("'abc");
+    test_parse_fail("'abc\\'");
+
+    // Keywords are only matched as whole words
+    test_parse("iffy + notify + order + index + android");
+    test_parse("a.if + b.not");
+
+    // Tokens and their kinds
+    uint32_t num_toks;
+    const char* src = "let x=0x1F // c\n  <= 'a\\'b' /**/:{";
+    token_t* toks = tokenize(src, strlen(src), &num_toks);
+    uint8_t kinds[] = {
+        TOK_LET, TOK_IDENT, TOK_ASSIGN, TOK_INT, TOK_LE, TOK_STRING,
+        TOK_COLON, TOK_LBRACE, TOK_EOF
+    };
+    assert (num_toks == sizeof(kinds));
+    for (size_t i = 0; i < num_toks; ++i)
+        assert (toks[i].kind == kinds[i]);
+    assert (toks[3].start == 6 && toks[3].len == 4);
+    assert (toks[5].len == 6);
+    free(toks);
+
+    // Error positions
+    ast_error_t* error = (ast_error_t*)parse_string("a\n  b #", "parser_test");
+    assert (ast_error((heapptr_t)error));
+    srcpos_t pos = srcfile_pos(error->src, error->src_off);
+    assert (pos.lineNo == 1 && pos.colNo == 4);
+
+    // Nodes record the offset of their first token, or of their operator
+    ast_fun_t* unit = parse_check_error(parse_string("x\nlet f = fun (a)\n  a.b + 1", "parser_test"));
+    array_t* stmts = ((ast_seq_t*)unit->body_expr)->expr_list;
+    ast_binop_t* assg = (ast_binop_t*)array_get_ptr(stmts, 1);
+    ast_fun_t* fun = (ast_fun_t*)assg->right_expr;
+    ast_binop_t* add = (ast_binop_t*)fun->body_expr;
+    assert (((ast_ref_t*)array_get_ptr(stmts, 0))->src_off == 0);
+    assert (assg->src_off == 2 && ((ast_decl_t*)assg->left_expr)->src_off == 6);
+    assert (fun->src_off == 10);
+    assert (add->src_off == 24 && ((ast_binop_t*)add->left_expr)->src_off == 21);
+    assert (srcfile_pos(fun->src, add->src_off).lineNo == 2);
+    assert (srcfile_pos(fun->src, add->src_off).colNo == 6);
+    assert (srcfile_pos(fun->src, fun->src->len).lineNo == 2);
+
     parse_check_error(parse_file("global.zeta"));
     parse_check_error(parse_file("parser.zeta"));
 
@@ -1507,3 +1777,60 @@ void test_parser()
     parse_check_error(parse_file("tests/list-sum.zeta"));
 }
 
+/**
+Measure the throughput of the tokenizer and parser on generated source
+Run with the --bench flag.
+*/
+void bench_parser()
+{
+    printf("parser benchmarks\n");
+
+    // Generate about 8MB of source code
+    size_t cap = 8 << 20;
+    char* src = malloc(cap + 256);
+    size_t len = 0;
+    for (int i = 0; len < cap; ++i)
+    {
+        len += sprintf(
+            src + len,
+            "let fun_%d = fun (alpha, beta)\n"
+            "{\n"
+            "    // Combine the arguments\n"
+            "    if alpha <= beta then alpha + beta * %d else $println('%d')\n"
+            "}\n",
+            i, i, i
+        );
+    }
+
+    uint64_t start = time_ns();
+    uint32_t num_toks;
+    token_t* toks = tokenize(src, len, &num_toks);
+    uint64_t tok_time = time_ns() - start;
+    free(toks);
+
+    printf(
+        "tokenize %zu bytes: %.1f MB/s, %.2f ns/token\n",
+        len,
+        (len / 1e6) / (tok_time / 1e9),
+        (double)tok_time / num_toks
+    );
+
+    // The AST is allocated on the hosted heap, parse a smaller prefix
+    // ending after a complete function
+    size_t parse_len = 64 << 10;
+    while (src[parse_len - 2] != '}' || src[parse_len - 1] != '\n')
+        parse_len--;
+    src[parse_len] = '\0';
+
+    start = time_ns();
+    parse_check_error(parse_string(src, "bench"));
+    uint64_t parse_time = time_ns() - start;
+
+    printf(
+        "parse %zu bytes: %.1f MB/s\n",
+        parse_len,
+        (parse_len / 1e6) / (parse_time / 1e9)
+    );
+
+    free(src);
+}
@@ -12,6 +12,7 @@ language.
 #define __PARSER_H__
 
 #include <stdbool.h>
+#include "util.h"
 #include "vm.h"
 
 /**
@@ -26,24 +27,130 @@ typedef struct
 } srcpos_t;
 
 /**
-Input stream, character/token stream for parsing functions
+Source text of a parsed unit
+AST nodes only record byte offsets into the text, which are converted
+to line and column numbers when needed (see srcfile_pos).
 */
 typedef struct
 {
-    /// Internal source string (hosted heap)
-    string_t* str;
+    /// Source name string
+    string_t* name;
 
-    /// Current index
-    uint32_t idx;
+    /// Source text, followed by a zero byte, kept as long as the AST
+    const char* data;
+    uint32_t len;
+
+    /// Mapping of the file holding the text, if parsed from a file
+    file_view_t view;
+
+    /// Byte offsets of the line starts, built on first use
+    uint32_t* line_starts;
+    uint32_t num_lines;
+
+} srcfile_t;
+
+/// Token kinds
+#define TOK_EOF         0
+#define TOK_ERROR       1   // Unterminated string literal or comment
+#define TOK_OTHER       2   // Character which doesn't start any token
+#define TOK_IDENT       3
+#define TOK_INT         4
+#define TOK_STRING      5
+
+/// Keyword token kinds
+#define TOK_VAR         6
+#define TOK_LET         7
+#define TOK_IF          8
+#define TOK_THEN        9
+#define TOK_ELSE        10
+#define TOK_FUN         11
+#define TOK_TRUE        12
+#define TOK_FALSE       13
+#define TOK_NOT         14
+#define TOK_MOD         15
+#define TOK_AND         16
+#define TOK_OR          17
+#define TOK_IN          18
+#define TOK_INSTANCEOF  19
+
+/// Punctuation and operator token kinds
+#define TOK_DOT         20
+#define TOK_COMMA       21
+#define TOK_SEMI        22
+#define TOK_COLON       23
+#define TOK_LPAREN      24
+#define TOK_RPAREN      25
+#define TOK_LBRACKET    26
+#define TOK_RBRACKET    27
+#define TOK_LBRACE      28
+#define TOK_RBRACE      29
+#define TOK_PLUS        30
+#define TOK_MINUS       31
+#define TOK_STAR        32
+#define TOK_SLASH       33
+#define TOK_LT          34
+#define TOK_LE          35
+#define TOK_GT          36
+#define TOK_GE          37
+#define TOK_EQ          38
+#define TOK_NE          39
+#define TOK_ASSIGN      40
+
+#define TOK_NUM_KINDS   41
+
+/// Test if a token kind is a keyword
+#define TOK_IS_KEYWORD(kind) ((kind) >= TOK_VAR && (kind) <= TOK_INSTANCEOF)
 
-    /// Source name string
-    string_t* src_name;
+/**
+Token, a span of the source text
+*/
+typedef struct
+{
+    /// Byte offset of the first character
+    uint32_t start;
+
+    /// Length in bytes
+    uint32_t len;
 
-    /// Current source position
-    srcpos_t pos;
+    /// Token kind (TOK_*)
+    uint8_t kind;
+
+} token_t;
+
+/**
+Input stream, token stream for parsing functions
+The source text is split into tokens before parsing starts.
+*/
+typedef struct
+{
+    /// Source being parsed
+    srcfile_t* src;
+
+    /// Source text and length, as in the source
+    const char* data;
+    uint32_t len;
+
+    /// Tokens, ending with a TOK_EOF token
+    token_t* toks;
+    uint32_t num_toks;
+
+    /// Index of the current token
+    uint32_t tok_idx;
 
 } input_t;
 
+/**
+Fields common to all AST nodes
+*/
+typedef struct
+{
+    shapeidx_t shape;
+
+    /// Byte offset of the node in the source text
+    uint32_t src_off;
+
+} ast_node_t;
+
 /**
 Parse error
 */
@@ -51,11 +158,13 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     // Error description
     string_t* error_str;
 
-    /// Source position
-    srcpos_t src_pos;
+    /// Source the error was found in
+    srcfile_t* src;
 
 } ast_error_t;
 
@@ -67,6 +176,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     value_t val;
 
 } ast_const_t;
@@ -78,7 +189,9 @@ typedef struct
 {
     shapeidx_t shape;
 
-    /// Stack or mutable cell index
+    uint32_t src_off;
+
+    /// Stack, closure or global slot index
     uint32_t idx;
 
     /// Identifier name string
@@ -96,15 +209,35 @@ typedef struct ast_decl
 {
     shapeidx_t shape;
 
-    /// Local (stack) index
+    uint32_t src_off;
+
+    /// Local (stack) index, also the global slot index of globals
     uint32_t idx;
 
     /// Constant flag
     bool cst;
 
-    /// Escaping variable (captured by a nested function)
+    /// Escaping variable, captured by a nested function and held in a
+    /// mutable cell. Captured variables which can not change after they
+    /// are captured are copied into closures instead (see var_res_pass).
     bool esc;
 
+    /// Number of assignments to the variable, including the assignment
+    /// of parameters by calls
+    uint32_t num_assigns;
+
+    /// Set once the assignment to the variable has been seen, and if a
+    /// closure captures the variable before that, in evaluation order
+    bool assigned;
+    bool capt_early;
+
+    /// Variable of the global unit, held in the global slot table
+    bool global;
+
+    /// Functions whose compiled code reads this global as a constant,
+    /// NULL if there are none
+    array_t* cst_deps;
+
     /// Identifier name string
     string_t* name;
 
@@ -145,6 +278,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     const opinfo_t* op;
 
     heapptr_t expr;
@@ -158,6 +293,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     const opinfo_t* op;
 
     heapptr_t left_expr;
@@ -172,6 +309,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     // List of expressions
     array_t* expr_list;
 
@@ -184,6 +323,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     heapptr_t test_expr;
 
     heapptr_t then_expr;
@@ -198,6 +339,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     /// Function to be called
     heapptr_t fun_expr;
 
@@ -206,6 +349,10 @@ typedef struct
 
 } ast_call_t;
 
+/// Capture map flag, the cell of a free variable comes from a local
+/// variable slot of the parent function (see ast_fun_t)
+#define CAPT_LOCAL (1u << 31)
+
 /**
 Function expression node
 */
@@ -213,6 +360,8 @@ typedef struct ast_fun
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     /// Parent (outer) function
     struct ast_fun* parent;
 
@@ -232,9 +381,48 @@ typedef struct ast_fun
     /// Note: the value of these are stored in closure objects
     array_t* free_vars;
 
+    /// Where the cell of each free variable comes from when a closure of
+    /// this function is created, computed by var_res_pass. Entries are
+    /// CAPT_LOCAL | slot index of a local of the parent function, or the
+    /// index of a cell in the closure of the parent function.
+    uint32_t* capt_map;
+
+    /// Closure shared by all evaluations of this function expression,
+    /// for functions without free variables (see clos_shared)
+    clos_t* shared_clos;
+
     /// Function body expression
     heapptr_t body_expr;
 
+    /// Function name, NULL for anonymous functions
+    /// Functions are named after the variable they are assigned to
+    string_t* name;
+
+    /// Source of the function expression
+    srcfile_t* src;
+
+    /// Number of calls made through the interpreter
+    uint32_t num_calls;
+
+    /// Entry point of the compiled code, NULL if not compiled
+    void* jit_entry;
+
+    /// Number of times compiled code for this function deoptimized
+    uint32_t num_deopts;
+
+    /// Number of times compiled code for this function was evicted to
+    /// make room in the code cache, or could not be added to it
+    /// (see jit_call_threshold)
+    uint32_t num_evictions;
+
+    /// On-stack replacement entry points, one per statement of the body
+    /// Allocated when the first one gets compiled, NULL otherwise
+    void** osr_entries;
+
+    /// An on-stack replacement entry could not be added to the code
+    /// cache, no other is compiled until the function gets compiled
+    bool osr_failed;
+
 } ast_fun_t;
 
 /**
@@ -244,6 +432,8 @@ typedef struct
 {
     shapeidx_t shape;
 
+    uint32_t src_off;
+
     /// Prototype object expression (may be null)
     heapptr_t proto_expr;
 
@@ -294,9 +484,13 @@ const opinfo_t OP_OR;
 const opinfo_t OP_ASSIGN;
 
 char* srcpos_to_str(srcpos_t pos, char* buf);
+srcpos_t srcfile_pos(srcfile_t* src, uint32_t offset);
 
 void init_parser();
 
+void init_tokenizer();
+token_t* tokenize(const char* data, uint32_t len, uint32_t* num_toks);
+
 bool ast_error(heapptr_t node);
 
 heapptr_t ast_const_alloc(value_t val);
@@ -313,6 +507,7 @@ heapptr_t parse_file(const char* file_name);
 ast_fun_t* parse_check_error(heapptr_t node);
 
 void test_parser();
+void bench_parser();
 
 #endif
 
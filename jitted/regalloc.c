@@ -0,0 +1,420 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "regalloc.h"
+#include "ir.h"
+#include "parser.h"
+#include "interp.h"
+
+/**
+Live interval of an SSA value
+*/
+typedef struct
+{
+    /// Instruction defining the value
+    ir_instr_t* instr;
+
+    /// First and last positions where the value is live
+    uint32_t start;
+    uint32_t end;
+
+    /// Live across a call into C code
+    bool crosses_call;
+
+} interval_t;
+
+/**
+Test if an instruction needs a location for its output
+*/
+bool ra_needs_loc(ir_instr_t* instr)
+{
+    return ir_has_value(instr) && instr->op != &IR_CONST;
+}
+
+/**
+Number the instructions and compute the live intervals
+Returns the number of intervals produced
+*/
+uint32_t ra_intervals(ir_fun_t* fun, interval_t* intervals, interval_t** by_id)
+{
+    uint32_t pos = 0;
+    uint32_t num_calls = 0;
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            instr->pos = pos;
+            instr->reg = -1;
+            instr->slot = -1;
+            pos += 2;
+
+            if (instr->op->flags & IRF_CALL)
+                num_calls++;
+        }
+    }
+
+    // Positions of the calls, in increasing order
+    uint32_t* calls = malloc(sizeof(uint32_t) * (num_calls + 1));
+    num_calls = 0;
+
+    uint32_t num_intervals = 0;
+
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            if (instr->op->flags & IRF_CALL)
+                calls[num_calls++] = instr->pos;
+
+            by_id[instr->id] = NULL;
+
+            if (!ra_needs_loc(instr))
+                continue;
+
+            interval_t* interval = &intervals[num_intervals++];
+            interval->instr = instr;
+            interval->start = instr->pos;
+            interval->end = instr->pos;
+            interval->crosses_call = false;
+            by_id[instr->id] = interval;
+
+            // Phis are written at the end of their predecessors
+            if (instr->op == &IR_PHI)
+            {
+                for (uint32_t i = 0; i < block->num_preds; ++i)
+                {
+                    uint32_t pred_end = block->preds[i]->last->pos;
+                    if (pred_end < interval->start)
+                        interval->start = pred_end;
+                }
+            }
+
+            // Call tags are written along with the call output
+            if (instr->op == &IR_PROJ_TAG)
+                interval->start = instr->args[0]->pos;
+        }
+    }
+
+    // Extend the intervals up to the last use of each value
+    for (ir_block_t* block = fun->entry; block; block = block->next)
+    {
+        for (ir_instr_t* instr = block->first; instr; instr = instr->next)
+        {
+            for (uint32_t i = 0; i < instr->num_args; ++i)
+            {
+                interval_t* interval = by_id[instr->args[i]->id];
+                if (interval == NULL)
+                    continue;
+
+                uint32_t use_pos = instr->pos;
+                if (instr->op == &IR_PHI)
+                    use_pos = block->preds[i]->last->pos;
+
+                if (use_pos > interval->end)
+                    interval->end = use_pos;
+            }
+        }
+    }
+
+    // Find the intervals containing a call strictly inside them
+    for (uint32_t i = 0; i < num_intervals; ++i)
+    {
+        interval_t* interval = &intervals[i];
+
+        for (uint32_t j = 0; j < num_calls; ++j)
+        {
+            if (calls[j] > interval->start && calls[j] < interval->end)
+            {
+                interval->crosses_call = true;
+                break;
+            }
+        }
+    }
+
+    free(calls);
+
+    return num_intervals;
+}
+
+int ra_cmp_start(const void* a, const void* b)
+{
+    const interval_t* ia = a;
+    const interval_t* ib = b;
+
+    if (ia->start != ib->start)
+        return (ia->start < ib->start)? -1:1;
+
+    // Keep the sort stable with respect to the instruction order
+    return (ia->instr->pos < ib->instr->pos)? -1:1;
+}
+
+/**
+Pick the lowest-numbered register in a set
+*/
+int8_t ra_pick(uint32_t regs)
+{
+    assert (regs != 0);
+    return __builtin_ctz(regs);
+}
+
+/**
+Allocate registers and spill slots for the values of a function
+*/
+void regalloc(ir_fun_t* fun, regalloc_t* ra)
+{
+    interval_t* intervals = malloc(sizeof(interval_t) * (fun->num_instrs + 1));
+    interval_t** by_id = calloc(fun->num_instrs + 1, sizeof(interval_t*));
+
+    uint32_t num_intervals = ra_intervals(fun, intervals, by_id);
+    qsort(intervals, num_intervals, sizeof(interval_t), ra_cmp_start);
+
+    ra->num_slots = 0;
+    ra->used_callee_saved = 0;
+
+    // Active intervals currently holding a register
+    interval_t** active = malloc(sizeof(interval_t*) * (num_intervals + 1));
+    uint32_t num_active = 0;
+
+    uint32_t free_regs = REGS_CALLEE_SAVED | REGS_CALLER_SAVED;
+
+    for (uint32_t i = 0; i < num_intervals; ++i)
+    {
+        interval_t* cur = &intervals[i];
+
+        // Expire the intervals ending before this one starts
+        // Operands are read before outputs are written, so an interval
+        // ending at the start of this one can share its register
+        for (uint32_t j = 0; j < num_active;)
+        {
+            if (active[j]->end <= cur->start)
+            {
+                free_regs |= 1 << active[j]->instr->reg;
+                active[j] = active[--num_active];
+                continue;
+            }
+
+            j++;
+        }
+
+        uint32_t allowed = REGS_CALLEE_SAVED;
+        if (!cur->crosses_call)
+            allowed |= REGS_CALLER_SAVED;
+
+        if (free_regs & allowed)
+        {
+            // Values not live across calls prefer caller-saved registers,
+            // keeping the callee-saved ones for values which need them
+            uint32_t avail = free_regs & allowed;
+            if (avail & REGS_CALLER_SAVED)
+                avail &= REGS_CALLER_SAVED;
+
+            cur->instr->reg = ra_pick(avail);
+            free_regs &= ~(1 << cur->instr->reg);
+            active[num_active++] = cur;
+            continue;
+        }
+
+        // Find the active interval ending furthest away
+        // whose register could hold the current interval
+        interval_t* victim = NULL;
+        uint32_t victim_idx = 0;
+        for (uint32_t j = 0; j < num_active; ++j)
+        {
+            if (!(allowed & (1 << active[j]->instr->reg)))
+                continue;
+
+            if (victim == NULL || active[j]->end > victim->end)
+            {
+                victim = active[j];
+                victim_idx = j;
+            }
+        }
+
+        if (victim && victim->end > cur->end)
+        {
+            cur->instr->reg = victim->instr->reg;
+            victim->instr->reg = -1;
+            victim->instr->slot = ra->num_slots++;
+            active[victim_idx] = cur;
+        }
+        else
+        {
+            cur->instr->slot = ra->num_slots++;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_intervals; ++i)
+    {
+        int8_t reg = intervals[i].instr->reg;
+        if (reg >= 0 && ((1 << reg) & REGS_CALLEE_SAVED))
+            ra->used_callee_saved |= 1 << reg;
+    }
+
+    free(active);
+    free(by_id);
+    free(intervals);
+}
+
+/**
+Check that no two overlapping intervals share a location, and that
+values live across calls are not in caller-saved registers
+*/
+bool ra_check(ir_fun_t* fun)
+{
+    interval_t* intervals = malloc(sizeof(interval_t) * (fun->num_instrs + 1));
+    interval_t** by_id = calloc(fun->num_instrs + 1, sizeof(interval_t*));
+
+    // Recomputing the intervals resets the locations, save them
+    int8_t* regs = malloc(fun->num_instrs + 1);
+    int32_t* slots = malloc(sizeof(int32_t) * (fun->num_instrs + 1));
+    for (ir_instr_t* instr = fun->all_instrs; instr; instr = instr->all_next)
+    {
+        regs[instr->id] = instr->reg;
+        slots[instr->id] = instr->slot;
+    }
+
+    uint32_t num_intervals = ra_intervals(fun, intervals, by_id);
+
+    for (ir_instr_t* instr = fun->all_instrs; instr; instr = instr->all_next)
+    {
+        instr->reg = regs[instr->id];
+        instr->slot = slots[instr->id];
+    }
+
+    bool ok = true;
+
+    for (uint32_t i = 0; i < num_intervals; ++i)
+    {
+        interval_t* a = &intervals[i];
+
+        if ((a->instr->reg < 0) == (a->instr->slot < 0))
+        {
+            printf("v%d has no unique location\n", a->instr->id);
+            ok = false;
+        }
+
+        if (a->crosses_call && a->instr->reg >= 0 &&
+            !((1 << a->instr->reg) & REGS_CALLEE_SAVED))
+        {
+            printf("v%d is live across a call in a caller-saved register\n", a->instr->id);
+            ok = false;
+        }
+
+        for (uint32_t j = i + 1; j < num_intervals; ++j)
+        {
+            interval_t* b = &intervals[j];
+
+            // Intervals touching at one position may share a location
+            if (a->end <= b->start || b->end <= a->start)
+                continue;
+
+            if ((a->instr->reg >= 0 && a->instr->reg == b->instr->reg) ||
+                (a->instr->slot >= 0 && a->instr->slot == b->instr->slot))
+            {
+                printf("v%d and v%d share a location\n", a->instr->id, b->instr->id);
+                ok = false;
+            }
+        }
+    }
+
+    free(slots);
+    free(regs);
+    free(by_id);
+    free(intervals);
+
+    return ok;
+}
+
+/**
+Build, optimize and allocate the first function nested in a unit
+*/
+ir_fun_t* test_regalloc_fun(char* cstr, regalloc_t* ra)
+{
+    printf("%s\n", cstr);
+
+    ast_fun_t* unit_fun = parse_check_error(parse_string(cstr, "regalloc_test"));
+    var_res_pass(unit_fun, vm.global_clos? vm.global_clos->fun:NULL);
+
+    ast_fun_t* nested = test_ir_find_fun(unit_fun);
+    assert (nested != NULL);
+
+    ir_fun_t* fun = ir_build(nested);
+    ir_optimize(fun);
+    regalloc(fun, ra);
+
+    if (!ra_check(fun))
+    {
+        ir_dump(fun, stdout);
+        printf("invalid register allocation\n");
+        exit(-1);
+    }
+
+    return fun;
+}
+
+void test_regalloc()
+{
+    printf("core register allocator tests\n");
+
+    regalloc_t ra;
+    ir_fun_t* fun;
+
+    fun = test_regalloc_fun("fun (a, b) a + b;", &ra);
+    assert (ra.num_slots == 0);
+    assert (ra.used_callee_saved == 0);
+    ir_free(fun);
+
+    // The parameter is live across the recursive calls
+    fun = test_regalloc_fun(
+        "let fib = fun (n) if n < 2 then n else fib(n-1) + fib(n-2);",
+        &ra
+    );
+    assert (ra.num_slots == 0);
+    for (ir_instr_t* instr = fun->entry->first; instr; instr = instr->next)
+        if (instr->op == &IR_ARG)
+            assert ((1 << instr->reg) & REGS_CALLEE_SAVED);
+    ir_free(fun);
+
+    fun = test_regalloc_fun(
+        "fun (a) if a then a + 1 else a - 1;",
+        &ra
+    );
+    assert (ra.num_slots == 0);
+    ir_free(fun);
+
+    // More values live across a call than callee-saved registers
+    fun = test_regalloc_fun(
+        "fun (a, f) {"
+        "  let x1 = a + 1; let x2 = a + 2; let x3 = a + 3;"
+        "  let x4 = a + 4; let x5 = a + 5; let x6 = a + 6;"
+        "  let x7 = a + 7; f();"
+        "  x1 + x2 + x3 + x4 + x5 + x6 + x7"
+        "};",
+        &ra
+    );
+    assert (ra.num_slots > 0);
+    ir_free(fun);
+
+    // Many values live at once, without calls
+    fun = test_regalloc_fun(
+        "fun (a) {"
+        "  let x1 = a * 1; let x2 = a * 2; let x3 = a * 3;"
+        "  let x4 = a * 4; let x5 = a * 5; let x6 = a * 6;"
+        "  let x7 = a * 7; let x8 = a * 8; let x9 = a * 9;"
+        "  let x10 = a * 10; let x11 = a * 11; let x12 = a * 12;"
+        "  let x13 = a * 13;"
+        "  x1 + x2 + x3 + x4 + x5 + x6 + x7 + x8 + x9 + x10 + x11 + x12 + x13"
+        "};",
+        &ra
+    );
+    assert (ra.num_slots > 0);
+    ir_free(fun);
+
+    fun = test_regalloc_fun(
+        "fun (o, a) { o.x = a; let c = fun () a; if c() == a then o.x else [a, c] };",
+        &ra
+    );
+    ir_free(fun);
+}
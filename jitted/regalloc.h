@@ -0,0 +1,79 @@
+/**
+Linear scan register allocator for the x86-64 backend
+
+Blocks are linearized in their topological order and each instruction is
+given a position. Because the control flow graph is acyclic, the live range
+of an SSA value is a single interval going from its definition to its last
+use. Phi inputs are used at the end of the corresponding predecessor, and
+phis are live from the end of their first predecessor onwards.
+
+Intervals are scanned in order of increasing start position. Values live
+across a call into C code may only be placed in callee-saved registers,
+other values prefer caller-saved registers. When no register is available,
+the interval ending furthest away is spilled to a stack slot for its whole
+lifetime. Constants are not allocated, the code generator materializes
+them where they are used.
+*/
+
+#ifndef __REGALLOC_H__
+#define __REGALLOC_H__
+
+#include "ir.h"
+
+/// x86-64 general-purpose registers, in encoding order
+#define REG_RAX 0
+#define REG_RCX 1
+#define REG_RDX 2
+#define REG_RBX 3
+#define REG_RSP 4
+#define REG_RBP 5
+#define REG_RSI 6
+#define REG_RDI 7
+#define REG_R8  8
+#define REG_R9  9
+#define REG_R10 10
+#define REG_R11 11
+#define REG_R12 12
+#define REG_R13 13
+#define REG_R14 14
+#define REG_R15 15
+
+/// Allocatable registers preserved across calls
+#define REGS_CALLEE_SAVED (     \
+    (1 << REG_RBX) |            \
+    (1 << REG_R12) |            \
+    (1 << REG_R13) |            \
+    (1 << REG_R14) |            \
+    (1 << REG_R15)              \
+)
+
+/// Allocatable registers clobbered by calls
+/// Note: rax, rdx and r11 are reserved as scratch registers
+#define REGS_CALLER_SAVED (     \
+    (1 << REG_RCX) |            \
+    (1 << REG_RSI) |            \
+    (1 << REG_RDI) |            \
+    (1 << REG_R8) |             \
+    (1 << REG_R9) |             \
+    (1 << REG_R10)              \
+)
+
+/**
+Result of register allocation for a function
+The locations of the values are stored on the instructions
+*/
+typedef struct
+{
+    /// Number of stack slots used for spilled values
+    uint32_t num_slots;
+
+    /// Set of callee-saved registers allocated, to be preserved
+    uint32_t used_callee_saved;
+
+} regalloc_t;
+
+void regalloc(ir_fun_t* fun, regalloc_t* ra);
+
+void test_regalloc();
+
+#endif
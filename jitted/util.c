@@ -1,135 +1,817 @@
+#define _DEFAULT_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "util.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+/// Multiply two 64-bit integers, giving the low and high halves of the product
+#define WY_MUM(A, B) do {                   \
+    __uint128_t r = (__uint128_t)(A) * (B); \
+    (A) = (uint64_t)r;                      \
+    (B) = (uint64_t)(r >> 64);              \
+} while (0)
+
+/// Secret constants of wyhash
+const uint64_t WY_SECRET[4] = {
+    0x2d358dccaa6c78a5ull,
+    0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull
+};
+
+/**
+Fold a 128-bit product into 64 bits
+*/
+uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    WY_MUM(a, b);
+    return a ^ b;
+}
+
+uint64_t wy_read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t wy_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+wyhash (final version 4) by Wang Yi, released in the public domain
+Keys are consumed 48 bytes per iteration by three independent
+multiply chains. Keys of up to 16 bytes take no loop at all.
+*/
+uint64_t wyhash(const void* key, size_t len, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)key;
+    const uint64_t* secret = WY_SECRET;
+    uint64_t a, b;
+
+    seed ^= wy_mix(seed ^ secret[0], secret[1]);
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            // Overlapping reads cover lengths 4 to 16
+            size_t mid = (len >> 3) << 2;
+            a = (wy_read32(p) << 32) | wy_read32(p + mid);
+            b = (wy_read32(p + len - 4) << 32) | wy_read32(p + len - 4 - mid);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+
+        if (i > 48)
+        {
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+
+            do
+            {
+                seed = wy_mix(wy_read64(p) ^ secret[1], wy_read64(p + 8) ^ seed);
+                see1 = wy_mix(wy_read64(p + 16) ^ secret[2], wy_read64(p + 24) ^ see1);
+                see2 = wy_mix(wy_read64(p + 32) ^ secret[3], wy_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16)
+        {
+            seed = wy_mix(wy_read64(p) ^ secret[1], wy_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        // The last 16 bytes, which may overlap the bytes already hashed
+        a = wy_read64(p + i - 16);
+        b = wy_read64(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    WY_MUM(a, b);
+
+    return wy_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+// The byte search kernels below scan 16 bytes at a time with SSE2, which
+// is always available on x86-64, and 32 bytes at a time with AVX2 when the
+// CPU supports it. Other targets use the scalar loops. Vector loads never
+// cross the end of the inputs, the remaining bytes are handled one by one.
+
+/// AVX2 support, detected by init_simd
+bool cpu_has_avx2 = false;
+
+/**
+Detect the vector instructions supported by the CPU
+*/
+void init_simd()
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    cpu_has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_KERNELS
+#define AVX2_FN __attribute__((target("avx2")))
+
+AVX2_FN const char* bytes_find_byte_avx2(const char* data, size_t len, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+        if (mask != 0)
+            return data + i + __builtin_ctz(mask);
+    }
+
+    for (; i < len; ++i)
+        if (data[i] == c)
+            return data + i;
+
+    return NULL;
+}
+
+AVX2_FN size_t bytes_count_byte_avx2(const char* data, size_t len, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        count += __builtin_popcount(mask);
+    }
+
+    for (; i < len; ++i)
+        count += (data[i] == c);
+
+    return count;
+}
+
+AVX2_FN size_t bytes_mismatch_avx2(const char* a, const char* b, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    for (; i < len; ++i)
+        if (a[i] != b[i])
+            return i;
+
+    return len;
+}
+
+AVX2_FN const char* bytes_find_short_avx2(
+    const char* hay,
+    size_t hay_len,
+    const char* needle,
+    size_t needle_len
+)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t num_starts = hay_len - needle_len + 1;
+    size_t i = 0;
+
+    for (; i + 32 <= num_starts; i += 32)
+    {
+        __m256i vf = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i vl = _mm256_loadu_si256((const __m256i*)(hay + i + needle_len - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(vf, first),
+            _mm256_cmpeq_epi8(vl, last)
+        ));
+
+        // Check the middle bytes of each candidate
+        while (mask != 0)
+        {
+            size_t start = i + __builtin_ctz(mask);
+
+            if (memcmp(hay + start + 1, needle + 1, needle_len - 2) == 0)
+                return hay + start;
+
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < num_starts; ++i)
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, needle_len) == 0)
+            return hay + i;
+
+    return NULL;
+}
+
+#endif
+
+/**
+Find the first occurrence of a byte
+Returns NULL if there is none
+*/
+const char* bytes_find_byte(const char* data, size_t len, char c)
+{
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2)
+        return bytes_find_byte_avx2(data, len, c);
+#endif
+
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+        if (mask != 0)
+            return data + i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; ++i)
+        if (data[i] == c)
+            return data + i;
+
+    return NULL;
+}
+
+/**
+Count the occurrences of a byte
+*/
+size_t bytes_count_byte(const char* data, size_t len, char c)
+{
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2)
+        return bytes_count_byte_avx2(data, len, c);
+#endif
+
+    size_t count = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        count += __builtin_popcount(mask);
+    }
+#endif
+
+    for (; i < len; ++i)
+        count += (data[i] == c);
+
+    return count;
+}
+
+/**
+Count the whitespace bytes at the start of a buffer, as classified by
+isspace in the C locale. Whitespace runs between tokens are usually
+short, so this only uses SSE2.
+*/
+size_t bytes_skip_space(const char* data, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+
+        // The control characters \t \n \v \f \r are 9 to 13, the
+        // unsigned saturated difference with 4 is zero for those
+        __m128i ctrl = _mm_subs_epu8(_mm_sub_epi8(block, tab), four);
+        __m128i is_space = _mm_or_si128(
+            _mm_cmpeq_epi8(block, space),
+            _mm_cmpeq_epi8(ctrl, _mm_setzero_si128())
+        );
+        uint32_t mask = 0xFFFF ^ _mm_movemask_epi8(is_space);
+
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; ++i)
+    {
+        char ch = data[i];
+        if (ch != ' ' && (ch < '\t' || ch > '\r'))
+            break;
+    }
+
+    return i;
+}
+
 /**
-MurmurHash2, 64-bit version for 64-bit platforms
-All hail Austin Appleby
+Find the index of the first byte differing between two buffers
+Returns len if the buffers are equal
 */
-uint64_t murmur_hash_64a(const void* key, size_t len, uint64_t seed)
+size_t bytes_mismatch(const char* a, const char* b, size_t len)
 {
-    const uint64_t m = 0xc6a4a7935bd1e995;
-    const int r = 47;
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2)
+        return bytes_mismatch_avx2(a, b, len);
+#endif
+
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        uint32_t mask = 0xFFFF ^ _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; ++i)
+        if (a[i] != b[i])
+            return i;
 
-    uint64_t h = seed ^ (len * m);
+    return len;
+}
 
-    uint64_t* data = (uint64_t*)key;
-    uint64_t* end = data + (len/8);
+/**
+Compute the critical factorization of a needle for the two-way search.
+Returns the split position and writes the period of the right half.
+*/
+size_t two_way_factorize(const uint8_t* needle, size_t len, size_t* period)
+{
+    size_t max_suffix, max_suffix_rev, j, k, p;
 
-    while (data != end)
+    // Maximal suffix for the lexicographic order
+    max_suffix = SIZE_MAX;
+    j = 0;
+    k = p = 1;
+    while (j + k < len)
     {
-        uint64_t k = *data++;
+        uint8_t a = needle[j + k];
+        uint8_t b = needle[max_suffix + k];
 
-        k *= m;
-        k ^= k >> r;
-        k *= m;
+        if (a < b)
+        {
+            j += k;
+            k = 1;
+            p = j - max_suffix;
+        }
+        else if (a == b)
+        {
+            if (k != p)
+            {
+                ++k;
+            }
+            else
+            {
+                j += p;
+                k = 1;
+            }
+        }
+        else
+        {
+            max_suffix = j++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+
+    // Maximal suffix for the reverse order
+    max_suffix_rev = SIZE_MAX;
+    j = 0;
+    k = p = 1;
+    while (j + k < len)
+    {
+        uint8_t a = needle[j + k];
+        uint8_t b = needle[max_suffix_rev + k];
 
-        h ^= k;
-        h *= m;
+        if (b < a)
+        {
+            j += k;
+            k = 1;
+            p = j - max_suffix_rev;
+        }
+        else if (a == b)
+        {
+            if (k != p)
+            {
+                ++k;
+            }
+            else
+            {
+                j += p;
+                k = 1;
+            }
+        }
+        else
+        {
+            max_suffix_rev = j++;
+            k = p = 1;
+        }
     }
 
-    uint8_t* tail = (uint8_t*)data;
+    // The larger of the two suffixes gives the critical position
+    if (max_suffix_rev + 1 < max_suffix + 1)
+        return max_suffix + 1;
+
+    *period = p;
+    return max_suffix_rev + 1;
+}
+
+/**
+Two-way substring search (Crochemore and Perrin), linear in the
+haystack length and using constant space
+*/
+const char* bytes_find_two_way(
+    const char* hay_chars,
+    size_t hay_len,
+    const char* needle_chars,
+    size_t needle_len
+)
+{
+    const uint8_t* hay = (const uint8_t*)hay_chars;
+    const uint8_t* needle = (const uint8_t*)needle_chars;
+
+    assert (needle_len > 0 && needle_len <= hay_len);
+
+    size_t period;
+    size_t suffix = two_way_factorize(needle, needle_len, &period);
+    size_t i, j;
+
+    // If the needle is periodic, remember how much of the period
+    // was matched so that it is not compared again after a shift
+    if (memcmp(needle, needle + period, suffix) == 0)
+    {
+        size_t memory = 0;
+        j = 0;
+        while (j <= hay_len - needle_len)
+        {
+            // Match the right half
+            i = (suffix > memory)? suffix:memory;
+            while (i < needle_len && needle[i] == hay[i + j])
+                ++i;
+
+            if (i < needle_len)
+            {
+                j += i - suffix + 1;
+                memory = 0;
+                continue;
+            }
+
+            // Match the left half
+            i = suffix - 1;
+            while (memory < i + 1 && needle[i] == hay[i + j])
+                --i;
+
+            if (i + 1 < memory + 1)
+                return hay_chars + j;
+
+            j += period;
+            memory = needle_len - period;
+        }
+    }
+    else
+    {
+        // Any mismatch in the left half allows a maximal shift
+        period = ((suffix > needle_len - suffix)? suffix:needle_len - suffix) + 1;
+        j = 0;
+        while (j <= hay_len - needle_len)
+        {
+            // Match the right half
+            i = suffix;
+            while (i < needle_len && needle[i] == hay[i + j])
+                ++i;
+
+            if (i < needle_len)
+            {
+                j += i - suffix + 1;
+                continue;
+            }
+
+            // Match the left half
+            i = suffix - 1;
+            while (i != SIZE_MAX && needle[i] == hay[i + j])
+                --i;
+
+            if (i == SIZE_MAX)
+                return hay_chars + j;
+
+            j += period;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+Find the first occurrence of a byte sequence
+Short needles are located by vector comparison of their first and last
+bytes, which rejects most candidate positions without a byte compare.
+Longer needles use the two-way search, so that no input is quadratic.
+Returns NULL if there is no occurrence.
+*/
+const char* bytes_find(
+    const char* hay,
+    size_t hay_len,
+    const char* needle,
+    size_t needle_len
+)
+{
+    if (needle_len > hay_len)
+        return NULL;
+
+    if (needle_len == 0)
+        return hay;
+
+    if (needle_len == 1)
+        return bytes_find_byte(hay, hay_len, needle[0]);
+
+    if (needle_len > BYTES_FIND_SHORT_MAX)
+        return bytes_find_two_way(hay, hay_len, needle, needle_len);
+
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2)
+        return bytes_find_short_avx2(hay, hay_len, needle, needle_len);
+#endif
 
-    switch (len & 7)
+    size_t num_starts = hay_len - needle_len + 1;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+    for (; i + 16 <= num_starts; i += 16)
     {
-        case 7: h ^= ((uint64_t)tail[6]) << 48;
-        case 6: h ^= ((uint64_t)tail[5]) << 40;
-        case 5: h ^= ((uint64_t)tail[4]) << 32;
-        case 4: h ^= ((uint64_t)tail[3]) << 24;
-        case 3: h ^= ((uint64_t)tail[2]) << 16;
-        case 2: h ^= ((uint64_t)tail[1]) << 8;
-        case 1: h ^= ((uint64_t)tail[0]);
-                h *= m;
-        default:
-        break;
+        __m128i vf = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i vl = _mm_loadu_si128((const __m128i*)(hay + i + needle_len - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(vf, first),
+            _mm_cmpeq_epi8(vl, last)
+        ));
+
+        // Check the middle bytes of each candidate
+        while (mask != 0)
+        {
+            size_t start = i + __builtin_ctz(mask);
+
+            if (memcmp(hay + start + 1, needle + 1, needle_len - 2) == 0)
+                return hay + start;
+
+            mask &= mask - 1;
+        }
     }
+#endif
+
+    for (; i < num_starts; ++i)
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, needle_len) == 0)
+            return hay + i;
 
-    h ^= h >> r;
-    h *= m;
-    h ^= h >> r;
+    return NULL;
+}
 
-    return h;
+/**
+Read a monotonic clock, in nanoseconds, to time benchmarks
+*/
+uint64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /**
-Read a text file into a malloc'ed string
+Map a file in memory as a read-only view
+The view is followed by at least one zero byte, so that it can be read
+as a C string. Pages are only read from the file when they are touched.
 */
-char* read_file(const char* file_name)
+bool file_view_open(file_view_t* view, const char* file_name)
 {
     printf("reading file \"%s\"\n", file_name);
 
-    FILE* file = fopen(file_name, "r");
+    int fd = open(file_name, O_RDONLY);
 
-    if (!file)
+    if (fd < 0)
     {
         printf("failed to open file\n");
-        return NULL;
+        return false;
     }
 
-    // Get the file size in bytes
-    fseek(file, 0, SEEK_END);
-    size_t len = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        printf("failed to read file\n");
+        close(fd);
+        return false;
+    }
 
-    //printf("%ld bytes\n", len);
+    view->len = st.st_size;
 
-    char* buf = malloc(len+1);
+    // Reserve zeroed memory extending at least one byte past the end of
+    // the file, then map the file over it. The rest of the last page of
+    // the file is also zeroed.
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    view->map_len = (view->len / page_size + 1) * page_size;
 
-    // Read into the allocated buffer
-    int read = fread(buf, 1, len, file);
+    uint8_t* base = mmap(
+        NULL,
+        view->map_len,
+        PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
 
-    if (read != len)
+    if (base != MAP_FAILED && view->len > 0)
     {
-        printf("failed to read file");
-        return NULL;
+        void* file_map = mmap(
+            base,
+            view->len,
+            PROT_READ,
+            MAP_PRIVATE | MAP_FIXED,
+            fd,
+            0
+        );
+
+        if (file_map == MAP_FAILED)
+        {
+            munmap(base, view->map_len);
+            base = MAP_FAILED;
+        }
     }
 
-    // Add a null terminator to the string
-    buf[len] = '\0';
+    close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        printf("failed to map file\n");
+        return false;
+    }
 
-    // Close the input file
-    fclose(file);
+    view->data = (const char*)base;
+    assert (view->data[view->len] == '\0');
 
-    return buf;
+    return true;
 }
 
 /**
-Read a line from standard input into a malloc'ed string
+Unmap a file view
 */
-char* read_line()
+void file_view_close(file_view_t* view)
 {
-    size_t cap = 256;
-    size_t len = 0;
-    char* buf = malloc(cap+1);
+    munmap((void*)view->data, view->map_len);
+    view->data = NULL;
+    view->len = 0;
+    view->map_len = 0;
+}
+
+/// Standard input buffer, holding the bytes read but not yet consumed
+/// between in_start and in_end. Grows to hold lines longer than itself.
+char* in_buf = NULL;
+size_t in_cap = 0;
+size_t in_start = 0;
+size_t in_end = 0;
+
+/**
+Read a line from standard input, excluding the newline character
+Returns a pointer to the line, valid until the next read, or NULL at the
+end of the input. Input is read in large chunks with read(2), and the
+buffered bytes are scanned for newlines with memchr. Standard output is
+flushed before reading, so that prompts show up.
+*/
+const char* read_line_buf(size_t* len)
+{
+    if (in_buf == NULL)
+    {
+        in_cap = IN_BUF_SIZE;
+        in_buf = malloc(in_cap);
+    }
+
+    size_t scan = in_start;
 
     for (;;)
     {
-        char ch = getchar();
+        char* nl = memchr(in_buf + scan, '\n', in_end - scan);
 
-        if (ch == '\0')
-            return 0;
+        if (nl != NULL)
+        {
+            const char* line = in_buf + in_start;
+            *len = nl - line;
+            in_start = nl + 1 - in_buf;
+            return line;
+        }
 
-        if (ch == '\n')
-            break;
+        // Move the partial line to the start of the buffer, and grow
+        // the buffer if the line fills it entirely
+        scan = in_end - in_start;
+        memmove(in_buf, in_buf + in_start, scan);
+        in_end = scan;
+        in_start = 0;
+
+        if (in_end == in_cap)
+        {
+            in_cap *= 2;
+            in_buf = realloc(in_buf, in_cap);
+        }
+
+        fflush(stdout);
 
-        buf[len] = ch;
-        len++;
+        ssize_t n = read(STDIN_FILENO, in_buf + in_end, in_cap - in_end);
 
-        if (len == cap)
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        // At the end of the input, the last line may lack a newline
+        if (n <= 0)
         {
-            cap *= 2;
-            char* new_buf = malloc(cap+1);
-            strncpy(new_buf, buf, len);
-            free(buf);
-            buf = new_buf;
+            if (in_end == 0)
+                return NULL;
+
+            *len = in_end;
+            in_start = in_end;
+            return in_buf;
         }
+
+        in_end += n;
     }
+}
+
+/**
+Read a line from standard input into a malloc'ed string
+Returns NULL at the end of the input
+*/
+char* read_line()
+{
+    size_t len;
+    const char* line = read_line_buf(&len);
+
+    if (line == NULL)
+        return NULL;
+
+    char* buf = malloc(len+1);
+    memcpy(buf, line, len);
 
     // Add a null terminator to the string
     buf[len] = '\0';
 
     return buf;
 }
-
@@ -2,13 +2,63 @@
 #define __UTIL_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 /// Macro to get the size of a struct field
 #define FIELD_SIZEOF(STRUCT, FIELD) (sizeof(((STRUCT*)0)->FIELD))
 
-uint64_t murmur_hash_64a(const void* key, size_t len, uint64_t seed);
+uint64_t wyhash(const void* key, size_t len, uint64_t seed);
 
-char* read_file(const char* file_name);
+/// Longest needle searched with the vector first/last byte filter
+#define BYTES_FIND_SHORT_MAX 32
+
+/// AVX2 support, detected by init_simd
+extern bool cpu_has_avx2;
+
+void init_simd();
+const char* bytes_find_byte(const char* data, size_t len, char c);
+size_t bytes_count_byte(const char* data, size_t len, char c);
+size_t bytes_skip_space(const char* data, size_t len);
+size_t bytes_mismatch(const char* a, const char* b, size_t len);
+const char* bytes_find_two_way(
+    const char* hay,
+    size_t hay_len,
+    const char* needle,
+    size_t needle_len
+);
+const char* bytes_find(
+    const char* hay,
+    size_t hay_len,
+    const char* needle,
+    size_t needle_len
+);
+
+/**
+Read-only view of a file mapped in memory
+*/
+typedef struct
+{
+    /// File contents, followed by at least one zero byte
+    const char* data;
+
+    /// File size in bytes
+    size_t len;
+
+    /// Size of the mapping
+    size_t map_len;
+
+} file_view_t;
+
+uint64_t time_ns();
+
+bool file_view_open(file_view_t* view, const char* file_name);
+void file_view_close(file_view_t* view);
+
+/// Initial size of the standard input buffer
+#define IN_BUF_SIZE (1 << 16)
+
+const char* read_line_buf(size_t* len);
 
 char* read_line();
 
@@ -8,6 +8,10 @@
 #include "util.h"
 #include "vm.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 //============================================================================
 // VM core
 //============================================================================
@@ -21,6 +25,12 @@ shapeidx_t SHAPE_ARRAY;
 /// Shape of string objects
 shapeidx_t SHAPE_STRING;
 
+/// Shape of hash map objects
+shapeidx_t SHAPE_MAP;
+
+/// Shape of string builder objects
+shapeidx_t SHAPE_STRBUF;
+
 /// Boolean constant values
 const value_t VAL_FALSE = { 0, TAG_BOOL };
 const value_t VAL_TRUE = { 1, TAG_BOOL };
@@ -54,10 +64,14 @@ bool value_equals(value_t this, value_t that)
     if (this.tag != that.tag)
         return false;
 
-    if (this.word.int64 != that.word.int64)
-        return false;
+    if (this.word.int64 == that.word.int64)
+        return true;
 
-    return true;
+    // Data strings are not interned, equal strings can be distinct
+    if (this.tag == TAG_STRING)
+        return string_equals(this.word.string, that.word.string);
+
+    return false;
 }
 
 /**
@@ -105,6 +119,14 @@ void value_print(value_t value)
         printf("object\n");
         break;
 
+        case TAG_MAP:
+        printf("map");
+        break;
+
+        case TAG_STRBUF:
+        printf("strbuf");
+        break;
+
         default:
         printf("unknown value tag");
         break;
@@ -122,6 +144,9 @@ shapeidx_t get_shape(heapptr_t obj)
 /// Initialize the VM
 void init_vm()
 {
+    // Select the string search kernels for this CPU
+    init_simd();
+
     // Allocate the hosted heap
     // Note: calloc also zeroes out the heap
     vm.heapstart = calloc(1, HEAP_SIZE);
@@ -172,9 +197,22 @@ void init_vm()
     vm.string_shape = shape_alloc_empty();
     SHAPE_STRING = vm.string_shape->idx;
     assert (SHAPE_ARRAY != SHAPE_STRING);
+    SHAPE_MAP = shape_alloc_empty()->idx;
+    SHAPE_STRBUF = shape_alloc_empty()->idx;
+
+    // Create the single-byte strings, so that indexing into strings
+    // never allocates
+    for (size_t i = 0; i < 256; ++i)
+    {
+        char ch = (char)i;
+        vm.char_strs[i] = vm_get_tbl_str(string_from_bytes(&ch, 1));
+    }
 
     // The global scope is initialized in interp.c
     vm.global_clos = NULL;
+    vm.global_fun = NULL;
+    vm.global_slots = NULL;
+    vm.num_globals = 0;
 }
 
 /**
@@ -224,40 +262,269 @@ string_t* string_alloc(uint32_t len)
     );
 
     str->len = len;
+    str->flags = 0;
+    str->data = str->chars;
+    str->parent = NULL;
 
     return str;
 }
 
+/**
+Allocate a data string holding a copy of some bytes
+The string is not interned, and its hash is only computed if needed
+*/
+string_t* string_from_bytes(const char* data, uint32_t len)
+{
+    string_t* str = string_alloc(len);
+
+    memcpy(str->data, data, len);
+    str->data[len] = '\0';
+
+    return str;
+}
+
+/**
+Get a substring, without copying the characters
+The shortest substrings are shared rather than allocated.
+*/
+string_t* string_slice(string_t* str, uint32_t start, uint32_t len)
+{
+    assert (start <= str->len && len <= str->len - start);
+
+    if (start == 0 && len == str->len)
+        return str;
+
+    if (len == 1)
+        return vm.char_strs[(uint8_t)str->data[start]];
+
+    string_t* slice = (string_t*)vm_alloc(sizeof(string_t), SHAPE_STRING);
+
+    slice->len = len;
+    slice->flags = 0;
+    slice->data = str->data + start;
+
+    // Slices of slices refer to the string holding the characters
+    slice->parent = str->parent? str->parent:str;
+
+    return slice;
+}
+
+/**
+Copy the characters of a slice into a null-terminated string of its own
+The slice object stays the same, so references to it remain valid.
+*/
+void string_flatten(string_t* str)
+{
+    if (str->parent == NULL)
+        return;
+
+    // If the slice already spans all of its parent
+    if (str->data == str->parent->data && str->len == str->parent->len)
+        return;
+
+    string_t* flat = string_from_bytes(str->data, str->len);
+    str->data = flat->data;
+    str->parent = flat;
+}
+
+/**
+Get a null-terminated C string for a string
+Slices not ending at the end of their parent are flattened.
+*/
 char* string_cstr(string_t* str)
 {
+    // The terminator of the parent string can always be read
+    if (str->data[str->len] != '\0')
+        string_flatten(str);
+
     assert (str->data[str->len] == '\0');
-    return &str->data[0];
+    return str->data;
+}
+
+/**
+Compare strings in lexicographic byte order
+Returns a negative, zero or positive value, as strcmp
+*/
+int string_compare(string_t* stra, string_t* strb)
+{
+    uint32_t min_len = (stra->len < strb->len)? stra->len:strb->len;
+    size_t idx = bytes_mismatch(stra->data, strb->data, min_len);
+
+    if (idx < min_len)
+        return (uint8_t)stra->data[idx] - (uint8_t)strb->data[idx];
+
+    return (stra->len > strb->len) - (stra->len < strb->len);
+}
+
+/**
+Find the first occurrence of a substring at or after a given index
+Returns -1 if there is none
+*/
+int64_t string_index_of(string_t* str, string_t* needle, uint32_t from)
+{
+    if (from > str->len)
+        return -1;
+
+    const char* p = bytes_find(
+        str->data + from,
+        str->len - from,
+        needle->data,
+        needle->len
+    );
+
+    return p? p - str->data:-1;
+}
+
+/**
+Count the non-overlapping occurrences of a non-empty substring
+*/
+int64_t string_count(string_t* str, string_t* needle)
+{
+    assert (needle->len > 0);
+
+    if (needle->len == 1)
+        return bytes_count_byte(str->data, str->len, needle->data[0]);
+
+    int64_t count = 0;
+    const char* p = str->data;
+    const char* end = str->data + str->len;
+
+    while ((p = bytes_find(p, end - p, needle->data, needle->len)) != NULL)
+    {
+        ++count;
+        p += needle->len;
+    }
+
+    return count;
+}
+
+/**
+Split a string around each occurrence of a non-empty separator
+The parts are slices of the string, stored in a new array.
+*/
+array_t* string_split(string_t* str, string_t* sep)
+{
+    assert (sep->len > 0);
+
+    array_t* parts = array_alloc(4);
+    uint32_t start = 0;
+
+    for (;;)
+    {
+        const char* p = bytes_find(
+            str->data + start,
+            str->len - start,
+            sep->data,
+            sep->len
+        );
+
+        uint32_t end = p? p - str->data:str->len;
+        string_t* part = string_slice(str, start, end - start);
+        array_set(parts, parts->len, value_from_heapptr((heapptr_t)part, TAG_STRING));
+
+        if (p == NULL)
+            break;
+
+        start = end + sep->len;
+    }
+
+    return parts;
+}
+
+/**
+Test if a string starts with a given prefix
+*/
+bool string_starts_with(string_t* str, string_t* prefix)
+{
+    return (
+        prefix->len <= str->len &&
+        bytes_mismatch(str->data, prefix->data, prefix->len) == prefix->len
+    );
+}
+
+/**
+Get the hash code of a string, computing it on first use
+*/
+uint32_t string_hash(string_t* str)
+{
+    if (!(str->flags & STR_HASHED))
+    {
+        str->hash = (uint32_t)wyhash(str->data, str->len, STR_HASH_SEED);
+        str->flags |= STR_HASHED;
+    }
+
+    return str->hash;
 }
 
+/**
+Compare strings by content. Distinct interned strings are never equal,
+other strings are compared by length, hash codes if both are known,
+then bytes.
+*/
 bool string_equals(string_t* stra, string_t* strb)
 {
+    if (stra == strb)
+        return true;
+
+    if (stra->flags & strb->flags & STR_INTERNED)
+        return false;
+
     if (stra->len != strb->len)
         return false;
 
-    return strncmp(stra->data, strb->data, stra->len) == 0;
+    if ((stra->flags & strb->flags & STR_HASHED) && stra->hash != strb->hash)
+        return false;
+
+    return bytes_mismatch(stra->data, strb->data, stra->len) == stra->len;
+}
+
+/**
+Double the size of the string table
+The strings are reinserted using their cached hash codes.
+*/
+void vm_grow_str_tbl()
+{
+    array_t* old_tbl = vm.stringtbl;
+    array_t* new_tbl = array_alloc(2 * old_tbl->len);
+    for (size_t i = 0; i < new_tbl->cap; ++i)
+        array_set(new_tbl, i, VAL_FALSE);
+
+    uint32_t mask = new_tbl->len - 1;
+
+    for (uint32_t i = 0; i < old_tbl->len; ++i)
+    {
+        string_t* str = array_get(old_tbl, i).word.string;
+
+        if (str == NULL)
+            continue;
+
+        assert (str->flags & STR_HASHED);
+        uint32_t hashIndex = str->hash & mask;
+
+        while (array_get(new_tbl, hashIndex).word.string != NULL)
+            hashIndex = (hashIndex + 1) & mask;
+
+        array_set(
+            new_tbl,
+            hashIndex,
+            value_from_heapptr((heapptr_t)str, TAG_STRING)
+        );
+    }
+
+    vm.stringtbl = new_tbl;
 }
 
 /**
 Find a string in the string table if duplicate, or add it to the string table
+This is also used to intern data strings on demand.
 */
 string_t* vm_get_tbl_str(string_t* str)
 {
-    assert (str->data[str->len] == '\0');
-
-    // Compute the hash code for the string
-    uint32_t hashCode = (uint32_t)murmur_hash_64a(
-        &str->data,
-        str->len,
-        1337
-    );
+    if (str->flags & STR_INTERNED)
+        return str;
 
-    // Store the hash code on the string object
-    str->hash = hashCode;
+    // Get the hash code for the string
+    uint32_t hashCode = string_hash(str);
 
     // Get the hash table index for this hash value
     uint32_t hashIndex = hashCode & (vm.stringtbl->len - 1);
@@ -290,7 +557,11 @@ string_t* vm_get_tbl_str(string_t* str)
     // Hash table updating
     //
 
+    // Interned strings do not hold on to the parent of a slice
+    string_flatten(str);
+
     // Set the corresponding key and value in the slot
+    str->flags |= STR_INTERNED;
     array_set(
         vm.stringtbl,
         hashIndex,
@@ -307,16 +578,7 @@ string_t* vm_get_tbl_str(string_t* str)
     if (vm.num_strings * STR_TBL_MAX_LOAD_DEN >
         vm.stringtbl->len * STR_TBL_MAX_LOAD_NUM)
     {
-        assert (false);
-
-        // Store the string pointer in a GC root object
-        //auto strRoot = GCRoot(str, Tag.STRING);
-
-        // Extend the string table
-        //extStrTable(vm, strTbl, tblSize, numStrings);
-
-        // Restore the string pointer
-        //str = strRoot.ptr;
+        vm_grow_str_tbl();
     }
 
     // Return a reference to the string object passed as argument
@@ -396,22 +658,99 @@ void extStrTable(heapptr_t curTbl, uint32_t curSize, uint32_t numStrings)
 }
 */
 
+/**
+Get the interned string for some bytes
+A string is only allocated if the string table doesn't have one yet.
+*/
+string_t* vm_get_str(const char* data, uint32_t len)
+{
+    uint32_t hashCode = (uint32_t)wyhash(data, len, STR_HASH_SEED);
+    uint32_t hashIndex = hashCode & (vm.stringtbl->len - 1);
+
+    for (;;)
+    {
+        string_t* strVal = array_get(vm.stringtbl, hashIndex).word.string;
+
+        if (strVal == NULL)
+            break;
+
+        if (strVal->hash == hashCode &&
+            strVal->len == len &&
+            bytes_mismatch(strVal->data, data, len) == len)
+            return strVal;
+
+        hashIndex = (hashIndex + 1) & (vm.stringtbl->len - 1);
+    }
+
+    // Add a new string, which is known not to be in the table
+    string_t* str = string_from_bytes(data, len);
+    str->hash = hashCode;
+    str->flags |= STR_HASHED;
+
+    return vm_get_tbl_str(str);
+}
+
 /**
 Get the interned string object for a given C string
 */
 string_t* vm_get_cstr(const char* cstr)
 {
-    string_t* str = string_alloc(strlen(cstr));
+    return vm_get_str(cstr, strlen(cstr));
+}
 
-    strncpy(str->data, cstr, str->len);
+//============================================================================
+// String builders
+//============================================================================
 
-    // Write the null terminator character
-    str->data[str->len] = '\0';
+strbuf_t* strbuf_alloc(uint32_t cap)
+{
+    strbuf_t* sb = (strbuf_t*)vm_alloc(sizeof(strbuf_t), SHAPE_STRBUF);
 
-    // Find/add the string in the string table
-    str = vm_get_tbl_str(str);
+    sb->len = 0;
+    sb->cap = (cap > 0)? cap:16;
+    sb->buf = malloc(sb->cap);
+    sb->str = NULL;
 
-    return str;
+    return sb;
+}
+
+/**
+Append characters to a string builder, doubling its capacity as needed
+*/
+void strbuf_append(strbuf_t* sb, const char* data, uint32_t len)
+{
+    if (len > UINT32_MAX - sb->len)
+    {
+        printf("string builder length overflow\n");
+        exit(-1);
+    }
+
+    if (sb->len + len > sb->cap)
+    {
+        uint64_t new_cap = (uint64_t)sb->cap * 2;
+        if (new_cap < sb->len + len)
+            new_cap = sb->len + len;
+        if (new_cap > UINT32_MAX)
+            new_cap = UINT32_MAX;
+
+        sb->cap = new_cap;
+        sb->buf = realloc(sb->buf, sb->cap);
+    }
+
+    memcpy(sb->buf + sb->len, data, len);
+    sb->len += len;
+    sb->str = NULL;
+}
+
+/**
+Get the contents of a string builder as a data string
+*/
+string_t* strbuf_to_string(strbuf_t* sb)
+{
+    if (sb->str == NULL)
+        sb->str = string_from_bytes(sb->buf, sb->len);
+
+    return sb->str;
 }
 
 //============================================================================
@@ -870,10 +1209,375 @@ value_t object_get_prop(object_t* obj, string_t* prop_name)
     exit(-1);
 }
 
+//============================================================================
+// Hash maps
+//============================================================================
+
+/**
+Get a bit mask of the slots of a group whose control byte is equal to a
+given byte. The control bytes of a group are compared all at once with
+SSE2, which every x86-64 processor supports.
+*/
+uint32_t map_group_match(const uint8_t* ctrl, uint8_t byte)
+{
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    __m128i cmp = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte));
+    return (uint32_t)_mm_movemask_epi8(cmp);
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < MAP_GROUP_SIZE; ++i)
+        if (ctrl[i] == byte)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/**
+Get a bit mask of the empty or deleted slots of a group, these are the
+slots whose control byte has its high bit set
+*/
+uint32_t map_group_free(const uint8_t* ctrl)
+{
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < MAP_GROUP_SIZE; ++i)
+        if (ctrl[i] & 0x80)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/**
+Hash a map key. Strings are hashed by content, using their cached hash
+code, other values are hashed by identity.
+*/
+uint64_t map_hash(value_t key)
+{
+    uint64_t h;
+
+    if (key.tag == TAG_STRING)
+        h = string_hash(key.word.string);
+    else if (key.tag == TAG_BOOL)
+        h = key.word.int8 != 0;
+    else
+        h = (uint64_t)key.word.int64;
+
+    // Mix the tag and the word so that all bits of the hash are used,
+    // the low bits are stored in the control bytes
+    h = (h ^ ((uint64_t)key.tag << 59)) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+
+/**
+Test if two map keys are equal
+*/
+bool map_key_equals(value_t a, value_t b)
+{
+    if (a.tag != b.tag)
+        return false;
+
+    if (a.tag == TAG_BOOL)
+        return (a.word.int8 != 0) == (b.word.int8 != 0);
+
+    if (a.word.int64 == b.word.int64)
+        return true;
+
+    if (a.tag == TAG_STRING)
+        return string_equals(a.word.string, b.word.string);
+
+    return false;
+}
+
+/**
+Allocate an empty slot table for a map
+The control bytes and the slots share a single allocation,
+which is owned by map->ctrl
+*/
+void map_alloc_table(map_t* map, uint32_t cap)
+{
+    assert (cap >= MAP_MIN_CAP);
+    assert ((cap & (cap - 1)) == 0);
+
+    uint8_t* mem = malloc(cap + sizeof(map_slot_t) * cap);
+    map->ctrl = mem;
+    map->slots = (map_slot_t*)(mem + cap);
+    memset(map->ctrl, MAP_CTRL_EMPTY, cap);
+
+    map->cap = cap;
+    map->len = 0;
+    map->num_deleted = 0;
+}
+
+/**
+Allocate a hash map with room for a given number of keys
+*/
+map_t* map_alloc(uint32_t cap)
+{
+    map_t* map = (map_t*)vm_alloc(sizeof(map_t), SHAPE_MAP);
+
+    uint32_t num_slots = MAP_MIN_CAP;
+    while ((uint64_t)num_slots * MAP_MAX_LOAD_NUM < (uint64_t)cap * MAP_MAX_LOAD_DEN)
+        num_slots *= 2;
+
+    map_alloc_table(map, num_slots);
+
+    return map;
+}
+
+/**
+Find the slot holding a key, given the key hash
+Groups are probed in triangular order, which visits every group since
+the number of groups is a power of two. A key is always inserted in the
+first group with a free slot, so the search stops at a group with an
+empty slot.
+*/
+uint32_t map_lookup(map_t* map, value_t key, uint64_t hash)
+{
+    uint32_t group_mask = map->cap / MAP_GROUP_SIZE - 1;
+    uint32_t group = (uint32_t)(hash >> 7) & group_mask;
+    uint8_t h2 = hash & 0x7F;
+
+    for (uint32_t step = 1;; ++step)
+    {
+        uint8_t* ctrl = map->ctrl + group * MAP_GROUP_SIZE;
+
+        for (uint32_t match = map_group_match(ctrl, h2); match; match &= match - 1)
+        {
+            uint32_t idx = group * MAP_GROUP_SIZE + __builtin_ctz(match);
+
+            if (map_key_equals(map->slots[idx].key, key))
+                return idx;
+        }
+
+        if (map_group_match(ctrl, MAP_CTRL_EMPTY))
+            return map->cap;
+
+        group = (group + step) & group_mask;
+    }
+}
+
+/**
+Find the first free slot in the probe sequence of a hash
+*/
+uint32_t map_find_free(map_t* map, uint64_t hash)
+{
+    uint32_t group_mask = map->cap / MAP_GROUP_SIZE - 1;
+    uint32_t group = (uint32_t)(hash >> 7) & group_mask;
+
+    for (uint32_t step = 1;; ++step)
+    {
+        uint32_t free_mask = map_group_free(map->ctrl + group * MAP_GROUP_SIZE);
+
+        if (free_mask)
+            return group * MAP_GROUP_SIZE + __builtin_ctz(free_mask);
+
+        group = (group + step) & group_mask;
+    }
+}
+
+/**
+Rehash all the keys of a map into a new slot table
+This also clears the deleted slots
+*/
+void map_resize(map_t* map, uint32_t new_cap)
+{
+    uint8_t* old_ctrl = map->ctrl;
+    map_slot_t* old_slots = map->slots;
+    uint32_t old_cap = map->cap;
+
+    map_alloc_table(map, new_cap);
+
+    for (uint32_t i = 0; i < old_cap; ++i)
+    {
+        if (old_ctrl[i] & 0x80)
+            continue;
+
+        uint64_t hash = map_hash(old_slots[i].key);
+        uint32_t idx = map_find_free(map, hash);
+        map->ctrl[idx] = hash & 0x7F;
+        map->slots[idx] = old_slots[i];
+        map->len++;
+    }
+
+    // Free the old control bytes and slots
+    free(old_ctrl);
+}
+
+/**
+Find the slot index of a key, returns the map capacity if not found
+*/
+uint32_t map_find(map_t* map, value_t key)
+{
+    return map_lookup(map, key, map_hash(key));
+}
+
+/**
+Get the value associated with a key, returns false if not found
+*/
+bool map_get(map_t* map, value_t key, value_t* val)
+{
+    uint32_t idx = map_find(map, key);
+
+    if (idx == map->cap)
+        return false;
+
+    *val = map->slots[idx].val;
+    return true;
+}
+
+/**
+Associate a value with a key
+*/
+void map_set(map_t* map, value_t key, value_t val)
+{
+    uint64_t hash = map_hash(key);
+    uint32_t idx = map_lookup(map, key, hash);
+
+    if (idx < map->cap)
+    {
+        map->slots[idx].val = val;
+        return;
+    }
+
+    // If the new key would exceed the maximum load, rehash. The capacity
+    // is doubled unless the keys fill at most half of the maximum load,
+    // in which case rehashing only clears the deleted slots.
+    uint64_t load = (uint64_t)(map->len + map->num_deleted + 1) * MAP_MAX_LOAD_DEN;
+    uint64_t max_load = (uint64_t)map->cap * MAP_MAX_LOAD_NUM;
+
+    if (load > max_load)
+    {
+        uint64_t live = (uint64_t)(map->len + 1) * MAP_MAX_LOAD_DEN * 2;
+        map_resize(map, (live > max_load)? map->cap * 2:map->cap);
+    }
+
+    idx = map_find_free(map, hash);
+
+    if (map->ctrl[idx] == MAP_CTRL_DELETED)
+        map->num_deleted--;
+
+    map->ctrl[idx] = hash & 0x7F;
+    map->slots[idx].key = key;
+    map->slots[idx].val = val;
+    map->len++;
+}
+
+/**
+Test if a map contains a key
+*/
+bool map_has(map_t* map, value_t key)
+{
+    return map_find(map, key) < map->cap;
+}
+
+/**
+Remove a key from a map, returns false if not found
+*/
+bool map_delete(map_t* map, value_t key)
+{
+    uint32_t idx = map_find(map, key);
+
+    if (idx == map->cap)
+        return false;
+
+    // If the group has an empty slot, no probe sequence goes past it,
+    // and the slot can be made empty rather than deleted
+    uint8_t* group = map->ctrl + (idx & ~(MAP_GROUP_SIZE - 1));
+
+    if (map_group_match(group, MAP_CTRL_EMPTY))
+    {
+        map->ctrl[idx] = MAP_CTRL_EMPTY;
+    }
+    else
+    {
+        map->ctrl[idx] = MAP_CTRL_DELETED;
+        map->num_deleted++;
+    }
+
+    map->slots[idx].key = VAL_FALSE;
+    map->slots[idx].val = VAL_FALSE;
+    map->len--;
+
+    return true;
+}
+
+/**
+Get the index of the first full slot at or after a given index, used to
+iterate over the keys of a map. Returns the map capacity at the end.
+*/
+uint32_t map_next(map_t* map, uint32_t idx)
+{
+    for (; idx < map->cap; ++idx)
+        if (!(map->ctrl[idx] & 0x80))
+            return idx;
+
+    return map->cap;
+}
+
 //============================================================================
 // VM tests
 //============================================================================
 
+/**
+Cross-check the byte search kernels with naive loops
+*/
+void test_bytes_find(bool use_avx2)
+{
+    bool has_avx2 = cpu_has_avx2;
+    cpu_has_avx2 = use_avx2;
+
+    char hay[200];
+    char needle[64];
+    uint32_t seed = 1;
+
+    for (size_t iter = 0; iter < 4000; ++iter)
+    {
+        seed = seed * 1103515245 + 12345;
+        size_t hay_len = (seed >> 8) % sizeof(hay);
+        seed = seed * 1103515245 + 12345;
+        size_t needle_len = 1 + (seed >> 8) % sizeof(needle);
+
+        for (size_t i = 0; i < hay_len; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            hay[i] = 'a' + ((seed >> 16) % 8 == 0);
+        }
+
+        // Take the needle from the haystack most of the time
+        seed = seed * 1103515245 + 12345;
+        size_t from = (hay_len > 0)? (seed >> 8) % hay_len:0;
+        for (size_t i = 0; i < needle_len; ++i)
+            needle[i] = (from + i < hay_len)? hay[from + i]:'a';
+
+        const char* expected = NULL;
+        for (size_t i = 0; i + needle_len <= hay_len && !expected; ++i)
+            if (memcmp(hay + i, needle, needle_len) == 0)
+                expected = hay + i;
+
+        assert (bytes_find(hay, hay_len, needle, needle_len) == expected);
+        if (needle_len <= hay_len)
+            assert (bytes_find_two_way(hay, hay_len, needle, needle_len) == expected);
+
+        size_t count = 0;
+        for (size_t i = 0; i < hay_len; ++i)
+            count += (hay[i] == 'b');
+        assert (bytes_count_byte(hay, hay_len, 'b') == count);
+
+        const char* first_b = memchr(hay, 'b', hay_len);
+        assert (bytes_find_byte(hay, hay_len, 'b') == first_b);
+
+        size_t mismatch = 0;
+        while (mismatch < hay_len / 2 && hay[mismatch] == hay[hay_len / 2 + mismatch])
+            ++mismatch;
+        assert (bytes_mismatch(hay, hay + hay_len / 2, hay_len / 2) == mismatch);
+    }
+
+    cpu_has_avx2 = has_avx2;
+}
+
 void test_vm()
 {
     printf("core VM tests\n");
@@ -889,6 +1593,70 @@ void test_vm()
     string_t* str_foo2 = vm_get_cstr("foo");
     assert (str_foo1 == str_foo2);
 
+    // Data strings are compared by content, and interned on demand
+    string_t* data_foo = string_from_bytes("foo", 3);
+    assert (data_foo != str_foo1);
+    assert (!(data_foo->flags & (STR_INTERNED | STR_HASHED)));
+    assert (string_equals(data_foo, str_foo1));
+    assert (!string_equals(data_foo, str_bar));
+    assert (string_hash(data_foo) == string_hash(str_foo1));
+    assert (vm_get_tbl_str(data_foo) == str_foo1);
+    string_t* data_baz = string_from_bytes("baz", 3);
+    assert (vm_get_tbl_str(data_baz) == data_baz);
+    assert (data_baz->flags & STR_INTERNED);
+    assert (vm_get_cstr("baz") == data_baz);
+    assert (vm.char_strs['a'] == vm_get_cstr("a"));
+
+    // Strings with known hash codes are told apart without comparing bytes
+    string_t* data_bar = string_from_bytes("bar", 3);
+    string_hash(data_bar);
+    assert (!string_equals(data_bar, data_foo));
+    assert (string_equals(data_bar, str_bar));
+
+    // Growing the string table keeps the interned strings
+    uint32_t tbl_len = vm.stringtbl->len;
+    vm_grow_str_tbl();
+    assert (vm.stringtbl->len == 2 * tbl_len);
+    assert (vm_get_cstr("foo") == str_foo1);
+    assert (vm_get_tbl_str(string_from_bytes("baz", 3)) == data_baz);
+
+    // Slices share the characters of their parent
+    string_t* str_long = string_from_bytes("foobarbaz", 9);
+    string_t* slice = string_slice(str_long, 3, 5);
+    assert (slice->data == str_long->data + 3 && slice->parent == str_long);
+    assert (string_slice(slice, 1, 3)->parent == str_long);
+    assert (string_slice(slice, 1, 1) == vm.char_strs['a']);
+    assert (string_equals(slice, string_from_bytes("barba", 5)));
+    assert (string_hash(slice) == string_hash(vm_get_cstr("barba")));
+    assert (string_compare(slice, vm_get_cstr("barbb")) < 0);
+    assert (string_compare(slice, vm_get_cstr("barb")) > 0);
+    assert (string_index_of(str_long, vm_get_cstr("ba"), 0) == 3);
+    assert (string_index_of(str_long, vm_get_cstr("ba"), 4) == 6);
+    assert (string_index_of(str_long, vm_get_cstr("bz"), 0) == -1);
+    assert (string_starts_with(slice, vm_get_cstr("bar")));
+    assert (!string_starts_with(slice, vm_get_cstr("baz")));
+    assert (strcmp(string_cstr(slice), "barba") == 0);
+    assert (slice->data != str_long->data + 3);
+    assert (string_slice(str_long, 6, 3)->data[3] == '\0');
+
+    assert (vm.char_strs[0]->len == 1 && vm.char_strs[0]->data[0] == '\0');
+
+    // Split and count
+    array_t* parts = string_split(vm_get_cstr("a,bc,,d"), vm.char_strs[',']);
+    assert (parts->len == 4);
+    assert (string_equals(array_get(parts, 1).word.string, vm_get_cstr("bc")));
+    assert (array_get(parts, 2).word.string->len == 0);
+    assert (string_split(vm_get_cstr("a::b"), vm_get_cstr("::"))->len == 2);
+    assert (string_count(vm_get_cstr("aaaa"), vm_get_cstr("aa")) == 2);
+    assert (string_count(vm_get_cstr("a,b,c"), vm.char_strs[',']) == 2);
+    assert (string_compare(vm_get_cstr("\xff"), vm_get_cstr("a")) > 0);
+
+    // Check the search kernels against a naive search on a two-letter
+    // alphabet, which produces many partial matches, with and without AVX2
+    test_bytes_find(false);
+    if (cpu_has_avx2)
+        test_bytes_find(true);
+
     // Test object allocation, set prop, get prop
     object_t* obj = object_alloc(OBJ_MIN_CAP);
     bool set_ret = object_set_prop_val(obj, "foo", VAL_TRUE);
@@ -902,6 +1670,168 @@ void test_vm()
     // TODO: helper methods, set_prop_int, set_prop_obj
     // wait to see if those are needed
 
+    // String builders
+    strbuf_t* sb = strbuf_alloc(0);
+    for (size_t i = 0; i < 1000; ++i)
+        strbuf_append(sb, "ab", 2);
+    assert (sb->len == 2000 && sb->cap >= sb->len);
+    string_t* sb_str = strbuf_to_string(sb);
+    assert (sb_str->len == 2000 && sb_str->data[1999] == 'b');
+    assert (strbuf_to_string(sb) == sb_str);
+    strbuf_append(sb, "c", 1);
+    assert (strbuf_to_string(sb) != sb_str);
+    assert (strbuf_to_string(sb)->data[2000] == 'c');
+
+    // Hash maps with integer keys, growing from the minimum capacity
+    map_t* map = map_alloc(0);
+    assert (map->cap == MAP_MIN_CAP);
+    for (int64_t i = 0; i < 1000; ++i)
+        map_set(map, value_from_int64(i * 7), value_from_int64(i));
+    assert (map->len == 1000);
+    assert (map->len * MAP_MAX_LOAD_DEN <= map->cap * MAP_MAX_LOAD_NUM);
+    value_t map_val;
+    assert (map_get(map, value_from_int64(700), &map_val));
+    assert (value_equals(map_val, value_from_int64(100)));
+    assert (!map_get(map, value_from_int64(701), &map_val));
+
+    // Deleting keys, and inserting into deleted slots
+    for (int64_t i = 0; i < 1000; i += 2)
+        assert (map_delete(map, value_from_int64(i * 7)));
+    assert (!map_delete(map, value_from_int64(0)));
+    assert (map->len == 500);
+    assert (!map_has(map, value_from_int64(14)));
+    assert (map_has(map, value_from_int64(21)));
+    uint32_t map_cap = map->cap;
+    for (int64_t i = 0; i < 100000; ++i)
+    {
+        map_set(map, value_from_int64(-i), VAL_TRUE);
+        map_delete(map, value_from_int64(-i));
+    }
+    assert (map->cap == map_cap);
+    assert (map->len == 500);
 
+    // Iteration visits every key once
+    uint32_t map_count = 0;
+    for (uint32_t i = map_next(map, 0); i < map->cap; i = map_next(map, i + 1))
+    {
+        assert (map->slots[i].key.word.int64 % 14 == 7);
+        map_count++;
+    }
+    assert (map_count == 500);
+
+    // String keys compare by content, other keys by identity and tag
+    map = map_alloc(4);
+    map_set(map, value_from_heapptr((heapptr_t)str_foo1, TAG_STRING), VAL_TRUE);
+    map_set(map, value_from_obj((heapptr_t)obj), value_from_int64(3));
+    map_set(map, VAL_TRUE, value_from_int64(1));
+    map_set(map, value_from_int64(1), value_from_int64(2));
+    assert (map->len == 4);
+    assert (map_has(map, value_from_heapptr((heapptr_t)str_foo2, TAG_STRING)));
+    assert (!map_has(map, value_from_heapptr((heapptr_t)str_bar, TAG_STRING)));
+    assert (map_has(map, value_from_obj((heapptr_t)obj)));
+    assert (!map_has(map, value_from_obj((heapptr_t)object_alloc(OBJ_MIN_CAP))));
+    assert (map_get(map, VAL_TRUE, &map_val));
+    assert (value_equals(map_val, value_from_int64(1)));
 }
 
+//============================================================================
+// VM benchmarks
+//============================================================================
+
+/**
+Time one interning pass over a set of strings, in nanoseconds
+*/
+uint64_t bench_intern_pass(string_t** strs, size_t num_strs)
+{
+    uint64_t start = time_ns();
+
+    for (size_t i = 0; i < num_strs; ++i)
+        vm_get_tbl_str(strs[i]);
+
+    return time_ns() - start;
+}
+
+/**
+Measure the throughput of string hashing and interning per byte
+Run with the --bench flag.
+*/
+void bench_vm()
+{
+    printf("string hashing and interning benchmarks\n");
+
+    // Random bytes to take the keys from
+    size_t buf_len = 1 << 20;
+    char* buf = malloc(buf_len + 8);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < buf_len + 8; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+
+    const size_t hash_lens[] = { 8, 16, 64, 256, 4096, 1 << 20 };
+
+    for (size_t k = 0; k < sizeof(hash_lens) / sizeof(hash_lens[0]); ++k)
+    {
+        size_t len = hash_lens[k];
+        size_t num_iters = (256 << 20) / len;
+        uint64_t sum = 0;
+
+        // Vary the key offset so that the calls can't be merged
+        uint64_t start = time_ns();
+        for (size_t i = 0; i < num_iters; ++i)
+            sum += wyhash(buf + (i & 7), len, i);
+        uint64_t time = time_ns() - start;
+
+        printf(
+            "hash %7zu bytes: %6.3f ns/byte, %8.1f ns/key (sum %04lx)\n",
+            len,
+            (double)time / ((double)num_iters * len),
+            (double)time / num_iters,
+            (unsigned long)(sum & 0xFFFF)
+        );
+    }
+
+    const size_t intern_lens[] = { 8, 64, 1024 };
+
+    for (size_t k = 0; k < sizeof(intern_lens) / sizeof(intern_lens[0]); ++k)
+    {
+        size_t len = intern_lens[k];
+        size_t num_strs = (1 << 20) / len;
+        if (num_strs > 16384)
+            num_strs = 16384;
+
+        // Make distinct keys, and a second copy of each one which is
+        // neither interned nor hashed, to be looked up in the table
+        string_t** fresh = malloc(num_strs * sizeof(string_t*));
+        string_t** copies = malloc(num_strs * sizeof(string_t*));
+        for (size_t i = 0; i < num_strs; ++i)
+        {
+            char* key = buf + (i * 61) % (buf_len - len);
+            uint32_t key_idx = i;
+            memcpy(key, &key_idx, sizeof(key_idx));
+            fresh[i] = string_from_bytes(key, len);
+            copies[i] = string_from_bytes(key, len);
+        }
+
+        uint64_t insert_time = bench_intern_pass(fresh, num_strs);
+        uint64_t lookup_time = bench_intern_pass(copies, num_strs);
+
+        for (size_t i = 0; i < num_strs; ++i)
+            assert (vm_get_tbl_str(copies[i]) == fresh[i]);
+
+        printf(
+            "intern %4zu bytes: insert %6.3f ns/byte, lookup %6.3f ns/byte, "
+            "%6.1f ns/key\n",
+            len,
+            (double)insert_time / ((double)num_strs * len),
+            (double)lookup_time / ((double)num_strs * len),
+            (double)lookup_time / num_strs
+        );
+
+        free(fresh);
+        free(copies);
+    }
+
+    free(buf);
+}
@@ -19,6 +19,8 @@ typedef struct array array_t;
 typedef struct string string_t;
 typedef struct shape shape_t;
 typedef struct object object_t;
+typedef struct map map_t;
+typedef struct strbuf strbuf_t;
 typedef struct ast_decl ast_decl_t;
 typedef struct ast_fun ast_fun_t;
 typedef struct cell cell_t;
@@ -42,6 +44,8 @@ typedef union
     string_t* string;
     shape_t* shape;
     object_t* object;
+    map_t* map;
+    strbuf_t* strbuf;
 
     ast_fun_t* fun;
     ast_decl_t* decl;
@@ -85,6 +89,9 @@ typedef struct
     /// Number of strings allocated
     uint32_t num_strings;
 
+    /// Interned single-byte strings, indexed by byte value
+    string_t* char_strs[256];
+
     /// Empty object shape
     shape_t* empty_shape;
 
@@ -97,24 +104,51 @@ typedef struct
     /// Global scope closure
     clos_t* global_clos;
 
+    /// Global unit function, its variables live in the global slots
+    ast_fun_t* global_fun;
+
+    /// Global variable slots, indexed by declaration index
+    /// This table is allocated once and never moves
+    value_t* global_slots;
+    uint32_t num_globals;
+
 } vm_t;
 
 /**
 String (heap object)
+
+Strings are either interned in the string table, in which case equal
+strings are the same object, or data strings, such as lines of input,
+which are not. Data strings are hashed only when needed, and interned on
+demand when used as property names.
+
+Slices are strings whose characters are a view into another string. Their
+characters are copied out only when a null-terminated string is needed,
+or when they get interned.
 */
 typedef struct string
 {
     shapeidx_t shape;
 
-    /// String hash
+    /// String hash, valid if the STR_HASHED flag is set
     uint32_t hash;
 
     /// String length (excluding null terminator)
     uint32_t len;
 
-    /// Character data, variable length
-    /// UTF-8 formatting, with null-terminator character
-    char data[];
+    /// String flags (STR_INTERNED, STR_HASHED)
+    uint8_t flags;
+
+    /// Character data, UTF-8 formatting
+    /// Points to the inline characters, null-terminated, or into the
+    /// characters of the parent string for slices
+    char* data;
+
+    /// String holding the characters of a slice, NULL otherwise
+    string_t* parent;
+
+    /// Inline characters, variable length, with null-terminator character
+    char chars[];
 
 } string_t;
 
@@ -196,6 +230,73 @@ typedef struct object
 
 } object_t;
 
+/**
+Key/value slot of a hash map
+*/
+typedef struct
+{
+    value_t key;
+
+    value_t val;
+
+} map_slot_t;
+
+/**
+Hash map (dictionary) heap object
+
+Keys of any type are hashed into an open addressing table. Each slot has
+a control byte, which is either empty, deleted or holds 7 bits of the
+key hash. Lookups compare the control bytes of a whole group of slots at
+once, and only look at the keys of the slots whose hash bits match.
+
+The slot table is allocated outside of the hosted heap, so that the old
+table can be freed when the map grows.
+*/
+typedef struct map
+{
+    shapeidx_t shape;
+
+    /// Number of slots, a power of two multiple of the group size
+    uint32_t cap;
+
+    /// Number of keys
+    uint32_t len;
+
+    /// Number of deleted slots, counted in the load factor
+    uint32_t num_deleted;
+
+    /// Control bytes, one per slot, followed by the slots
+    uint8_t* ctrl;
+    map_slot_t* slots;
+
+} map_t;
+
+/**
+String builder, a growable character buffer
+
+Appending takes amortized constant time per character. The characters
+are copied into a string only when the contents are requested, and that
+string is reused until more characters are appended. Like map tables,
+the buffer is allocated outside of the hosted heap.
+*/
+typedef struct strbuf
+{
+    shapeidx_t shape;
+
+    /// Number of characters
+    uint32_t len;
+
+    /// Buffer capacity
+    uint32_t cap;
+
+    /// Character buffer
+    char* buf;
+
+    /// String holding the current contents, NULL if not created yet
+    string_t* str;
+
+} strbuf_t;
+
 /// Value type tags
 /// Note: the value false is (0, 0)
 #define TAG_BOOL        0
@@ -207,15 +308,34 @@ typedef struct object
 #define TAG_OBJECT      6
 #define TAG_CLOS        7
 #define TAG_HOSTFN      8
+#define TAG_MAP         9
+#define TAG_STRBUF      10
 
 /// Initial VM heap size
 #define HEAP_SIZE (1 << 24)
 
+/// String flags
+#define STR_INTERNED    (1 << 0)
+#define STR_HASHED      (1 << 1)
+
 /// String table parameters
 #define STR_TBL_INIT_SIZE       16384
 #define STR_TBL_MAX_LOAD_NUM    3
 #define STR_TBL_MAX_LOAD_DEN    5
 
+/// Seed of the string hash function
+#define STR_HASH_SEED           1337
+
+/// Hash map parameters, the maximum load includes deleted slots
+#define MAP_GROUP_SIZE      16
+#define MAP_MIN_CAP         MAP_GROUP_SIZE
+#define MAP_MAX_LOAD_NUM    7
+#define MAP_MAX_LOAD_DEN    8
+
+/// Hash map control bytes, full slots hold 7 bits of the key hash
+#define MAP_CTRL_EMPTY      0x80
+#define MAP_CTRL_DELETED    0xFE
+
 /// Guaranteed minimum object capacity, in bytes
 /// This is the total object size
 #define OBJ_MIN_CAP 128
@@ -246,6 +366,12 @@ extern shapeidx_t SHAPE_ARRAY;
 /// Shape of string objects
 extern shapeidx_t SHAPE_STRING;
 
+/// Shape of hash map objects
+extern shapeidx_t SHAPE_MAP;
+
+/// Shape of string builder objects
+extern shapeidx_t SHAPE_STRBUF;
+
 /// Boolean constant values
 const value_t VAL_FALSE;
 const value_t VAL_TRUE;
@@ -260,11 +386,23 @@ shapeidx_t get_shape(heapptr_t obj);
 
 void init_vm();
 heapptr_t vm_alloc(uint32_t size, shapeidx_t shape);
+void vm_grow_str_tbl();
 string_t* vm_get_tbl_str(string_t* str);
+string_t* vm_get_str(const char* data, uint32_t len);
 string_t* vm_get_cstr(const char* cstr);
 
 string_t* string_alloc(uint32_t len);
+string_t* string_from_bytes(const char* data, uint32_t len);
+string_t* string_slice(string_t* str, uint32_t start, uint32_t len);
+void string_flatten(string_t* str);
 char* string_cstr(string_t* str);
+int string_compare(string_t* stra, string_t* strb);
+int64_t string_index_of(string_t* str, string_t* needle, uint32_t from);
+int64_t string_count(string_t* str, string_t* needle);
+array_t* string_split(string_t* str, string_t* sep);
+bool string_starts_with(string_t* str, string_t* prefix);
+uint32_t string_hash(string_t* str);
+bool string_equals(string_t* stra, string_t* strb);
 
 array_t* array_alloc(uint32_t cap);
 void array_set(array_t* array, uint32_t idx, value_t val);
@@ -304,7 +442,20 @@ value_t object_get_prop(
     string_t* prop_name
 );
 
+strbuf_t* strbuf_alloc(uint32_t cap);
+void strbuf_append(strbuf_t* sb, const char* data, uint32_t len);
+string_t* strbuf_to_string(strbuf_t* sb);
+
+map_t* map_alloc(uint32_t cap);
+uint32_t map_find(map_t* map, value_t key);
+bool map_get(map_t* map, value_t key, value_t* val);
+void map_set(map_t* map, value_t key, value_t val);
+bool map_has(map_t* map, value_t key);
+bool map_delete(map_t* map, value_t key);
+uint32_t map_next(map_t* map, uint32_t idx);
+
 void test_vm();
+void bench_vm();
 
 #endif
 